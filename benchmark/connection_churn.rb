@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+# Connection churn benchmark
+#
+# Compares allocating a fresh Server/Client per connection against recycling
+# one instance with #reset.
+#
+#   ruby -Ilib benchmark/connection_churn.rb [iterations]
+
+require "benchmark"
+require "nghttp3"
+
+ITERATIONS = Integer(ARGV[0] || 20_000)
+
+def measure(label)
+  GC.start
+  gc_count = GC.count
+  gc_time = GC.stat(:time)
+  allocated = GC.stat(:total_allocated_objects)
+  elapsed = Benchmark.realtime { yield }
+  printf("%-16s %8.1f conn/s  %10d objects  %4d GCs  %6d ms GC\n",
+    label,
+    ITERATIONS / elapsed,
+    GC.stat(:total_allocated_objects) - allocated,
+    GC.count - gc_count,
+    GC.stat(:time) - gc_time)
+end
+
+def churn(endpoint)
+  endpoint.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+  endpoint.pump_writes { |_, data, _| data.bytesize }
+  endpoint.close
+end
+
+measure("server new") do
+  ITERATIONS.times { churn(Nghttp3::Server.new) }
+end
+
+server = Nghttp3::Server.new
+measure("server reset") do
+  ITERATIONS.times { churn(server.reset) }
+end
+
+measure("client new") do
+  ITERATIONS.times do
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.close
+  end
+end
+
+client = Nghttp3::Client.new
+measure("client reset") do
+  ITERATIONS.times do
+    client.reset
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.close
+  end
+end
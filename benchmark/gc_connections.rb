@@ -0,0 +1,55 @@
+# frozen_string_literal: true
+
+# Minor GC cost of long-lived connections
+#
+# Keeps many servers alive, each with a connection, callbacks, a QPACK
+# decoder and a router, until they are promoted to the old generation, then
+# churns short-lived garbage and reports how long each minor GC takes. An
+# object that is not write-barrier protected stays in the remembered set
+# and is re-marked on every minor GC, so the minor GC time grows with the
+# number of live connections unless every type is protected.
+#
+#   ruby -Ilib benchmark/gc_connections.rb [connections] [minor_gcs]
+
+require "benchmark"
+require "nghttp3"
+
+CONNECTIONS = Integer(ARGV[0] || 10_000)
+MINOR_GCS = Integer(ARGV[1] || 200)
+
+def build(count)
+  Array.new(count) do
+    server = Nghttp3::Server.new
+    server.route("GET", "/items/:id") { |_request, response| response.status = 200 }
+    server.on_request { |_request, response| response.status = 404 }
+    connection = server.connection
+    connection.assemble_header(0, ":method", "GET")
+    connection.assemble_header(0, ":path", "/items/1")
+    [server, Nghttp3::QPACK::Decoder.new(4096, 16)]
+  end
+end
+
+def measure(label, live)
+  # Promote everything that is alive to the old generation
+  4.times { GC.start }
+  gc_time = GC.stat(:time)
+  minor = GC.stat(:minor_gc_count)
+
+  elapsed = Benchmark.realtime do
+    MINOR_GCS.times do
+      200.times { +"garbage" }
+      GC.start(full_mark: false)
+    end
+  end
+
+  count = GC.stat(:minor_gc_count) - minor
+  printf("%-18s %8d live  %7.3fms/minor GC  %7.1fms total\n",
+    label,
+    live.size,
+    (GC.stat(:time) - gc_time).fdiv(count),
+    elapsed * 1000)
+end
+
+measure("baseline", [])
+live = build(CONNECTIONS)
+measure("connections", live)
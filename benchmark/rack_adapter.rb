@@ -0,0 +1,82 @@
+# frozen_string_literal: true
+
+# Rack adapter benchmark
+#
+# Serves a small Rack application over the in-process loopback transport and
+# compares a handler that builds a full env Hash and buffers the body array
+# per request against RackAdapter with lazy headers and env reuse. The
+# handler-only rows call each handler directly, without the connection.
+#
+#   ruby -Ilib benchmark/rack_adapter.rb [requests]
+
+require "benchmark"
+require "stringio"
+require "nghttp3"
+
+REQUESTS = Integer(ARGV[0] || 20_000)
+HEADERS = {"user-agent" => "bench", "accept" => "*/*", "accept-encoding" => "gzip", "cookie" => "session=1"}.freeze
+APP = ->(env) { [200, {"content-type" => "text/plain"}, ["hello ", env["PATH_INFO"]]] }
+
+# Straightforward bridge: eager env, every header copied, body joined
+EAGER = lambda do |request, response|
+  path, query = request.path.split("?", 2)
+  env = {
+    "REQUEST_METHOD" => request.method,
+    "SCRIPT_NAME" => "",
+    "PATH_INFO" => path,
+    "QUERY_STRING" => query || "",
+    "SERVER_NAME" => request.authority.to_s,
+    "SERVER_PORT" => "443",
+    "SERVER_PROTOCOL" => "HTTP/3",
+    "rack.url_scheme" => request.scheme,
+    "rack.input" => StringIO.new(request.body || ""),
+    "rack.errors" => $stderr
+  }
+  request.headers.each { |name, value| env["HTTP_#{name.upcase.tr("-", "_")}"] = value }
+  status, headers, body = APP.call(env)
+  response.status = status
+  headers.each { |name, value| response.headers[name] = value }
+  buffer = +""
+  body.each { |chunk| buffer << chunk }
+  response.body = buffer
+end
+
+def measure_handler(label, handler)
+  request = Nghttp3::Request.new(method: "GET", path: "/bench", authority: "localhost", headers: HEADERS)
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  elapsed = Benchmark.realtime do
+    REQUESTS.times { handler.call(request, Nghttp3::Response.new(stream_id: 0)) }
+  end
+  printf("%-18s %10.1f req/s  %8.1f objects/req\n",
+    label,
+    REQUESTS / elapsed,
+    (GC.stat(:total_allocated_objects) - allocated).fdiv(REQUESTS))
+end
+
+def measure(label, handler)
+  server = Nghttp3::Server.new
+  server.on_request(&handler)
+  loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+  loopback.pump
+  client = loopback.client
+
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  elapsed = Benchmark.realtime do
+    REQUESTS.times do
+      stream_id = client.get("https://localhost/bench", headers: HEADERS)
+      loopback.pump
+      client.responses.delete(stream_id)
+    end
+  end
+  printf("%-18s %10.1f req/s  %8.1f objects/req\n",
+    label,
+    REQUESTS / elapsed,
+    (GC.stat(:total_allocated_objects) - allocated).fdiv(REQUESTS))
+end
+
+measure_handler("eager handler", EAGER)
+measure_handler("adapter handler", Nghttp3::RackAdapter.new(APP))
+measure("eager loopback", EAGER)
+measure("adapter loopback", Nghttp3::RackAdapter.new(APP))
@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+# Request/response pooling benchmark
+#
+# Runs the server side of many short keep-alive requests with and without a
+# RequestPool and reports throughput, allocations and GC time. The lifecycle
+# rows feed each request's header fields through Connection#assemble_header
+# and the Server's stream events, without the connection; the loopback rows
+# send real requests from a Client over the in-process transport.
+#
+#   ruby -Ilib benchmark/server_pool.rb [requests]
+
+require "benchmark"
+require "nghttp3"
+
+REQUESTS = Integer(ARGV[0] || 50_000)
+HEADERS = {"user-agent" => "bench", "accept" => "*/*", "accept-encoding" => "gzip", "cookie" => "session=1"}.freeze
+FIELDS = {":method" => "GET", ":scheme" => "https", ":authority" => "localhost", ":path" => "/bench"}
+  .merge(HEADERS).to_a.freeze
+BODY = "hello"
+
+HANDLER = lambda do |_request, response|
+  response.status = 200
+  response.headers["content-type"] = "text/plain"
+  response.body = BODY
+end
+
+def report(label)
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  gc_time = GC.stat(:time)
+  gc_count = GC.count
+  elapsed = Benchmark.realtime { yield }
+  printf("%-18s %10.1f req/s  %8.1f objects/req  %4d GCs  %7.1fms GC\n",
+    label,
+    REQUESTS / elapsed,
+    (GC.stat(:total_allocated_objects) - allocated).fdiv(REQUESTS),
+    GC.count - gc_count,
+    GC.stat(:time) - gc_time)
+end
+
+def measure_lifecycle(label, pool)
+  server = Nghttp3::Server.new(pool: pool)
+  server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+  server.on_request(&HANDLER)
+  connection = server.connection
+
+  report(label) do
+    REQUESTS.times do |i|
+      # A bounded set of concurrent streams, as on a keep-alive connection
+      stream_id = (i % 100) * 4
+      server.send(:on_begin_headers, stream_id)
+      FIELDS.each { |name, value| connection.assemble_header(stream_id, name, value) }
+      server.send(:on_end_headers, stream_id, true)
+      server.send(:on_stream_close, stream_id, 0)
+      server.requests.delete(stream_id)
+      server.responses.delete(stream_id)
+    end
+  end
+end
+
+def measure_loopback(label, pool)
+  server = Nghttp3::Server.new(pool: pool)
+  server.on_request(&HANDLER)
+  loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+  loopback.pump
+  client = loopback.client
+
+  report(label) do
+    REQUESTS.times do
+      stream_id = client.get("https://localhost/bench", headers: HEADERS)
+      loopback.pump
+      client.responses.delete(stream_id)
+      server.requests.delete(stream_id)
+      server.responses.delete(stream_id)
+    end
+  end
+end
+
+measure_lifecycle("lifecycle", nil)
+measure_lifecycle("lifecycle pooled", true)
+measure_loopback("loopback", nil)
+measure_loopback("loopback pooled", true)
@@ -0,0 +1,42 @@
+# frozen_string_literal: true
+
+# Batch request submission benchmark
+#
+# Submits fan-out batches of GET requests through Client#submit one at a
+# time and through Client#submit_all, then drains the connection with
+# pump_writes, and reports throughput and allocations per request. Each
+# batch runs on a fresh connection so stream limits never interfere.
+#
+#   ruby -Ilib benchmark/submit_all.rb [batches] [batch_size]
+
+require "benchmark"
+require "nghttp3"
+
+BATCHES = Integer(ARGV[0] || 200)
+BATCH_SIZE = Integer(ARGV[1] || 250)
+HEADERS = {"user-agent" => "bench", "accept" => "*/*", "accept-encoding" => "gzip"}.freeze
+REQUESTS = Array.new(BATCH_SIZE) { |i| Nghttp3::Request.get("https://localhost/items/#{i}", headers: HEADERS) }.freeze
+
+def report(label)
+  client = Nghttp3::Client.new
+  total = BATCHES * BATCH_SIZE
+  allocated = 0
+  elapsed = 0.0
+
+  BATCHES.times do
+    client.reset
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    GC.start
+    before = GC.stat(:total_allocated_objects)
+    elapsed += Benchmark.realtime do
+      yield client
+      client.pump_writes
+    end
+    allocated += GC.stat(:total_allocated_objects) - before
+  end
+
+  printf("%-12s %10.1f req/s  %8.1f objects/req\n", label, total / elapsed, allocated.fdiv(total))
+end
+
+report("submit") { |client| REQUESTS.each { |request| client.submit(request) } }
+report("submit_all") { |client| client.submit_all(REQUESTS) }
@@ -20,6 +20,7 @@ VALUE rb_eNghttp3StreamDataOverflowError;
 VALUE rb_eNghttp3FatalError;
 VALUE rb_eNghttp3NoMemError;
 VALUE rb_eNghttp3CallbackFailureError;
+VALUE rb_eNghttp3ExcessiveLoadError;
 
 /*
  * call-seq:
@@ -114,6 +115,48 @@ VALUE nghttp3_rb_error_class_for_code(int error_code) {
   }
 }
 
+/*
+ * Returns a Symbol naming the given nghttp3 error code, or nil for 0. Used by
+ * the *_nonblock methods, which report errors without raising.
+ */
+VALUE nghttp3_rb_error_symbol(int error_code) {
+  switch (error_code) {
+  case 0:
+    return Qnil;
+  case NGHTTP3_ERR_INVALID_ARGUMENT:
+    return ID2SYM(rb_intern("invalid_argument"));
+  case NGHTTP3_ERR_INVALID_STATE:
+    return ID2SYM(rb_intern("invalid_state"));
+  case NGHTTP3_ERR_WOULDBLOCK:
+    return ID2SYM(rb_intern("wouldblock"));
+  case NGHTTP3_ERR_STREAM_IN_USE:
+    return ID2SYM(rb_intern("stream_in_use"));
+  case NGHTTP3_ERR_MALFORMED_HTTP_HEADER:
+    return ID2SYM(rb_intern("malformed_http_header"));
+  case NGHTTP3_ERR_MALFORMED_HTTP_MESSAGING:
+    return ID2SYM(rb_intern("malformed_http_messaging"));
+  case NGHTTP3_ERR_QPACK_FATAL:
+    return ID2SYM(rb_intern("qpack_fatal"));
+  case NGHTTP3_ERR_QPACK_HEADER_TOO_LARGE:
+    return ID2SYM(rb_intern("qpack_header_too_large"));
+  case NGHTTP3_ERR_STREAM_NOT_FOUND:
+    return ID2SYM(rb_intern("stream_not_found"));
+  case NGHTTP3_ERR_CONN_CLOSING:
+    return ID2SYM(rb_intern("conn_closing"));
+  case NGHTTP3_ERR_STREAM_DATA_OVERFLOW:
+    return ID2SYM(rb_intern("stream_data_overflow"));
+  case NGHTTP3_ERR_NOMEM:
+    return ID2SYM(rb_intern("nomem"));
+  case NGHTTP3_ERR_CALLBACK_FAILURE:
+    return ID2SYM(rb_intern("callback_failure"));
+  default:
+    if (nghttp3_err_is_fatal(error_code)) {
+      return ID2SYM(rb_intern("fatal"));
+    }
+    return ID2SYM(rb_intern("error"));
+  }
+}
+
 /*
  * Raises an appropriate Ruby exception for the given nghttp3 error code.
  */
@@ -285,6 +328,8 @@ RUBY_FUNC_EXPORTED void Init_nghttp3(void) {
       rb_define_class_under(rb_mNghttp3, "NoMemError", rb_eNghttp3Error);
   rb_eNghttp3CallbackFailureError = rb_define_class_under(
       rb_mNghttp3, "CallbackFailureError", rb_eNghttp3Error);
+  rb_eNghttp3ExcessiveLoadError = rb_define_class_under(
+      rb_mNghttp3, "ExcessiveLoadError", rb_eNghttp3FatalError);
 
   /* Define error utility methods */
   rb_define_singleton_method(rb_mNghttp3, "err_is_fatal?",
@@ -297,4 +342,7 @@ RUBY_FUNC_EXPORTED void Init_nghttp3(void) {
   Init_nghttp3_callbacks();
   Init_nghttp3_connection();
   Init_nghttp3_qpack();
+  Init_nghttp3_router();
+  Init_nghttp3_metrics();
+  Init_nghttp3_string_cache();
 }
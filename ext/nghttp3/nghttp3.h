@@ -23,12 +23,16 @@ extern VALUE rb_eNghttp3StreamDataOverflowError;
 extern VALUE rb_eNghttp3FatalError;
 extern VALUE rb_eNghttp3NoMemError;
 extern VALUE rb_eNghttp3CallbackFailureError;
+extern VALUE rb_eNghttp3ExcessiveLoadError;
 
 /* Data structure classes */
 extern VALUE rb_cNghttp3Settings;
 extern VALUE rb_cNghttp3NV;
 extern VALUE rb_cNghttp3Connection;
 extern VALUE rb_cNghttp3Callbacks;
+extern VALUE rb_cNghttp3Router;
+extern VALUE rb_cNghttp3Metrics;
+extern VALUE rb_mNghttp3StringCache;
 
 /* QPACK module and classes */
 extern VALUE rb_mNghttp3QPACK;
@@ -44,6 +48,7 @@ extern const rb_data_type_t callbacks_data_type;
 /* Helper functions */
 VALUE nghttp3_rb_error_class_for_code(int error_code);
 void nghttp3_rb_raise(int error_code, const char *fmt, ...);
+VALUE nghttp3_rb_error_symbol(int error_code);
 
 /* Settings helper */
 nghttp3_settings *nghttp3_rb_get_settings(VALUE rb_settings);
@@ -51,9 +56,113 @@ nghttp3_settings *nghttp3_rb_get_settings(VALUE rb_settings);
 /* NV helper */
 nghttp3_nv nghttp3_rb_nv_to_c(VALUE rb_nv);
 
+/*
+ * nghttp3 is given the address of the Connection's own VALUE as
+ * conn_user_data, so the object can move under GC.compact.
+ */
+static inline VALUE nghttp3_rb_conn_from_user_data(void *conn_user_data) {
+  return *(VALUE *)conn_user_data;
+}
+
 /* Callbacks helper */
 VALUE nghttp3_rb_get_callbacks(VALUE rb_conn);
 void nghttp3_rb_setup_callbacks(nghttp3_callbacks *callbacks);
+void nghttp3_rb_notify_deferred_consume(VALUE rb_conn, int64_t stream_id,
+                                        size_t consumed);
+void nghttp3_rb_notify_stream_rejected(VALUE rb_conn, int64_t stream_id,
+                                       uint64_t app_error_code);
+
+/* Memory budget helpers (called from callbacks) */
+int nghttp3_rb_memory_admit_stream(VALUE rb_conn, int64_t stream_id,
+                                   void *stream_user_data);
+int nghttp3_rb_stream_rejected_p(VALUE rb_conn, int64_t stream_id,
+                                 void *stream_user_data);
+void nghttp3_rb_memory_on_recv_header(VALUE rb_conn, int64_t stream_id,
+                                      void *stream_user_data, size_t n);
+int nghttp3_rb_memory_on_recv_data(VALUE rb_conn, int64_t stream_id,
+                                   void *stream_user_data, size_t n);
+void nghttp3_rb_memory_on_acked(VALUE rb_conn, int64_t stream_id,
+                                void *stream_user_data, uint64_t datalen);
+void nghttp3_rb_memory_on_stream_close(VALUE rb_conn, int64_t stream_id,
+                                       void *stream_user_data);
+
+/* Hierarchical timer wheel (1ms ticks) */
+#define NGHTTP3_RB_WHEEL_BITS 6
+#define NGHTTP3_RB_WHEEL_SLOTS (1 << NGHTTP3_RB_WHEEL_BITS)
+#define NGHTTP3_RB_WHEEL_LEVELS 4
+
+typedef struct nghttp3_rb_timer {
+  struct nghttp3_rb_timer *prev;
+  struct nghttp3_rb_timer *next;
+  uint64_t expiry;
+  int64_t stream_id;
+  int kind;
+  int armed;
+  int level;
+  int slot;
+} nghttp3_rb_timer;
+
+typedef struct {
+  nghttp3_rb_timer *slots[NGHTTP3_RB_WHEEL_LEVELS][NGHTTP3_RB_WHEEL_SLOTS];
+  uint64_t bitmap[NGHTTP3_RB_WHEEL_LEVELS];
+  uint64_t now;
+  size_t count;
+} nghttp3_rb_timer_wheel;
+
+typedef void (*nghttp3_rb_timer_expire_cb)(nghttp3_rb_timer *timer,
+                                           void *arg);
+
+void nghttp3_rb_timer_wheel_init(nghttp3_rb_timer_wheel *wheel, uint64_t now);
+void nghttp3_rb_timer_init(nghttp3_rb_timer *timer, int64_t stream_id,
+                           int kind);
+void nghttp3_rb_timer_wheel_arm(nghttp3_rb_timer_wheel *wheel,
+                                nghttp3_rb_timer *timer, uint64_t expiry);
+void nghttp3_rb_timer_wheel_cancel(nghttp3_rb_timer_wheel *wheel,
+                                   nghttp3_rb_timer *timer);
+size_t nghttp3_rb_timer_wheel_advance(nghttp3_rb_timer_wheel *wheel,
+                                      uint64_t to,
+                                      nghttp3_rb_timer_expire_cb cb,
+                                      void *arg);
+int nghttp3_rb_timer_wheel_next_expiry(const nghttp3_rb_timer_wheel *wheel,
+                                       uint64_t *pexpiry);
+uint64_t nghttp3_rb_monotonic_ns(void);
+uint64_t nghttp3_rb_monotonic_ms(void);
+
+/* Per-stream timers (called from callbacks) */
+typedef enum {
+  NGHTTP3_RB_STREAM_EVENT_BEGIN_HEADERS,
+  NGHTTP3_RB_STREAM_EVENT_END_HEADERS,
+  NGHTTP3_RB_STREAM_EVENT_RECV_DATA,
+  NGHTTP3_RB_STREAM_EVENT_END_STREAM,
+  NGHTTP3_RB_STREAM_EVENT_CLOSE
+} nghttp3_rb_stream_event;
+
+void nghttp3_rb_stream_timers_on(VALUE rb_conn, int64_t stream_id,
+                                 void *stream_user_data,
+                                 nghttp3_rb_stream_event event);
+
+/* Process-wide cache of frozen header value Strings */
+VALUE nghttp3_rb_interned_bytes(const void *p, size_t len);
+VALUE nghttp3_rb_header_string(const uint8_t *p, size_t len);
+
+/* Request assembly (called from callbacks) */
+int nghttp3_rb_assemble_header(VALUE rb_conn, int64_t stream_id,
+                               void *stream_user_data, nghttp3_rcbuf *name,
+                               nghttp3_rcbuf *value);
+int nghttp3_rb_assemble_data(VALUE rb_conn, int64_t stream_id,
+                             void *stream_user_data, const uint8_t *data,
+                             size_t datalen);
+
+/* Stream abuse counters (called from callbacks) */
+typedef enum {
+  NGHTTP3_RB_ABUSE_OPEN,
+  NGHTTP3_RB_ABUSE_RESET,
+  NGHTTP3_RB_ABUSE_STOP_SENDING,
+  NGHTTP3_RB_ABUSE_CANCEL,
+  NGHTTP3_RB_ABUSE_MAX
+} nghttp3_rb_abuse_event;
+
+int nghttp3_rb_abuse_on(VALUE rb_conn, nghttp3_rb_abuse_event event);
 
 /* Init functions */
 void Init_nghttp3_settings(void);
@@ -61,5 +170,8 @@ void Init_nghttp3_nv(void);
 void Init_nghttp3_connection(void);
 void Init_nghttp3_callbacks(void);
 void Init_nghttp3_qpack(void);
+void Init_nghttp3_router(void);
+void Init_nghttp3_metrics(void);
+void Init_nghttp3_string_cache(void);
 
 #endif /* NGHTTP3_RUBY_H */
@@ -2,6 +2,48 @@
 
 VALUE rb_cNghttp3Callbacks;
 
+/* Events in the order of the handler method names below */
+enum {
+  CALLBACK_ACKED_STREAM_DATA,
+  CALLBACK_STREAM_CLOSE,
+  CALLBACK_RECV_DATA,
+  CALLBACK_DEFERRED_CONSUME,
+  CALLBACK_BEGIN_HEADERS,
+  CALLBACK_RECV_HEADER,
+  CALLBACK_END_HEADERS,
+  CALLBACK_BEGIN_TRAILERS,
+  CALLBACK_RECV_TRAILER,
+  CALLBACK_END_TRAILERS,
+  CALLBACK_STOP_SENDING,
+  CALLBACK_END_STREAM,
+  CALLBACK_RESET_STREAM,
+  CALLBACK_SHUTDOWN,
+  CALLBACK_RECV_SETTINGS,
+  CALLBACK_STREAM_REJECTED,
+  CALLBACK_MAX
+};
+
+static const char *handler_method_names[CALLBACK_MAX] = {
+    "on_acked_stream_data",
+    "on_stream_close",
+    "on_recv_data",
+    "on_deferred_consume",
+    "on_begin_headers",
+    "on_recv_header",
+    "on_end_headers",
+    "on_begin_trailers",
+    "on_recv_trailer",
+    "on_end_trailers",
+    "on_stop_sending",
+    "on_end_stream",
+    "on_reset_stream",
+    "on_shutdown",
+    "on_recv_settings",
+    "on_stream_rejected",
+};
+
+static ID handler_method_ids[CALLBACK_MAX];
+
 typedef struct {
   VALUE on_acked_stream_data;
   VALUE on_stream_close;
@@ -18,25 +60,51 @@ typedef struct {
   VALUE on_reset_stream;
   VALUE on_shutdown;
   VALUE on_recv_settings;
+  VALUE on_stream_rejected;
+  VALUE handler;                /* receives events without a proc, or Qnil */
+  unsigned int handler_methods; /* bit per event the handler responds to */
 } CallbacksObj;
 
 static void callbacks_mark(void *ptr) {
   CallbacksObj *obj = (CallbacksObj *)ptr;
-  rb_gc_mark(obj->on_acked_stream_data);
-  rb_gc_mark(obj->on_stream_close);
-  rb_gc_mark(obj->on_recv_data);
-  rb_gc_mark(obj->on_deferred_consume);
-  rb_gc_mark(obj->on_begin_headers);
-  rb_gc_mark(obj->on_recv_header);
-  rb_gc_mark(obj->on_end_headers);
-  rb_gc_mark(obj->on_begin_trailers);
-  rb_gc_mark(obj->on_recv_trailer);
-  rb_gc_mark(obj->on_end_trailers);
-  rb_gc_mark(obj->on_stop_sending);
-  rb_gc_mark(obj->on_end_stream);
-  rb_gc_mark(obj->on_reset_stream);
-  rb_gc_mark(obj->on_shutdown);
-  rb_gc_mark(obj->on_recv_settings);
+  rb_gc_mark_movable(obj->on_acked_stream_data);
+  rb_gc_mark_movable(obj->on_stream_close);
+  rb_gc_mark_movable(obj->on_recv_data);
+  rb_gc_mark_movable(obj->on_deferred_consume);
+  rb_gc_mark_movable(obj->on_begin_headers);
+  rb_gc_mark_movable(obj->on_recv_header);
+  rb_gc_mark_movable(obj->on_end_headers);
+  rb_gc_mark_movable(obj->on_begin_trailers);
+  rb_gc_mark_movable(obj->on_recv_trailer);
+  rb_gc_mark_movable(obj->on_end_trailers);
+  rb_gc_mark_movable(obj->on_stop_sending);
+  rb_gc_mark_movable(obj->on_end_stream);
+  rb_gc_mark_movable(obj->on_reset_stream);
+  rb_gc_mark_movable(obj->on_shutdown);
+  rb_gc_mark_movable(obj->on_recv_settings);
+  rb_gc_mark_movable(obj->on_stream_rejected);
+  rb_gc_mark_movable(obj->handler);
+}
+
+static void callbacks_compact(void *ptr) {
+  CallbacksObj *obj = (CallbacksObj *)ptr;
+  obj->on_acked_stream_data = rb_gc_location(obj->on_acked_stream_data);
+  obj->on_stream_close = rb_gc_location(obj->on_stream_close);
+  obj->on_recv_data = rb_gc_location(obj->on_recv_data);
+  obj->on_deferred_consume = rb_gc_location(obj->on_deferred_consume);
+  obj->on_begin_headers = rb_gc_location(obj->on_begin_headers);
+  obj->on_recv_header = rb_gc_location(obj->on_recv_header);
+  obj->on_end_headers = rb_gc_location(obj->on_end_headers);
+  obj->on_begin_trailers = rb_gc_location(obj->on_begin_trailers);
+  obj->on_recv_trailer = rb_gc_location(obj->on_recv_trailer);
+  obj->on_end_trailers = rb_gc_location(obj->on_end_trailers);
+  obj->on_stop_sending = rb_gc_location(obj->on_stop_sending);
+  obj->on_end_stream = rb_gc_location(obj->on_end_stream);
+  obj->on_reset_stream = rb_gc_location(obj->on_reset_stream);
+  obj->on_shutdown = rb_gc_location(obj->on_shutdown);
+  obj->on_recv_settings = rb_gc_location(obj->on_recv_settings);
+  obj->on_stream_rejected = rb_gc_location(obj->on_stream_rejected);
+  obj->handler = rb_gc_location(obj->handler);
 }
 
 static void callbacks_free(void *ptr) { xfree(ptr); }
@@ -52,8 +120,9 @@ const rb_data_type_t callbacks_data_type = {
             .dmark = callbacks_mark,
             .dfree = callbacks_free,
             .dsize = callbacks_memsize,
+            .dcompact = callbacks_compact,
         },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
 };
 
 static VALUE callbacks_alloc(VALUE klass) {
@@ -75,6 +144,9 @@ static VALUE callbacks_alloc(VALUE klass) {
   obj->on_reset_stream = Qnil;
   obj->on_shutdown = Qnil;
   obj->on_recv_settings = Qnil;
+  obj->on_stream_rejected = Qnil;
+  obj->handler = Qnil;
+  obj->handler_methods = 0;
   return self;
 }
 
@@ -86,6 +158,46 @@ static VALUE callbacks_alloc(VALUE klass) {
  */
 static VALUE rb_nghttp3_callbacks_initialize(VALUE self) { return self; }
 
+/*
+ * call-seq:
+ *   Callbacks.dispatch_to(handler) -> Callbacks
+ *
+ * Creates a Callbacks object that delivers each event by calling the method
+ * of the same name as the setter (on_recv_header, on_end_stream, ...) on
+ * handler, with the arguments the block would receive. Private methods are
+ * called too. Which methods exist is checked once here; events the handler
+ * does not respond to are skipped. A block set later takes precedence over
+ * the handler method for its event.
+ */
+static VALUE rb_nghttp3_callbacks_s_dispatch_to(VALUE klass, VALUE handler) {
+  VALUE self = rb_class_new_instance(0, NULL, klass);
+  CallbacksObj *obj;
+  int i;
+
+  TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
+
+  RB_OBJ_WRITE(self, &obj->handler, handler);
+  for (i = 0; i < CALLBACK_MAX; i++) {
+    if (rb_obj_respond_to(handler, handler_method_ids[i], TRUE)) {
+      obj->handler_methods |= 1u << i;
+    }
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   callbacks.handler -> Object or nil
+ *
+ * Returns the object events are dispatched to, or nil.
+ */
+static VALUE rb_nghttp3_callbacks_handler(VALUE self) {
+  CallbacksObj *obj;
+  TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
+  return obj->handler;
+}
+
 /* Callback setters - each takes a block and stores it */
 
 /*
@@ -97,7 +209,7 @@ static VALUE rb_nghttp3_callbacks_initialize(VALUE self) { return self; }
 static VALUE rb_nghttp3_callbacks_on_acked_stream_data(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_acked_stream_data = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_acked_stream_data, rb_block_proc());
   return self;
 }
 
@@ -110,7 +222,7 @@ static VALUE rb_nghttp3_callbacks_on_acked_stream_data(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_stream_close(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_stream_close = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_stream_close, rb_block_proc());
   return self;
 }
 
@@ -123,7 +235,7 @@ static VALUE rb_nghttp3_callbacks_on_stream_close(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_recv_data(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_recv_data = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_recv_data, rb_block_proc());
   return self;
 }
 
@@ -136,7 +248,7 @@ static VALUE rb_nghttp3_callbacks_on_recv_data(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_deferred_consume(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_deferred_consume = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_deferred_consume, rb_block_proc());
   return self;
 }
 
@@ -149,7 +261,7 @@ static VALUE rb_nghttp3_callbacks_on_deferred_consume(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_begin_headers(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_begin_headers = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_begin_headers, rb_block_proc());
   return self;
 }
 
@@ -157,12 +269,13 @@ static VALUE rb_nghttp3_callbacks_on_begin_headers(VALUE self) {
  * call-seq:
  *   callbacks.on_recv_header { |stream_id, name, value, flags| ... } -> self
  *
- * Sets the callback for receiving headers.
+ * Sets the callback for receiving headers. The name and value are frozen
+ * and may be shared with other streams, see StringCache.
  */
 static VALUE rb_nghttp3_callbacks_on_recv_header(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_recv_header = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_recv_header, rb_block_proc());
   return self;
 }
 
@@ -175,7 +288,7 @@ static VALUE rb_nghttp3_callbacks_on_recv_header(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_end_headers(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_end_headers = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_end_headers, rb_block_proc());
   return self;
 }
 
@@ -188,7 +301,7 @@ static VALUE rb_nghttp3_callbacks_on_end_headers(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_begin_trailers(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_begin_trailers = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_begin_trailers, rb_block_proc());
   return self;
 }
 
@@ -196,12 +309,13 @@ static VALUE rb_nghttp3_callbacks_on_begin_trailers(VALUE self) {
  * call-seq:
  *   callbacks.on_recv_trailer { |stream_id, name, value, flags| ... } -> self
  *
- * Sets the callback for receiving trailers.
+ * Sets the callback for receiving trailers. The name and value are frozen
+ * and may be shared with other streams, see StringCache.
  */
 static VALUE rb_nghttp3_callbacks_on_recv_trailer(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_recv_trailer = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_recv_trailer, rb_block_proc());
   return self;
 }
 
@@ -214,7 +328,7 @@ static VALUE rb_nghttp3_callbacks_on_recv_trailer(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_end_trailers(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_end_trailers = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_end_trailers, rb_block_proc());
   return self;
 }
 
@@ -227,7 +341,7 @@ static VALUE rb_nghttp3_callbacks_on_end_trailers(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_stop_sending(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_stop_sending = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_stop_sending, rb_block_proc());
   return self;
 }
 
@@ -240,7 +354,7 @@ static VALUE rb_nghttp3_callbacks_on_stop_sending(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_end_stream(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_end_stream = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_end_stream, rb_block_proc());
   return self;
 }
 
@@ -253,7 +367,7 @@ static VALUE rb_nghttp3_callbacks_on_end_stream(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_reset_stream(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_reset_stream = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_reset_stream, rb_block_proc());
   return self;
 }
 
@@ -266,7 +380,7 @@ static VALUE rb_nghttp3_callbacks_on_reset_stream(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_shutdown(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_shutdown = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_shutdown, rb_block_proc());
   return self;
 }
 
@@ -279,18 +393,51 @@ static VALUE rb_nghttp3_callbacks_on_shutdown(VALUE self) {
 static VALUE rb_nghttp3_callbacks_on_recv_settings(VALUE self) {
   CallbacksObj *obj;
   TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
-  obj->on_recv_settings = rb_block_proc();
+  RB_OBJ_WRITE(self, &obj->on_recv_settings, rb_block_proc());
+  return self;
+}
+
+/*
+ * call-seq:
+ *   callbacks.on_stream_rejected { |stream_id, app_error_code| ... } -> self
+ *
+ * Sets the callback for streams the connection closed on its own: requests
+ * shed with reject_stream or by the memory budget. It runs after
+ * on_stream_close; nghttp3 has closed the stream, and the QUIC layer should
+ * reset it with app_error_code (RESET_STREAM and STOP_SENDING).
+ */
+static VALUE rb_nghttp3_callbacks_on_stream_rejected(VALUE self) {
+  CallbacksObj *obj;
+  TypedData_Get_Struct(self, CallbacksObj, &callbacks_data_type, obj);
+  RB_OBJ_WRITE(self, &obj->on_stream_rejected, rb_block_proc());
   return self;
 }
 
 /* C callback wrapper functions - called by nghttp3 */
 
+/* Non-zero if the event has a block or a handler method */
+static int callbacks_wants(const CallbacksObj *cb, int event, VALUE proc) {
+  return !NIL_P(proc) || (cb->handler_methods & (1u << event)) != 0;
+}
+
+static void callbacks_invoke(const CallbacksObj *cb, int event, VALUE proc,
+                             int argc, const VALUE *argv) {
+  if (!NIL_P(proc)) {
+    rb_proc_call(proc, rb_ary_new_from_values(argc, argv));
+  } else {
+    rb_funcallv(cb->handler, handler_method_ids[event], argc, argv);
+  }
+}
+
 static int nghttp3_rb_acked_stream_data_callback(nghttp3_conn *conn,
                                                  int64_t stream_id,
                                                  uint64_t datalen,
                                                  void *conn_user_data,
                                                  void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  nghttp3_rb_memory_on_acked(rb_conn, stream_id, stream_user_data, datalen);
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -299,43 +446,93 @@ static int nghttp3_rb_acked_stream_data_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_acked_stream_data))
+  if (!callbacks_wants(cb, CALLBACK_ACKED_STREAM_DATA,
+                       cb->on_acked_stream_data))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), ULL2NUM(datalen)};
-  rb_proc_call(cb->on_acked_stream_data, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_ACKED_STREAM_DATA,
+                   cb->on_acked_stream_data, 2, args);
 
   return 0;
 }
 
+typedef struct {
+  VALUE rb_conn;
+  int64_t stream_id;
+  uint64_t app_error_code;
+} stream_close_args;
+
+static VALUE callbacks_stream_close_body(VALUE arg) {
+  stream_close_args *args = (stream_close_args *)arg;
+  VALUE rb_callbacks = nghttp3_rb_get_callbacks(args->rb_conn);
+
+  if (NIL_P(rb_callbacks))
+    return Qnil;
+
+  CallbacksObj *cb;
+  TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
+
+  if (!callbacks_wants(cb, CALLBACK_STREAM_CLOSE, cb->on_stream_close))
+    return Qnil;
+
+  VALUE argv[2] = {LL2NUM(args->stream_id), ULL2NUM(args->app_error_code)};
+  callbacks_invoke(cb, CALLBACK_STREAM_CLOSE, cb->on_stream_close, 2, argv);
+
+  return Qnil;
+}
+
+/* Drops the stream's state only after on_stream_close, so the handler can
+ * still read its user data, and even if the handler raised. Looked up by ID:
+ * the handler may have closed the connection and freed the state */
+static VALUE callbacks_stream_close_ensure(VALUE arg) {
+  stream_close_args *args = (stream_close_args *)arg;
+
+  nghttp3_rb_stream_timers_on(args->rb_conn, args->stream_id, NULL,
+                              NGHTTP3_RB_STREAM_EVENT_CLOSE);
+  return Qnil;
+}
+
 static int nghttp3_rb_stream_close_callback(nghttp3_conn *conn,
                                             int64_t stream_id,
                                             uint64_t app_error_code,
                                             void *conn_user_data,
                                             void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
-  VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
-
-  if (NIL_P(rb_callbacks))
-    return 0;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+  stream_close_args args = {rb_conn, stream_id, app_error_code};
+  int abusive;
 
-  CallbacksObj *cb;
-  TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
+  nghttp3_rb_memory_on_stream_close(rb_conn, stream_id, stream_user_data);
 
-  if (NIL_P(cb->on_stream_close))
-    return 0;
+  /* The close is still reported when it trips the cancel limit; the
+   * connection fails once the handler has run */
+  abusive = app_error_code == NGHTTP3_H3_REQUEST_CANCELLED &&
+            nghttp3_rb_abuse_on(rb_conn, NGHTTP3_RB_ABUSE_CANCEL) != 0;
 
-  VALUE args[2] = {LL2NUM(stream_id), ULL2NUM(app_error_code)};
-  rb_proc_call(cb->on_stream_close, rb_ary_new_from_values(2, args));
+  rb_ensure(callbacks_stream_close_body, (VALUE)&args,
+            callbacks_stream_close_ensure, (VALUE)&args);
 
-  return 0;
+  return abusive ? NGHTTP3_ERR_CALLBACK_FAILURE : 0;
 }
 
 static int nghttp3_rb_recv_data_callback(nghttp3_conn *conn, int64_t stream_id,
                                          const uint8_t *data, size_t datalen,
                                          void *conn_user_data,
                                          void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  /* Also drops the data of rejected streams */
+  if (nghttp3_rb_memory_on_recv_data(rb_conn, stream_id, stream_user_data,
+                                     datalen))
+    return 0;
+
+  nghttp3_rb_stream_timers_on(rb_conn, stream_id, stream_user_data,
+                              NGHTTP3_RB_STREAM_EVENT_RECV_DATA);
+
+  if (nghttp3_rb_assemble_data(rb_conn, stream_id, stream_user_data, data,
+                               datalen))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -344,12 +541,12 @@ static int nghttp3_rb_recv_data_callback(nghttp3_conn *conn, int64_t stream_id,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_recv_data))
+  if (!callbacks_wants(cb, CALLBACK_RECV_DATA, cb->on_recv_data))
     return 0;
 
   VALUE rb_data = rb_str_new((const char *)data, datalen);
   VALUE args[2] = {LL2NUM(stream_id), rb_data};
-  rb_proc_call(cb->on_recv_data, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_RECV_DATA, cb->on_recv_data, 2, args);
 
   return 0;
 }
@@ -359,7 +556,7 @@ static int nghttp3_rb_deferred_consume_callback(nghttp3_conn *conn,
                                                 size_t consumed,
                                                 void *conn_user_data,
                                                 void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -368,11 +565,12 @@ static int nghttp3_rb_deferred_consume_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_deferred_consume))
+  if (!callbacks_wants(cb, CALLBACK_DEFERRED_CONSUME, cb->on_deferred_consume))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), SIZET2NUM(consumed)};
-  rb_proc_call(cb->on_deferred_consume, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_DEFERRED_CONSUME,
+                   cb->on_deferred_consume, 2, args);
 
   return 0;
 }
@@ -381,7 +579,17 @@ static int nghttp3_rb_begin_headers_callback(nghttp3_conn *conn,
                                              int64_t stream_id,
                                              void *conn_user_data,
                                              void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_abuse_on(rb_conn, NGHTTP3_RB_ABUSE_OPEN) != 0)
+    return NGHTTP3_ERR_CALLBACK_FAILURE;
+
+  if (!nghttp3_rb_memory_admit_stream(rb_conn, stream_id, stream_user_data))
+    return 0;
+
+  nghttp3_rb_stream_timers_on(rb_conn, stream_id, stream_user_data,
+                              NGHTTP3_RB_STREAM_EVENT_BEGIN_HEADERS);
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -390,11 +598,11 @@ static int nghttp3_rb_begin_headers_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_begin_headers))
+  if (!callbacks_wants(cb, CALLBACK_BEGIN_HEADERS, cb->on_begin_headers))
     return 0;
 
   VALUE args[1] = {LL2NUM(stream_id)};
-  rb_proc_call(cb->on_begin_headers, rb_ary_new_from_values(1, args));
+  callbacks_invoke(cb, CALLBACK_BEGIN_HEADERS, cb->on_begin_headers, 1, args);
 
   return 0;
 }
@@ -405,7 +613,19 @@ static int nghttp3_rb_recv_header_callback(nghttp3_conn *conn,
                                            nghttp3_rcbuf *value, uint8_t flags,
                                            void *conn_user_data,
                                            void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
+  nghttp3_rb_memory_on_recv_header(rb_conn, stream_id, stream_user_data,
+                                   nghttp3_rcbuf_get_buf(name).len +
+                                       nghttp3_rcbuf_get_buf(value).len);
+
+  if (nghttp3_rb_assemble_header(rb_conn, stream_id, stream_user_data, name,
+                                 value))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -414,17 +634,17 @@ static int nghttp3_rb_recv_header_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_recv_header))
+  if (!callbacks_wants(cb, CALLBACK_RECV_HEADER, cb->on_recv_header))
     return 0;
 
   nghttp3_vec name_vec = nghttp3_rcbuf_get_buf(name);
   nghttp3_vec value_vec = nghttp3_rcbuf_get_buf(value);
 
-  VALUE rb_name = rb_str_new((const char *)name_vec.base, name_vec.len);
-  VALUE rb_value = rb_str_new((const char *)value_vec.base, value_vec.len);
+  VALUE rb_name = nghttp3_rb_interned_bytes(name_vec.base, name_vec.len);
+  VALUE rb_value = nghttp3_rb_header_string(value_vec.base, value_vec.len);
 
   VALUE args[4] = {LL2NUM(stream_id), rb_name, rb_value, UINT2NUM(flags)};
-  rb_proc_call(cb->on_recv_header, rb_ary_new_from_values(4, args));
+  callbacks_invoke(cb, CALLBACK_RECV_HEADER, cb->on_recv_header, 4, args);
 
   return 0;
 }
@@ -433,7 +653,14 @@ static int nghttp3_rb_end_headers_callback(nghttp3_conn *conn,
                                            int64_t stream_id, int fin,
                                            void *conn_user_data,
                                            void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
+  nghttp3_rb_stream_timers_on(rb_conn, stream_id, stream_user_data,
+                              NGHTTP3_RB_STREAM_EVENT_END_HEADERS);
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -442,11 +669,11 @@ static int nghttp3_rb_end_headers_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_end_headers))
+  if (!callbacks_wants(cb, CALLBACK_END_HEADERS, cb->on_end_headers))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), fin ? Qtrue : Qfalse};
-  rb_proc_call(cb->on_end_headers, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_END_HEADERS, cb->on_end_headers, 2, args);
 
   return 0;
 }
@@ -455,7 +682,11 @@ static int nghttp3_rb_begin_trailers_callback(nghttp3_conn *conn,
                                               int64_t stream_id,
                                               void *conn_user_data,
                                               void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -464,11 +695,11 @@ static int nghttp3_rb_begin_trailers_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_begin_trailers))
+  if (!callbacks_wants(cb, CALLBACK_BEGIN_TRAILERS, cb->on_begin_trailers))
     return 0;
 
   VALUE args[1] = {LL2NUM(stream_id)};
-  rb_proc_call(cb->on_begin_trailers, rb_ary_new_from_values(1, args));
+  callbacks_invoke(cb, CALLBACK_BEGIN_TRAILERS, cb->on_begin_trailers, 1, args);
 
   return 0;
 }
@@ -479,7 +710,15 @@ static int nghttp3_rb_recv_trailer_callback(nghttp3_conn *conn,
                                             nghttp3_rcbuf *value, uint8_t flags,
                                             void *conn_user_data,
                                             void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
+  nghttp3_rb_memory_on_recv_header(rb_conn, stream_id, stream_user_data,
+                                   nghttp3_rcbuf_get_buf(name).len +
+                                       nghttp3_rcbuf_get_buf(value).len);
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -488,17 +727,17 @@ static int nghttp3_rb_recv_trailer_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_recv_trailer))
+  if (!callbacks_wants(cb, CALLBACK_RECV_TRAILER, cb->on_recv_trailer))
     return 0;
 
   nghttp3_vec name_vec = nghttp3_rcbuf_get_buf(name);
   nghttp3_vec value_vec = nghttp3_rcbuf_get_buf(value);
 
-  VALUE rb_name = rb_str_new((const char *)name_vec.base, name_vec.len);
-  VALUE rb_value = rb_str_new((const char *)value_vec.base, value_vec.len);
+  VALUE rb_name = nghttp3_rb_interned_bytes(name_vec.base, name_vec.len);
+  VALUE rb_value = nghttp3_rb_header_string(value_vec.base, value_vec.len);
 
   VALUE args[4] = {LL2NUM(stream_id), rb_name, rb_value, UINT2NUM(flags)};
-  rb_proc_call(cb->on_recv_trailer, rb_ary_new_from_values(4, args));
+  callbacks_invoke(cb, CALLBACK_RECV_TRAILER, cb->on_recv_trailer, 4, args);
 
   return 0;
 }
@@ -507,7 +746,11 @@ static int nghttp3_rb_end_trailers_callback(nghttp3_conn *conn,
                                             int64_t stream_id, int fin,
                                             void *conn_user_data,
                                             void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -516,11 +759,11 @@ static int nghttp3_rb_end_trailers_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_end_trailers))
+  if (!callbacks_wants(cb, CALLBACK_END_TRAILERS, cb->on_end_trailers))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), fin ? Qtrue : Qfalse};
-  rb_proc_call(cb->on_end_trailers, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_END_TRAILERS, cb->on_end_trailers, 2, args);
 
   return 0;
 }
@@ -530,7 +773,14 @@ static int nghttp3_rb_stop_sending_callback(nghttp3_conn *conn,
                                             uint64_t app_error_code,
                                             void *conn_user_data,
                                             void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_abuse_on(rb_conn, NGHTTP3_RB_ABUSE_STOP_SENDING) != 0)
+    return NGHTTP3_ERR_CALLBACK_FAILURE;
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -539,11 +789,11 @@ static int nghttp3_rb_stop_sending_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_stop_sending))
+  if (!callbacks_wants(cb, CALLBACK_STOP_SENDING, cb->on_stop_sending))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), ULL2NUM(app_error_code)};
-  rb_proc_call(cb->on_stop_sending, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_STOP_SENDING, cb->on_stop_sending, 2, args);
 
   return 0;
 }
@@ -551,7 +801,14 @@ static int nghttp3_rb_stop_sending_callback(nghttp3_conn *conn,
 static int nghttp3_rb_end_stream_callback(nghttp3_conn *conn, int64_t stream_id,
                                           void *conn_user_data,
                                           void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
+  nghttp3_rb_stream_timers_on(rb_conn, stream_id, stream_user_data,
+                              NGHTTP3_RB_STREAM_EVENT_END_STREAM);
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -560,11 +817,11 @@ static int nghttp3_rb_end_stream_callback(nghttp3_conn *conn, int64_t stream_id,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_end_stream))
+  if (!callbacks_wants(cb, CALLBACK_END_STREAM, cb->on_end_stream))
     return 0;
 
   VALUE args[1] = {LL2NUM(stream_id)};
-  rb_proc_call(cb->on_end_stream, rb_ary_new_from_values(1, args));
+  callbacks_invoke(cb, CALLBACK_END_STREAM, cb->on_end_stream, 1, args);
 
   return 0;
 }
@@ -574,7 +831,14 @@ static int nghttp3_rb_reset_stream_callback(nghttp3_conn *conn,
                                             uint64_t app_error_code,
                                             void *conn_user_data,
                                             void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+
+  if (nghttp3_rb_abuse_on(rb_conn, NGHTTP3_RB_ABUSE_RESET) != 0)
+    return NGHTTP3_ERR_CALLBACK_FAILURE;
+
+  if (nghttp3_rb_stream_rejected_p(rb_conn, stream_id, stream_user_data))
+    return 0;
+
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -583,18 +847,18 @@ static int nghttp3_rb_reset_stream_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_reset_stream))
+  if (!callbacks_wants(cb, CALLBACK_RESET_STREAM, cb->on_reset_stream))
     return 0;
 
   VALUE args[2] = {LL2NUM(stream_id), ULL2NUM(app_error_code)};
-  rb_proc_call(cb->on_reset_stream, rb_ary_new_from_values(2, args));
+  callbacks_invoke(cb, CALLBACK_RESET_STREAM, cb->on_reset_stream, 2, args);
 
   return 0;
 }
 
 static int nghttp3_rb_shutdown_callback(nghttp3_conn *conn, int64_t id,
                                         void *conn_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -603,11 +867,11 @@ static int nghttp3_rb_shutdown_callback(nghttp3_conn *conn, int64_t id,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_shutdown))
+  if (!callbacks_wants(cb, CALLBACK_SHUTDOWN, cb->on_shutdown))
     return 0;
 
   VALUE args[1] = {LL2NUM(id)};
-  rb_proc_call(cb->on_shutdown, rb_ary_new_from_values(1, args));
+  callbacks_invoke(cb, CALLBACK_SHUTDOWN, cb->on_shutdown, 1, args);
 
   return 0;
 }
@@ -615,7 +879,7 @@ static int nghttp3_rb_shutdown_callback(nghttp3_conn *conn, int64_t id,
 static int nghttp3_rb_recv_settings_callback(nghttp3_conn *conn,
                                              const nghttp3_settings *settings,
                                              void *conn_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
   VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
 
   if (NIL_P(rb_callbacks))
@@ -624,7 +888,7 @@ static int nghttp3_rb_recv_settings_callback(nghttp3_conn *conn,
   CallbacksObj *cb;
   TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
 
-  if (NIL_P(cb->on_recv_settings))
+  if (!callbacks_wants(cb, CALLBACK_RECV_SETTINGS, cb->on_recv_settings))
     return 0;
 
   /* Create a Ruby hash with settings values */
@@ -644,11 +908,44 @@ static int nghttp3_rb_recv_settings_callback(nghttp3_conn *conn,
                settings->h3_datagram ? Qtrue : Qfalse);
 
   VALUE args[1] = {rb_settings};
-  rb_proc_call(cb->on_recv_settings, rb_ary_new_from_values(1, args));
+  callbacks_invoke(cb, CALLBACK_RECV_SETTINGS, cb->on_recv_settings, 1, args);
 
   return 0;
 }
 
+/*
+ * Invokes the on_deferred_consume callback outside of nghttp3, used when a
+ * connection hands out receive credit it withheld under memory pressure.
+ */
+void nghttp3_rb_notify_deferred_consume(VALUE rb_conn, int64_t stream_id,
+                                        size_t consumed) {
+  nghttp3_rb_deferred_consume_callback(NULL, stream_id, consumed, &rb_conn,
+                                       NULL);
+}
+
+/*
+ * Invokes the on_stream_rejected callback once the connection has closed a
+ * rejected stream. nghttp3 has no such event, so it is always called from
+ * outside of nghttp3.
+ */
+void nghttp3_rb_notify_stream_rejected(VALUE rb_conn, int64_t stream_id,
+                                       uint64_t app_error_code) {
+  VALUE rb_callbacks = nghttp3_rb_get_callbacks(rb_conn);
+
+  if (NIL_P(rb_callbacks))
+    return;
+
+  CallbacksObj *cb;
+  TypedData_Get_Struct(rb_callbacks, CallbacksObj, &callbacks_data_type, cb);
+
+  if (!callbacks_wants(cb, CALLBACK_STREAM_REJECTED, cb->on_stream_rejected))
+    return;
+
+  VALUE args[2] = {LL2NUM(stream_id), ULL2NUM(app_error_code)};
+  callbacks_invoke(cb, CALLBACK_STREAM_REJECTED, cb->on_stream_rejected, 2,
+                   args);
+}
+
 /*
  * Sets up the nghttp3_callbacks structure with our C wrapper functions.
  */
@@ -671,6 +968,8 @@ void nghttp3_rb_setup_callbacks(nghttp3_callbacks *callbacks) {
 }
 
 void Init_nghttp3_callbacks(void) {
+  int i;
+
   rb_cNghttp3Callbacks =
       rb_define_class_under(rb_mNghttp3, "Callbacks", rb_cObject);
 
@@ -678,6 +977,14 @@ void Init_nghttp3_callbacks(void) {
 
   rb_define_method(rb_cNghttp3Callbacks, "initialize",
                    rb_nghttp3_callbacks_initialize, 0);
+  rb_define_singleton_method(rb_cNghttp3Callbacks, "dispatch_to",
+                             rb_nghttp3_callbacks_s_dispatch_to, 1);
+  rb_define_method(rb_cNghttp3Callbacks, "handler",
+                   rb_nghttp3_callbacks_handler, 0);
+
+  for (i = 0; i < CALLBACK_MAX; i++) {
+    handler_method_ids[i] = rb_intern(handler_method_names[i]);
+  }
 
   /* Callback setters */
   rb_define_method(rb_cNghttp3Callbacks, "on_acked_stream_data",
@@ -710,4 +1017,6 @@ void Init_nghttp3_callbacks(void) {
                    rb_nghttp3_callbacks_on_shutdown, 0);
   rb_define_method(rb_cNghttp3Callbacks, "on_recv_settings",
                    rb_nghttp3_callbacks_on_recv_settings, 0);
+  rb_define_method(rb_cNghttp3Callbacks, "on_stream_rejected",
+                   rb_nghttp3_callbacks_on_stream_rejected, 0);
 }
@@ -2,47 +2,190 @@
 
 VALUE rb_cNghttp3Connection;
 
+/* Process-wide memory accounting shared by all connections */
+static size_t process_memory_budget = 0;
+static size_t process_memory_used = 0;
+
+enum {
+  STREAM_TIMER_HEADER,
+  STREAM_TIMER_IDLE,
+  STREAM_TIMER_DEADLINE,
+  STREAM_TIMER_MAX
+};
+
+/* Token bucket; credit is kept in byte-nanoseconds per second so refills are
+ * exact. A negative credit is debt from writes beyond the available tokens. */
+typedef struct {
+  uint64_t rate; /* bytes per second, 0 means unlimited */
+  uint64_t burst;
+  int64_t credit;
+  uint64_t last; /* monotonic nanoseconds */
+} token_bucket;
+
+/* C-side state of one stream. Attached to the nghttp3 stream as its
+ * stream_user_data so callbacks reach it without a lookup, indexed by stream
+ * ID for calls from Ruby, and linked into the connection so the Ruby objects
+ * it holds can be marked. */
+typedef struct stream_state {
+  int64_t stream_id;
+  int attached;  /* set as the nghttp3 stream_user_data */
+  VALUE reader;  /* String or Proc supplying the body, or Qnil */
+  VALUE user_data;
+  VALUE pending; /* body Strings kept alive until ACKed, or Qnil */
+  uint64_t pending_acked; /* bytes acked into the first pending String */
+  nghttp3_rb_timer timers[STREAM_TIMER_MAX];
+  nghttp3_rb_timer shape_timer; /* armed while blocked by the write rate */
+  token_bucket bucket;
+  int flow_blocked; /* blocked by the application through block_stream */
+  int assembling;   /* holds a request header block, see assemble_requests */
+  int combined;     /* req_headers holds unfrozen combined values */
+  size_t charged;         /* bytes charged to the memory budget */
+  size_t deferred_credit; /* flow control credit withheld while over budget */
+  unsigned int budget_blocked : 1; /* producer paused while over budget */
+  unsigned int rejected : 1;       /* to be reset, events suppressed */
+  VALUE req_method;
+  VALUE req_scheme;
+  VALUE req_authority;
+  VALUE req_path;
+  VALUE req_headers; /* Hash of header name => value, or Qnil */
+  VALUE req_body;    /* received DATA, or Qnil */
+  struct stream_state *prev;
+  struct stream_state *next;
+} stream_state;
+
+/* Open-addressing table of stream states keyed by stream ID */
+typedef struct {
+  stream_state **slots;
+  size_t cap; /* power of two, or 0 before the first insert */
+  size_t len;
+} stream_table;
+
+/* Events in the current and previous window; the rate is interpolated
+ * across both so it does not reset to zero at window boundaries */
+typedef struct {
+  uint64_t total;
+  uint64_t cur;
+  uint64_t prev;
+  uint64_t limit; /* events per window, 0 disables */
+} abuse_counter;
+
 typedef struct {
   nghttp3_conn *conn;
+  VALUE self;                /* wrapping object, for write barriers */
   VALUE settings;            /* Prevent Settings from being GC'd */
   VALUE callbacks;           /* Prevent Callbacks from being GC'd */
-  VALUE stream_data_readers; /* stream_id => Proc/String for body data */
-  VALUE stream_user_data;    /* stream_id => arbitrary user data */
-  VALUE pending_data;        /* stream_id => [String, ...] for ACK tracking */
+  VALUE spare_headers;       /* cleared header Hashes of recycled Requests */
+  stream_table states;
+  stream_state *state_list;
+  nghttp3_rb_timer_wheel wheel;
+  uint64_t timeouts[STREAM_TIMER_MAX]; /* milliseconds, 0 disables */
+  token_bucket write_bucket;
+  nghttp3_rb_timer_wheel shaper_wheel; /* rate-limited streams by eligibility */
+  size_t shaped_streams;               /* streams with a write rate */
+  abuse_counter abuse[NGHTTP3_RB_ABUSE_MAX];
+  uint64_t abuse_window;       /* milliseconds */
+  uint64_t abuse_window_start; /* monotonic milliseconds */
+  int abuse_tripped;           /* event that crossed its limit, or -1 */
+  int closing_stream;          /* inside a local nghttp3_conn_close_stream */
+  int assemble_requests;       /* build Requests in C, see take_request */
+  size_t memory_budget;      /* 0 means unlimited */
+  size_t memory_used;
+  size_t charged_streams;    /* states with a non-zero charge */
+  size_t deferred_streams;   /* states with withheld credit */
+  size_t blocked_streams;    /* states with budget_blocked set */
+  size_t rejected_streams;   /* states with rejected set */
+  size_t read_credit;        /* DATA bytes credited during read_stream */
+  int drain_pending;
+  int in_read;               /* inside nghttp3_conn_read_stream */
   int is_closed;
   int is_server;
 } ConnectionObj;
 
 static void connection_mark(void *ptr) {
   ConnectionObj *obj = (ConnectionObj *)ptr;
-  if (obj->settings != Qnil) {
-    rb_gc_mark(obj->settings);
+  stream_state *st;
+
+  rb_gc_mark_movable(obj->settings);
+  rb_gc_mark_movable(obj->callbacks);
+  rb_gc_mark_movable(obj->spare_headers);
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    rb_gc_mark_movable(st->reader);
+    rb_gc_mark_movable(st->user_data);
+    rb_gc_mark_movable(st->pending);
+    rb_gc_mark_movable(st->req_method);
+    rb_gc_mark_movable(st->req_scheme);
+    rb_gc_mark_movable(st->req_authority);
+    rb_gc_mark_movable(st->req_path);
+    rb_gc_mark_movable(st->req_headers);
+    rb_gc_mark_movable(st->req_body);
   }
-  if (obj->callbacks != Qnil) {
-    rb_gc_mark(obj->callbacks);
-  }
-  if (obj->stream_data_readers != Qnil) {
-    rb_gc_mark(obj->stream_data_readers);
-  }
-  if (obj->stream_user_data != Qnil) {
-    rb_gc_mark(obj->stream_user_data);
-  }
-  if (obj->pending_data != Qnil) {
-    rb_gc_mark(obj->pending_data);
+}
+
+/*
+ * Updates references after GC.compact. nghttp3 holds &obj->self as its
+ * conn_user_data, which stays valid because only the field is rewritten.
+ */
+static void connection_compact(void *ptr) {
+  ConnectionObj *obj = (ConnectionObj *)ptr;
+  stream_state *st;
+
+  obj->self = rb_gc_location(obj->self);
+  obj->settings = rb_gc_location(obj->settings);
+  obj->callbacks = rb_gc_location(obj->callbacks);
+  obj->spare_headers = rb_gc_location(obj->spare_headers);
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    st->reader = rb_gc_location(st->reader);
+    st->user_data = rb_gc_location(st->user_data);
+    st->pending = rb_gc_location(st->pending);
+    st->req_method = rb_gc_location(st->req_method);
+    st->req_scheme = rb_gc_location(st->req_scheme);
+    st->req_authority = rb_gc_location(st->req_authority);
+    st->req_path = rb_gc_location(st->req_path);
+    st->req_headers = rb_gc_location(st->req_headers);
+    st->req_body = rb_gc_location(st->req_body);
   }
 }
 
+/* Frees all stream state, keeping the table's capacity for reuse */
+static void connection_free_states(ConnectionObj *obj) {
+  stream_state *st = obj->state_list;
+  uint64_t now = nghttp3_rb_monotonic_ms();
+
+  while (st != NULL) {
+    stream_state *next = st->next;
+    xfree(st);
+    st = next;
+  }
+  obj->state_list = NULL;
+  if (obj->states.cap > 0) {
+    memset(obj->states.slots, 0, obj->states.cap * sizeof(stream_state *));
+  }
+  obj->states.len = 0;
+  obj->shaped_streams = 0;
+  obj->charged_streams = 0;
+  obj->deferred_streams = 0;
+  obj->blocked_streams = 0;
+  obj->rejected_streams = 0;
+  nghttp3_rb_timer_wheel_init(&obj->wheel, now);
+  nghttp3_rb_timer_wheel_init(&obj->shaper_wheel, now);
+}
+
 static void connection_free(void *ptr) {
   ConnectionObj *obj = (ConnectionObj *)ptr;
   if (obj->conn != NULL && !obj->is_closed) {
     nghttp3_conn_del(obj->conn);
     obj->conn = NULL;
   }
+  process_memory_used -= obj->memory_used;
+  connection_free_states(obj);
+  xfree(obj->states.slots);
   xfree(ptr);
 }
 
 static size_t connection_memsize(const void *ptr) {
-  return sizeof(ConnectionObj);
+  const ConnectionObj *obj = (const ConnectionObj *)ptr;
+  return sizeof(ConnectionObj) + obj->states.cap * sizeof(stream_state *) +
+         obj->states.len * sizeof(stream_state);
 }
 
 static const rb_data_type_t connection_data_type = {
@@ -52,20 +195,50 @@ static const rb_data_type_t connection_data_type = {
             .dmark = connection_mark,
             .dfree = connection_free,
             .dsize = connection_memsize,
+            .dcompact = connection_compact,
         },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
 };
 
+/*
+ * Stores a VALUE referenced by the connection or one of its stream states.
+ * Every such store goes through the write barrier so the type can be
+ * WB-protected; storing Qnil needs none.
+ */
+#define CONNECTION_WRITE(obj, field, value)                                    \
+  RB_OBJ_WRITE((obj)->self, &(field), (value))
+
 static VALUE connection_alloc(VALUE klass) {
   ConnectionObj *obj;
   VALUE self =
       TypedData_Make_Struct(klass, ConnectionObj, &connection_data_type, obj);
   obj->conn = NULL;
+  obj->self = self;
   obj->settings = Qnil;
   obj->callbacks = Qnil;
-  obj->stream_data_readers = rb_hash_new();
-  obj->stream_user_data = rb_hash_new();
-  obj->pending_data = rb_hash_new();
+  obj->spare_headers = Qnil;
+  memset(&obj->states, 0, sizeof(obj->states));
+  obj->state_list = NULL;
+  nghttp3_rb_timer_wheel_init(&obj->wheel, nghttp3_rb_monotonic_ms());
+  memset(obj->timeouts, 0, sizeof(obj->timeouts));
+  memset(&obj->write_bucket, 0, sizeof(obj->write_bucket));
+  nghttp3_rb_timer_wheel_init(&obj->shaper_wheel, nghttp3_rb_monotonic_ms());
+  obj->shaped_streams = 0;
+  memset(obj->abuse, 0, sizeof(obj->abuse));
+  obj->abuse_window = 1000;
+  obj->abuse_window_start = nghttp3_rb_monotonic_ms();
+  obj->abuse_tripped = -1;
+  obj->closing_stream = 0;
+  obj->assemble_requests = 0;
+  obj->memory_budget = 0;
+  obj->memory_used = 0;
+  obj->charged_streams = 0;
+  obj->deferred_streams = 0;
+  obj->blocked_streams = 0;
+  obj->rejected_streams = 0;
+  obj->read_credit = 0;
+  obj->drain_pending = 0;
+  obj->in_read = 0;
   obj->is_closed = 0;
   obj->is_server = 0;
   return self;
@@ -81,285 +254,2741 @@ VALUE nghttp3_rb_get_callbacks(VALUE rb_conn) {
   return obj->callbacks;
 }
 
-/*
- * call-seq:
- *   Connection.client_new(settings = nil, callbacks = nil) -> Connection
- *
- * Creates a new client HTTP/3 connection.
- * If settings is nil, default settings are used.
- * If callbacks is provided, it will be used for HTTP/3 event notifications.
- */
-static VALUE rb_nghttp3_connection_client_new(int argc, VALUE *argv,
-                                              VALUE klass) {
-  VALUE rb_settings, rb_callbacks;
-  ConnectionObj *obj;
-  nghttp3_settings settings;
-  nghttp3_settings *settings_ptr;
-  nghttp3_callbacks callbacks;
-  int rv;
-  VALUE self;
+/* ============== Stream state ============== */
 
-  rb_scan_args(argc, argv, "02", &rb_settings, &rb_callbacks);
+static size_t stream_table_index(const stream_table *t, int64_t stream_id) {
+  /* Stream IDs step by 4; mix them before masking */
+  return (size_t)(((uint64_t)stream_id * UINT64_C(0x9e3779b97f4a7c15)) >> 32) &
+         (t->cap - 1);
+}
 
-  self = connection_alloc(klass);
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+static stream_state *stream_table_find(const stream_table *t,
+                                       int64_t stream_id) {
+  size_t i;
 
-  if (NIL_P(rb_settings)) {
-    nghttp3_settings_default(&settings);
-    settings_ptr = &settings;
-  } else {
-    settings_ptr = nghttp3_rb_get_settings(rb_settings);
-    obj->settings = rb_settings;
+  if (t->len == 0) {
+    return NULL;
   }
+  for (i = stream_table_index(t, stream_id); t->slots[i] != NULL;
+       i = (i + 1) & (t->cap - 1)) {
+    if (t->slots[i]->stream_id == stream_id) {
+      return t->slots[i];
+    }
+  }
+  return NULL;
+}
 
-  /* Initialize callbacks structure */
-  memset(&callbacks, 0, sizeof(callbacks));
-
-  if (!NIL_P(rb_callbacks)) {
-    obj->callbacks = rb_callbacks;
-    nghttp3_rb_setup_callbacks(&callbacks);
+static void stream_table_insert(stream_table *t, stream_state *st) {
+  size_t i;
+
+  /* Keep the load factor at or below 3/4 */
+  if ((t->len + 1) * 4 > t->cap * 3) {
+    stream_state **old = t->slots;
+    size_t old_cap = t->cap;
+
+    t->cap = old_cap ? old_cap * 2 : 16;
+    t->slots = ZALLOC_N(stream_state *, t->cap);
+    for (i = 0; i < old_cap; i++) {
+      if (old[i] != NULL) {
+        size_t j = stream_table_index(t, old[i]->stream_id);
+        while (t->slots[j] != NULL) {
+          j = (j + 1) & (t->cap - 1);
+        }
+        t->slots[j] = old[i];
+      }
+    }
+    xfree(old);
   }
 
-  rv = nghttp3_conn_client_new(&obj->conn, &callbacks, settings_ptr, NULL,
-                               (void *)self);
+  for (i = stream_table_index(t, st->stream_id); t->slots[i] != NULL;
+       i = (i + 1) & (t->cap - 1))
+    ;
+  t->slots[i] = st;
+  t->len++;
+}
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to create client connection");
+/* Removes by shifting later entries of the probe run back, so lookups never
+ * need tombstones */
+static void stream_table_remove(stream_table *t, stream_state *st) {
+  size_t mask = t->cap - 1;
+  size_t i, j;
+
+  for (i = stream_table_index(t, st->stream_id); t->slots[i] != st;
+       i = (i + 1) & mask)
+    ;
+  t->slots[i] = NULL;
+  t->len--;
+
+  for (j = (i + 1) & mask; t->slots[j] != NULL; j = (j + 1) & mask) {
+    size_t home = stream_table_index(t, t->slots[j]->stream_id);
+    /* Move the entry unless its home lies cyclically in (i, j] */
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      t->slots[j] = NULL;
+      i = j;
+    }
   }
+}
 
-  obj->is_server = 0;
-  return self;
+/* Sets the state as the stream's user data once nghttp3 knows the stream */
+static void connection_attach_state(ConnectionObj *obj, stream_state *st) {
+  if (!st->attached && obj->conn != NULL && !obj->is_closed &&
+      nghttp3_conn_set_stream_user_data(obj->conn, st->stream_id, st) == 0) {
+    st->attached = 1;
+  }
 }
 
-/*
- * call-seq:
- *   Connection.server_new(settings = nil, callbacks = nil) -> Connection
- *
- * Creates a new server HTTP/3 connection.
- * If settings is nil, default settings are used.
- * If callbacks is provided, it will be used for HTTP/3 event notifications.
- */
-static VALUE rb_nghttp3_connection_server_new(int argc, VALUE *argv,
-                                              VALUE klass) {
-  VALUE rb_settings, rb_callbacks;
-  ConnectionObj *obj;
-  nghttp3_settings settings;
-  nghttp3_settings *settings_ptr;
-  nghttp3_callbacks callbacks;
-  int rv;
-  VALUE self;
+static stream_state *connection_find_state(ConnectionObj *obj,
+                                           int64_t stream_id, int create) {
+  stream_state *st = stream_table_find(&obj->states, stream_id);
+  int i;
+
+  if (st != NULL) {
+    connection_attach_state(obj, st);
+    return st;
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  st = ZALLOC(stream_state);
+  st->stream_id = stream_id;
+  st->reader = Qnil;
+  st->user_data = Qnil;
+  st->pending = Qnil;
+  st->req_method = Qnil;
+  st->req_scheme = Qnil;
+  st->req_authority = Qnil;
+  st->req_path = Qnil;
+  st->req_headers = Qnil;
+  st->req_body = Qnil;
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    nghttp3_rb_timer_init(&st->timers[i], stream_id, i);
+  }
+  nghttp3_rb_timer_init(&st->shape_timer, stream_id, STREAM_TIMER_MAX);
+  st->next = obj->state_list;
+  if (obj->state_list != NULL) {
+    obj->state_list->prev = st;
+  }
+  obj->state_list = st;
+  stream_table_insert(&obj->states, st);
+  connection_attach_state(obj, st);
+
+  return st;
+}
 
-  rb_scan_args(argc, argv, "02", &rb_settings, &rb_callbacks);
+/* Returns the state nghttp3 passed to a callback, falling back to the table
+ * for streams whose state was not attached yet */
+static stream_state *connection_callback_state(ConnectionObj *obj,
+                                               int64_t stream_id,
+                                               void *stream_user_data,
+                                               int create) {
+  if (stream_user_data != NULL) {
+    return (stream_state *)stream_user_data;
+  }
+  return connection_find_state(obj, stream_id, create);
+}
 
-  self = connection_alloc(klass);
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+static size_t connection_release(ConnectionObj *obj, stream_state *st,
+                                 size_t n);
+static void connection_clear_budget_state(ConnectionObj *obj,
+                                          stream_state *st);
 
-  if (NIL_P(rb_settings)) {
-    nghttp3_settings_default(&settings);
-    settings_ptr = &settings;
+static void connection_drop_state(ConnectionObj *obj, stream_state *st) {
+  int i;
+
+  if (st == NULL) {
+    return;
+  }
+  connection_release(obj, st, st->charged);
+  connection_clear_budget_state(obj, st);
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    nghttp3_rb_timer_wheel_cancel(&obj->wheel, &st->timers[i]);
+  }
+  nghttp3_rb_timer_wheel_cancel(&obj->shaper_wheel, &st->shape_timer);
+  if (st->bucket.rate > 0) {
+    obj->shaped_streams--;
+  }
+  if (st->prev != NULL) {
+    st->prev->next = st->next;
   } else {
-    settings_ptr = nghttp3_rb_get_settings(rb_settings);
-    obj->settings = rb_settings;
+    obj->state_list = st->next;
   }
+  if (st->next != NULL) {
+    st->next->prev = st->prev;
+  }
+  stream_table_remove(&obj->states, st);
+  xfree(st);
+}
 
-  /* Initialize callbacks structure */
-  memset(&callbacks, 0, sizeof(callbacks));
-
-  if (!NIL_P(rb_callbacks)) {
-    obj->callbacks = rb_callbacks;
-    nghttp3_rb_setup_callbacks(&callbacks);
+/* Undoes a failed submit: a state created for it is dropped, since nghttp3
+ * never learned of the stream and will not report its close */
+static void connection_abandon_state(ConnectionObj *obj, stream_state *st,
+                                     int created) {
+  if (created) {
+    connection_drop_state(obj, st);
+  } else {
+    st->reader = Qnil;
   }
+}
 
-  rv = nghttp3_conn_server_new(&obj->conn, &callbacks, settings_ptr, NULL,
-                               (void *)self);
+typedef struct {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  uint64_t app_error_code;
+  int rv;
+} close_stream_args;
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to create server connection");
-  }
+static VALUE connection_close_stream_body(VALUE arg) {
+  close_stream_args *args = (close_stream_args *)arg;
+  args->rv = nghttp3_conn_close_stream(args->obj->conn, args->stream_id,
+                                       args->app_error_code);
+  return Qnil;
+}
 
-  obj->is_server = 1;
-  return self;
+static VALUE connection_close_stream_ensure(VALUE arg) {
+  ((close_stream_args *)arg)->obj->closing_stream = 0;
+  return Qnil;
 }
 
 /*
- * call-seq:
- *   connection.bind_control_stream(stream_id) -> self
- *
- * Binds the control stream to the given stream_id.
- * This must be called before sending any HTTP frames.
+ * Closes a stream on our own initiative. closing_stream keeps the close from
+ * counting as a peer cancel, and is cleared even if a callback raises.
  */
-static VALUE rb_nghttp3_connection_bind_control_stream(VALUE self,
-                                                       VALUE rb_stream_id) {
-  ConnectionObj *obj;
-  int64_t stream_id;
-  int rv;
+static int connection_close_stream_locally(ConnectionObj *obj,
+                                           int64_t stream_id,
+                                           uint64_t app_error_code) {
+  close_stream_args args;
+
+  args.obj = obj;
+  args.stream_id = stream_id;
+  args.app_error_code = app_error_code;
+  args.rv = 0;
+  obj->closing_stream = 1;
+  rb_ensure(connection_close_stream_body, (VALUE)&args,
+            connection_close_stream_ensure, (VALUE)&args);
+
+  return args.rv;
+}
 
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+/* ============== Memory budget ============== */
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+static int connection_over_budget(ConnectionObj *obj) {
+  if (obj->memory_budget > 0 && obj->memory_used > obj->memory_budget) {
+    return 1;
+  }
+  if (process_memory_budget > 0 &&
+      process_memory_used > process_memory_budget) {
+    return 1;
   }
+  return 0;
+}
 
-  stream_id = NUM2LL(rb_stream_id);
-  rv = nghttp3_conn_bind_control_stream(obj->conn, stream_id);
+/* Without a connection or process budget nothing is charged, so the
+ * accounting costs nothing on unbudgeted connections */
+static int connection_budgeted(ConnectionObj *obj) {
+  return obj->memory_budget > 0 || process_memory_budget > 0;
+}
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to bind control stream");
+static void connection_charge(ConnectionObj *obj, stream_state *st,
+                              size_t n) {
+  if (n == 0 || !connection_budgeted(obj)) {
+    return;
   }
-
-  return self;
+  if (st->charged == 0) {
+    obj->charged_streams++;
+  }
+  st->charged += n;
+  obj->memory_used += n;
+  process_memory_used += n;
 }
 
 /*
- * call-seq:
- *   connection.bind_qpack_streams(encoder_stream_id, decoder_stream_id) -> self
- *
- * Binds the QPACK encoder and decoder streams.
- * This must be called before sending any HTTP frames.
+ * Releases up to n bytes charged to a stream. Drain work (credit and producer
+ * resumption) is deferred until control returns from nghttp3.
  */
-static VALUE rb_nghttp3_connection_bind_qpack_streams(VALUE self,
-                                                      VALUE rb_enc_stream_id,
-                                                      VALUE rb_dec_stream_id) {
-  ConnectionObj *obj;
-  int64_t enc_stream_id, dec_stream_id;
-  int rv;
+static size_t connection_release(ConnectionObj *obj, stream_state *st,
+                                 size_t n) {
+  if (n > st->charged) {
+    n = st->charged;
+  }
+  if (n == 0) {
+    return 0;
+  }
 
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  st->charged -= n;
+  if (st->charged == 0) {
+    obj->charged_streams--;
+  }
+  obj->memory_used -= n;
+  process_memory_used -= n;
+  obj->drain_pending = 1;
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  return n;
+}
+
+static void connection_defer_credit(ConnectionObj *obj, stream_state *st,
+                                    size_t n) {
+  if (st->deferred_credit == 0) {
+    obj->deferred_streams++;
   }
+  st->deferred_credit += n;
+}
 
-  enc_stream_id = NUM2LL(rb_enc_stream_id);
-  dec_stream_id = NUM2LL(rb_dec_stream_id);
+static void connection_block_producer(ConnectionObj *obj, stream_state *st) {
+  if (!st->budget_blocked) {
+    st->budget_blocked = 1;
+    obj->blocked_streams++;
+  }
+}
 
-  rv = nghttp3_conn_bind_qpack_streams(obj->conn, enc_stream_id, dec_stream_id);
+static void connection_mark_rejected(ConnectionObj *obj, stream_state *st) {
+  if (!st->rejected) {
+    st->rejected = 1;
+    obj->rejected_streams++;
+  }
+}
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to bind QPACK streams");
+/* Forgets withheld credit and the blocked and rejected marks of a stream */
+static void connection_clear_budget_state(ConnectionObj *obj,
+                                          stream_state *st) {
+  if (st->deferred_credit > 0) {
+    st->deferred_credit = 0;
+    obj->deferred_streams--;
+  }
+  if (st->budget_blocked) {
+    st->budget_blocked = 0;
+    obj->blocked_streams--;
+  }
+  if (st->rejected) {
+    st->rejected = 0;
+    obj->rejected_streams--;
   }
+}
 
-  return self;
+/* Marks the parked stream holding the most memory for reset */
+static void connection_reject_largest(ConnectionObj *obj) {
+  stream_state *st, *largest = NULL;
+
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    if (st->deferred_credit > 0 &&
+        (largest == NULL || st->charged > largest->charged)) {
+      largest = st;
+    }
+  }
+  if (largest != NULL) {
+    connection_mark_rejected(obj, largest);
+  }
 }
 
+typedef struct {
+  int64_t stream_id;
+  size_t credit;
+} deferred_entry;
+
 /*
- * call-seq:
- *   connection.close -> nil
- *
- * Explicitly closes the connection and frees resources.
- * After calling this, the connection object cannot be used.
+ * Hands out withheld credit and resumes paused producers once the connection
+ * is back under its budget. Must not be called from inside an nghttp3
+ * callback.
  */
-static VALUE rb_nghttp3_connection_close(VALUE self) {
-  ConnectionObj *obj;
+static void connection_process_drain(VALUE self, ConnectionObj *obj) {
+  stream_state *st;
+  deferred_entry *entries;
+  VALUE buf;
+  size_t i, n = 0;
+
+  if (!obj->drain_pending || obj->conn == NULL ||
+      connection_over_budget(obj)) {
+    return;
+  }
+  obj->drain_pending = 0;
+
+  if (obj->blocked_streams > 0) {
+    for (st = obj->state_list; st != NULL; st = st->next) {
+      if (st->budget_blocked) {
+        st->budget_blocked = 0;
+        nghttp3_conn_resume_stream(obj->conn, st->stream_id);
+      }
+    }
+    obj->blocked_streams = 0;
+  }
 
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  if (obj->deferred_streams == 0) {
+    return;
+  }
 
-  if (obj->conn != NULL && !obj->is_closed) {
-    nghttp3_conn_del(obj->conn);
-    obj->conn = NULL;
-    obj->is_closed = 1;
+  /* Collected first: on_deferred_consume runs Ruby, which may close streams
+   * and drop their states */
+  entries = ALLOCV_N(deferred_entry, buf, obj->deferred_streams);
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    if (st->deferred_credit > 0) {
+      entries[n].stream_id = st->stream_id;
+      entries[n].credit = st->deferred_credit;
+      st->deferred_credit = 0;
+      n++;
+    }
   }
+  obj->deferred_streams = 0;
 
-  return Qnil;
+  for (i = 0; i < n; i++) {
+    nghttp3_rb_notify_deferred_consume(self, entries[i].stream_id,
+                                       entries[i].credit);
+  }
+  ALLOCV_END(buf);
 }
 
 /*
- * call-seq:
- *   connection.closed? -> true or false
- *
- * Returns true if the connection has been closed.
+ * Closes streams rejected while nghttp3 was processing input, by admission or
+ * by the budget, and reports each through on_stream_rejected so the QUIC
+ * layer can reset it. A client cancels its own requests instead.
  */
-static VALUE rb_nghttp3_connection_closed_p(VALUE self) {
+static void connection_process_rejections(VALUE self, ConnectionObj *obj) {
+  stream_state *st;
+  int64_t *ids;
+  VALUE buf;
+  size_t i, n = 0;
+  uint64_t app_error_code = obj->is_server ? NGHTTP3_H3_REQUEST_REJECTED
+                                           : NGHTTP3_H3_REQUEST_CANCELLED;
+
+  if (obj->rejected_streams == 0 || obj->conn == NULL) {
+    return;
+  }
+
+  /* Closing a stream drops its state, so the IDs are collected first. Each
+   * mark is cleared just before its close: if a callback raises, the rest
+   * stay marked for the next call. */
+  ids = ALLOCV_N(int64_t, buf, obj->rejected_streams);
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    if (st->rejected) {
+      ids[n++] = st->stream_id;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    st = connection_find_state(obj, ids[i], 0);
+    if (st == NULL || !st->rejected) {
+      continue;
+    }
+    st->rejected = 0;
+    obj->rejected_streams--;
+    if (connection_close_stream_locally(obj, ids[i], app_error_code) != 0) {
+      /* Unknown to nghttp3, so no close callback will drop the state */
+      st = connection_find_state(obj, ids[i], 0);
+      if (st != NULL && !st->attached) {
+        connection_drop_state(obj, st);
+      }
+      continue;
+    }
+    nghttp3_rb_notify_stream_rejected(self, ids[i], app_error_code);
+  }
+  ALLOCV_END(buf);
+}
+
+/*
+ * Called from begin_headers. Returns 0 if a new peer stream must be rejected
+ * because the connection is over its memory budget.
+ */
+int nghttp3_rb_memory_admit_stream(VALUE rb_conn, int64_t stream_id,
+                                   void *stream_user_data) {
   ConnectionObj *obj;
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
-  return obj->is_closed ? Qtrue : Qfalse;
+  stream_state *st;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  if (!obj->is_server || (stream_id & 0x03) != 0 ||
+      !connection_over_budget(obj)) {
+    return 1;
+  }
+  st = connection_callback_state(obj, stream_id, stream_user_data, 1);
+  if (st->charged > 0) {
+    /* Stream already admitted, e.g. trailers */
+    return 1;
+  }
+
+  connection_mark_rejected(obj, st);
+  return 0;
 }
 
 /*
- * call-seq:
- *   connection.server? -> true or false
- *
- * Returns true if this is a server connection.
+ * Returns non-zero if the stream has been rejected and its events must not
+ * reach Ruby.
  */
-static VALUE rb_nghttp3_connection_server_p(VALUE self) {
+int nghttp3_rb_stream_rejected_p(VALUE rb_conn, int64_t stream_id,
+                                 void *stream_user_data) {
   ConnectionObj *obj;
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
-  return obj->is_server ? Qtrue : Qfalse;
+  stream_state *st;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->rejected_streams == 0) {
+    return 0;
+  }
+  st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+  return st != NULL && st->rejected;
 }
 
 /*
- * call-seq:
- *   connection.client? -> true or false
- *
- * Returns true if this is a client connection.
+ * Charges decoded header bytes to the stream.
  */
-static VALUE rb_nghttp3_connection_client_p(VALUE self) {
+void nghttp3_rb_memory_on_recv_header(VALUE rb_conn, int64_t stream_id,
+                                      void *stream_user_data, size_t n) {
   ConnectionObj *obj;
-  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
-  return obj->is_server ? Qfalse : Qtrue;
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+  if (!connection_budgeted(obj)) {
+    return;
+  }
+  connection_charge(
+      obj, connection_callback_state(obj, stream_id, stream_user_data, 1), n);
 }
 
 /*
- * call-seq:
- *   connection.read_stream(stream_id, data, fin: false) -> Integer
- *
- * Reads data on a stream. This should be called when data is received from
- * the QUIC layer. Returns the number of bytes consumed (for flow control).
+ * Charges received body bytes to the stream. While over budget, credit for
+ * streams holding more than their fair share is withheld and handed out
+ * through on_deferred_consume once memory drains. Returns non-zero if the
+ * stream is rejected and the data must not reach Ruby.
  */
-static VALUE rb_nghttp3_connection_read_stream(int argc, VALUE *argv,
-                                               VALUE self) {
-  VALUE rb_stream_id, rb_data, rb_opts;
-  VALUE rb_fin = Qfalse;
+int nghttp3_rb_memory_on_recv_data(VALUE rb_conn, int64_t stream_id,
+                                   void *stream_user_data, size_t n) {
   ConnectionObj *obj;
-  nghttp3_ssize rv;
-  int64_t stream_id;
-  int fin;
+  stream_state *st;
+  size_t nstreams;
 
-  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_data, &rb_opts);
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
 
-  if (!NIL_P(rb_opts)) {
-    VALUE rb_fin_val = rb_hash_aref(rb_opts, ID2SYM(rb_intern("fin")));
+  if (obj->rejected_streams > 0) {
+    st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+    if (st != NULL && st->rejected) {
+      /* Dropped unread, so its credit is not withheld */
+      obj->read_credit += n;
+      return 1;
+    }
+  }
+
+  if (!connection_budgeted(obj)) {
+    obj->read_credit += n;
+    return 0;
+  }
+
+  st = connection_callback_state(obj, stream_id, stream_user_data, 1);
+  connection_charge(obj, st, n);
+
+  if (connection_over_budget(obj)) {
+    nstreams = obj->charged_streams;
+    if (nstreams <= 1 || st->charged * nstreams >= obj->memory_used) {
+      connection_defer_credit(obj, st, n);
+      /* A parked stream resumes once other charges drain. With every charged
+       * stream parked nothing would, e.g. a body larger than the budget, so
+       * the largest is reset instead of waiting forever. */
+      if (obj->rejected_streams == 0 &&
+          obj->deferred_streams >= obj->charged_streams) {
+        connection_reject_largest(obj);
+      }
+      return st->rejected;
+    }
+  }
+
+  obj->read_credit += n;
+  return 0;
+}
+
+/*
+ * Drops fully acknowledged body strings and releases their memory.
+ */
+void nghttp3_rb_memory_on_acked(VALUE rb_conn, int64_t stream_id,
+                                void *stream_user_data, uint64_t datalen) {
+  ConnectionObj *obj;
+  stream_state *st;
+  VALUE pending;
+  uint64_t acked;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+  if (st == NULL || NIL_P(st->pending)) {
+    return;
+  }
+
+  pending = st->pending;
+  acked = st->pending_acked + datalen;
+  while (RARRAY_LEN(pending) > 0) {
+    size_t len = RSTRING_LEN(RARRAY_AREF(pending, 0));
+    if (acked < len) {
+      break;
+    }
+    acked -= len;
+    rb_ary_shift(pending);
+    connection_release(obj, st, len);
+  }
+
+  if (RARRAY_LEN(pending) == 0) {
+    st->pending = Qnil;
+    acked = 0;
+  }
+  st->pending_acked = acked;
+}
+
+/*
+ * Releases the memory charged to a stream nghttp3 has closed and hands back
+ * its withheld credit, which the connection's receive window still needs.
+ * The stream's reader and pending bodies go with its state on the CLOSE
+ * timer event.
+ */
+void nghttp3_rb_memory_on_stream_close(VALUE rb_conn, int64_t stream_id,
+                                       void *stream_user_data) {
+  ConnectionObj *obj;
+  stream_state *st;
+  size_t credit;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+  if (st == NULL) {
+    return;
+  }
+  credit = st->deferred_credit;
+  connection_release(obj, st, st->charged);
+  connection_clear_budget_state(obj, st);
+  if (credit > 0) {
+    nghttp3_rb_notify_deferred_consume(rb_conn, stream_id, credit);
+  }
+}
+
+/* ============== Stream timers ============== */
+
+static const char *stream_timer_names[STREAM_TIMER_MAX] = {"header", "idle",
+                                                           "deadline"};
+
+static int stream_timer_kind(VALUE rb_kind) {
+  int i;
+
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    if (rb_kind == ID2SYM(rb_intern(stream_timer_names[i]))) {
+      return i;
+    }
+  }
+  rb_raise(rb_eArgError, "unknown timer kind (expected :header, :idle or "
+                         ":deadline)");
+  return -1;
+}
+
+static void connection_drop_timers(ConnectionObj *obj, int64_t stream_id) {
+  stream_state *st = connection_find_state(obj, stream_id, 0);
+  int i;
+
+  if (st == NULL) {
+    return;
+  }
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    nghttp3_rb_timer_wheel_cancel(&obj->wheel, &st->timers[i]);
+  }
+}
+
+static void connection_arm_timer(ConnectionObj *obj, int64_t stream_id,
+                                 int kind, uint64_t timeout, uint64_t now) {
+  stream_state *st = connection_find_state(obj, stream_id, 1);
+  nghttp3_rb_timer_wheel_arm(&obj->wheel, &st->timers[kind], now + timeout);
+}
+
+static void connection_cancel_timer(ConnectionObj *obj, int64_t stream_id,
+                                    int kind) {
+  stream_state *st = connection_find_state(obj, stream_id, 0);
+  if (st != NULL) {
+    nghttp3_rb_timer_wheel_cancel(&obj->wheel, &st->timers[kind]);
+  }
+}
+
+/*
+ * Arms, refreshes and cancels the configured timeouts as a stream progresses.
+ */
+void nghttp3_rb_stream_timers_on(VALUE rb_conn, int64_t stream_id,
+                                 void *stream_user_data,
+                                 nghttp3_rb_stream_event event) {
+  ConnectionObj *obj;
+  stream_state *st;
+  uint64_t now;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  switch (event) {
+  case NGHTTP3_RB_STREAM_EVENT_BEGIN_HEADERS:
+    /* Every request stream gets its state here, so later callbacks receive
+     * it as stream_user_data */
+    st = connection_callback_state(obj, stream_id, stream_user_data, 1);
+    now = nghttp3_rb_monotonic_ms();
+    if (obj->timeouts[STREAM_TIMER_HEADER] &&
+        !st->timers[STREAM_TIMER_HEADER].armed) {
+      nghttp3_rb_timer_wheel_arm(&obj->wheel, &st->timers[STREAM_TIMER_HEADER],
+                                 now + obj->timeouts[STREAM_TIMER_HEADER]);
+    }
+    if (obj->timeouts[STREAM_TIMER_DEADLINE] &&
+        !st->timers[STREAM_TIMER_DEADLINE].armed) {
+      nghttp3_rb_timer_wheel_arm(&obj->wheel,
+                                 &st->timers[STREAM_TIMER_DEADLINE],
+                                 now + obj->timeouts[STREAM_TIMER_DEADLINE]);
+    }
+    break;
+  case NGHTTP3_RB_STREAM_EVENT_END_HEADERS:
+  case NGHTTP3_RB_STREAM_EVENT_RECV_DATA:
+    st = connection_callback_state(obj, stream_id, stream_user_data,
+                                   obj->timeouts[STREAM_TIMER_IDLE] != 0);
+    if (st == NULL) {
+      break;
+    }
+    if (event == NGHTTP3_RB_STREAM_EVENT_END_HEADERS) {
+      nghttp3_rb_timer_wheel_cancel(&obj->wheel,
+                                    &st->timers[STREAM_TIMER_HEADER]);
+    }
+    if (obj->timeouts[STREAM_TIMER_IDLE]) {
+      nghttp3_rb_timer_wheel_arm(&obj->wheel, &st->timers[STREAM_TIMER_IDLE],
+                                 nghttp3_rb_monotonic_ms() +
+                                     obj->timeouts[STREAM_TIMER_IDLE]);
+    }
+    break;
+  case NGHTTP3_RB_STREAM_EVENT_END_STREAM:
+    st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+    if (st != NULL) {
+      nghttp3_rb_timer_wheel_cancel(&obj->wheel,
+                                    &st->timers[STREAM_TIMER_HEADER]);
+      nghttp3_rb_timer_wheel_cancel(&obj->wheel,
+                                    &st->timers[STREAM_TIMER_IDLE]);
+    }
+    break;
+  case NGHTTP3_RB_STREAM_EVENT_CLOSE:
+    connection_drop_state(
+        obj, connection_callback_state(obj, stream_id, stream_user_data, 0));
+    break;
+  }
+}
+
+/* ============== Write rate limiting ============== */
+
+#define NS_PER_SEC INT64_C(1000000000)
+
+/* Keeps credit arithmetic, including debt, within int64_t */
+#define BUCKET_MAX_BURST ((uint64_t)(INT64_MAX / NS_PER_SEC / 4))
+
+static void check_bucket_args(uint64_t rate, uint64_t burst) {
+  if (rate > 0 && (burst == 0 || burst > BUCKET_MAX_BURST)) {
+    rb_raise(rb_eArgError, "burst must be between 1 and %llu bytes",
+             (unsigned long long)BUCKET_MAX_BURST);
+  }
+}
+
+static void bucket_configure(token_bucket *b, uint64_t rate, uint64_t burst,
+                             uint64_t now) {
+  b->rate = rate;
+  b->burst = burst;
+  b->credit = (int64_t)burst * NS_PER_SEC;
+  b->last = now;
+}
+
+static void bucket_refill(token_bucket *b, uint64_t now) {
+  int64_t cap = (int64_t)b->burst * NS_PER_SEC;
+  uint64_t elapsed;
+
+  if (b->rate == 0 || now <= b->last) {
+    return;
+  }
+  elapsed = now - b->last;
+  b->last = now;
+  if (b->credit >= cap) {
+    return;
+  }
+  if (elapsed >= (uint64_t)(cap - b->credit) / b->rate + 1) {
+    b->credit = cap;
+  } else {
+    b->credit += (int64_t)(elapsed * b->rate);
+    if (b->credit > cap) {
+      b->credit = cap;
+    }
+  }
+}
+
+static size_t bucket_available(const token_bucket *b) {
+  if (b->rate == 0) {
+    return SIZE_MAX;
+  }
+  return b->credit > 0 ? (size_t)(b->credit / NS_PER_SEC) : 0;
+}
+
+static void bucket_consume(token_bucket *b, size_t n) {
+  if (b->rate > 0) {
+    b->credit -= (int64_t)n * NS_PER_SEC;
+  }
+}
+
+/* Monotonic nanoseconds at which at least one byte is available */
+static uint64_t bucket_eligible_at(const token_bucket *b) {
+  if (b->credit >= NS_PER_SEC) {
+    return b->last;
+  }
+  return b->last + ((uint64_t)(NS_PER_SEC - b->credit) + b->rate - 1) / b->rate;
+}
+
+static void shaper_release_cb(nghttp3_rb_timer *timer, void *arg) {
+  ConnectionObj *obj = (ConnectionObj *)arg;
+  stream_state *st =
+      (stream_state *)((char *)timer - offsetof(stream_state, shape_timer));
+
+  if (!st->flow_blocked && obj->conn != NULL) {
+    nghttp3_conn_unblock_stream(obj->conn, timer->stream_id);
+  }
+}
+
+/* Refills the connection bucket and unblocks streams whose rate allows them
+ * to send again. Returns the bytes the connection may write now. */
+static size_t connection_shaper_refresh(ConnectionObj *obj, uint64_t now) {
+  bucket_refill(&obj->write_bucket, now);
+  if (obj->shaper_wheel.count > 0) {
+    nghttp3_rb_timer_wheel_advance(&obj->shaper_wheel, now / 1000000,
+                                   shaper_release_cb, obj);
+  }
+  return bucket_available(&obj->write_bucket);
+}
+
+/*
+ * Returns the bytes stream_id may write now, or 0 after blocking it until its
+ * bucket has refilled.
+ */
+static size_t connection_shaper_admit(ConnectionObj *obj, int64_t stream_id,
+                                      uint64_t now) {
+  stream_state *st;
+  size_t avail;
+
+  if (obj->shaped_streams == 0 ||
+      (st = connection_find_state(obj, stream_id, 0)) == NULL ||
+      st->bucket.rate == 0) {
+    return SIZE_MAX;
+  }
+
+  bucket_refill(&st->bucket, now);
+  avail = bucket_available(&st->bucket);
+  if (avail == 0) {
+    nghttp3_conn_block_stream(obj->conn, stream_id);
+    /* Round up so the stream is never released early */
+    nghttp3_rb_timer_wheel_arm(&obj->shaper_wheel, &st->shape_timer,
+                               (bucket_eligible_at(&st->bucket) + 999999) /
+                                   1000000);
+  }
+
+  return avail;
+}
+
+static void connection_shaper_consume(ConnectionObj *obj, int64_t stream_id,
+                                      size_t n) {
+  stream_state *st;
+
+  bucket_consume(&obj->write_bucket, n);
+  if (obj->shaped_streams > 0 &&
+      (st = connection_find_state(obj, stream_id, 0)) != NULL) {
+    bucket_consume(&st->bucket, n);
+  }
+}
+
+/* ============== Stream abuse counters ============== */
+
+static const char *abuse_names[NGHTTP3_RB_ABUSE_MAX] = {
+    "opens", "resets", "stop_sending", "cancels"};
+
+static void abuse_reset(ConnectionObj *obj) {
+  int i;
+
+  for (i = 0; i < NGHTTP3_RB_ABUSE_MAX; i++) {
+    obj->abuse[i].total = obj->abuse[i].cur = obj->abuse[i].prev = 0;
+  }
+  obj->abuse_window_start = nghttp3_rb_monotonic_ms();
+  obj->abuse_tripped = -1;
+}
+
+static void abuse_roll(ConnectionObj *obj, uint64_t now) {
+  uint64_t elapsed = now - obj->abuse_window_start;
+  int i;
+
+  if (elapsed < obj->abuse_window) {
+    return;
+  }
+  for (i = 0; i < NGHTTP3_RB_ABUSE_MAX; i++) {
+    /* Only the window right before the current one carries over */
+    obj->abuse[i].prev =
+        elapsed < 2 * obj->abuse_window ? obj->abuse[i].cur : 0;
+    obj->abuse[i].cur = 0;
+  }
+  obj->abuse_window_start += elapsed - elapsed % obj->abuse_window;
+}
+
+/* Events over the last window length, weighting the previous window by its
+ * remaining overlap */
+static uint64_t abuse_rate(const ConnectionObj *obj, const abuse_counter *c,
+                           uint64_t now) {
+  uint64_t elapsed = now - obj->abuse_window_start;
+  return c->cur + c->prev * (obj->abuse_window - elapsed) / obj->abuse_window;
+}
+
+/*
+ * Counts a stream event. Returns non-zero once any limit has been crossed;
+ * the callback then fails so nghttp3 stops processing the peer's data before
+ * Ruby sees it.
+ */
+int nghttp3_rb_abuse_on(VALUE rb_conn, nghttp3_rb_abuse_event event) {
+  ConnectionObj *obj;
+  abuse_counter *c;
+  uint64_t now;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->abuse_tripped >= 0) {
+    return -1;
+  }
+  if ((event == NGHTTP3_RB_ABUSE_OPEN && !obj->is_server) ||
+      (event == NGHTTP3_RB_ABUSE_CANCEL && obj->closing_stream)) {
+    return 0;
+  }
+
+  c = &obj->abuse[event];
+  c->total++;
+  if (c->limit == 0) {
+    return 0;
+  }
+
+  now = nghttp3_rb_monotonic_ms();
+  abuse_roll(obj, now);
+  c->cur++;
+  if (abuse_rate(obj, c, now) > c->limit) {
+    obj->abuse_tripped = (int)event;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ============== Request assembly ============== */
+
+/* Header Hashes kept for reuse by a connection's recycled Requests */
+#define SPARE_HEADERS_MAX 64
+
+static VALUE request_class = Qnil;
+static VALUE headers_class = Qnil;
+static ID id_iv_method, id_iv_scheme, id_iv_authority, id_iv_path,
+    id_iv_headers, id_iv_body;
+
+/* Request and Headers are defined in Ruby after the extension is loaded */
+static void resolve_request_classes(void) {
+  if (NIL_P(request_class)) {
+    request_class = rb_path2class("Nghttp3::Request");
+    headers_class = rb_path2class("Nghttp3::Headers");
+  }
+}
+
+/* Interns the method, upcasing it as Request.new does */
+static VALUE assemble_method(const char *p, size_t len) {
+  VALUE str;
+  char *q;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (p[i] >= 'a' && p[i] <= 'z') {
+      break;
+    }
+  }
+  if (i == len) {
+    return nghttp3_rb_interned_bytes(p, len);
+  }
+
+  str = rb_str_new(p, (long)len);
+  q = RSTRING_PTR(str);
+  for (; i < len; i++) {
+    if (q[i] >= 'a' && q[i] <= 'z') {
+      q[i] -= 'a' - 'A';
+    }
+  }
+  return rb_str_freeze(str);
+}
+
+static int has_upper(const char *p, long len) {
+  long i;
+
+  for (i = 0; i < len; i++) {
+    if (p[i] >= 'A' && p[i] <= 'Z') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int name_is(const char *name, size_t namelen, const char *lit) {
+  size_t len = strlen(lit);
+  return namelen == len && memcmp(name, lit, len) == 0;
+}
+
+/*
+ * Stores one field of a request header block. Pseudo-headers go into their
+ * own slots, other fields into the header Hash under an interned name.
+ */
+static void assemble_header(ConnectionObj *obj, stream_state *st,
+                            const char *name, size_t namelen,
+                            const char *value, size_t valuelen) {
+  VALUE key, prev;
+
+  st->assembling = 1;
+
+  if (namelen > 0 && name[0] == ':') {
+    if (name_is(name, namelen, ":method")) {
+      CONNECTION_WRITE(obj, st->req_method, assemble_method(value, valuelen));
+    } else if (name_is(name, namelen, ":scheme")) {
+      CONNECTION_WRITE(obj, st->req_scheme,
+                       nghttp3_rb_interned_bytes(value, valuelen));
+    } else if (name_is(name, namelen, ":authority")) {
+      CONNECTION_WRITE(obj, st->req_authority,
+                       nghttp3_rb_interned_bytes(value, valuelen));
+    } else if (name_is(name, namelen, ":path")) {
+      CONNECTION_WRITE(obj, st->req_path,
+                       rb_str_freeze(rb_str_new(value, (long)valuelen)));
+    }
+    return;
+  }
+
+  if (NIL_P(st->req_headers)) {
+    CONNECTION_WRITE(obj, st->req_headers,
+                     (!NIL_P(obj->spare_headers) &&
+                      RARRAY_LEN(obj->spare_headers) > 0)
+                         ? rb_ary_pop(obj->spare_headers)
+                         : rb_hash_new());
+  }
+  key = nghttp3_rb_interned_bytes(name, namelen);
+  prev = rb_hash_lookup2(st->req_headers, key, Qundef);
+  if (prev == Qundef) {
+    rb_hash_aset(st->req_headers, key,
+                 nghttp3_rb_header_string((const uint8_t *)value, valuelen));
+    return;
+  }
+
+  /* Repeated fields are combined; split cookies are rejoined with "; " */
+  if (OBJ_FROZEN(prev)) {
+    prev = rb_str_dup(prev);
+    rb_hash_aset(st->req_headers, key, prev);
+    st->combined = 1;
+  }
+  rb_str_cat(prev, name_is(name, namelen, "cookie") ? "; " : ", ", 2);
+  rb_str_cat(prev, value, (long)valuelen);
+}
+
+static void assemble_data(ConnectionObj *obj, stream_state *st,
+                          const char *data, size_t datalen) {
+  if (NIL_P(st->req_body)) {
+    CONNECTION_WRITE(obj, st->req_body, rb_str_buf_new((long)datalen));
+  }
+  rb_str_cat(st->req_body, data, (long)datalen);
+}
+
+static VALUE assemble_default(VALUE v, const char *lit) {
+  return NIL_P(v) ? nghttp3_rb_interned_bytes(lit, strlen(lit)) : v;
+}
+
+static int assemble_freeze_value_i(VALUE key, VALUE value, VALUE arg) {
+  rb_str_freeze(value);
+  return ST_CONTINUE;
+}
+
+/* Keeps a cleared header Hash for the next assembled request */
+static void assemble_spare_headers(ConnectionObj *obj, VALUE hash) {
+  if (!RB_TYPE_P(hash, T_HASH) || OBJ_FROZEN(hash)) {
+    return;
+  }
+  if (NIL_P(obj->spare_headers)) {
+    CONNECTION_WRITE(obj, obj->spare_headers, rb_ary_new());
+  }
+  if (RARRAY_LEN(obj->spare_headers) < SPARE_HEADERS_MAX) {
+    rb_hash_clear(hash);
+    rb_ary_push(obj->spare_headers, hash);
+  }
+}
+
+/*
+ * Builds the Request for a stream's header block and body, setting the same
+ * instance variables as Request.new without copying any field. A recycled
+ * Request passed as into is refilled in place, reusing its Headers, and left
+ * unfrozen so it can be recycled again; otherwise a new frozen Request is
+ * allocated.
+ */
+static VALUE assemble_request(ConnectionObj *obj, stream_state *st,
+                              VALUE into) {
+  VALUE headers = Qnil, request;
+
+  resolve_request_classes();
+
+  if (!NIL_P(into)) {
+    if (!rb_obj_is_kind_of(into, request_class)) {
+      rb_raise(rb_eTypeError, "expected a Nghttp3::Request");
+    }
+    rb_check_frozen(into);
+    headers = rb_attr_get(into, id_iv_headers);
+    if (rb_obj_is_kind_of(headers, headers_class) && !OBJ_FROZEN(headers)) {
+      assemble_spare_headers(obj, rb_attr_get(headers, id_iv_headers));
+    } else {
+      headers = Qnil;
+    }
+  }
+  if (NIL_P(headers)) {
+    headers = rb_obj_alloc(headers_class);
+  }
+  /* Combined values were built up in place; every value is frozen once the
+   * Request is handed out */
+  if (st->combined) {
+    rb_hash_foreach(st->req_headers, assemble_freeze_value_i, 0);
+    st->combined = 0;
+  }
+  rb_ivar_set(headers, id_iv_headers,
+              NIL_P(st->req_headers) ? rb_hash_new() : st->req_headers);
+
+  request = NIL_P(into) ? rb_obj_alloc(request_class) : into;
+  rb_ivar_set(request, id_iv_method, assemble_default(st->req_method, "GET"));
+  rb_ivar_set(request, id_iv_scheme,
+              assemble_default(st->req_scheme, "https"));
+  rb_ivar_set(request, id_iv_authority, st->req_authority);
+  rb_ivar_set(request, id_iv_path, assemble_default(st->req_path, "/"));
+  rb_ivar_set(request, id_iv_headers, headers);
+  rb_ivar_set(request, id_iv_body,
+              NIL_P(st->req_body) ? Qnil : rb_str_freeze(st->req_body));
+  if (NIL_P(into)) {
+    rb_obj_freeze(request);
+  }
+
+  st->assembling = 0;
+  st->req_method = Qnil;
+  st->req_scheme = Qnil;
+  st->req_authority = Qnil;
+  st->req_path = Qnil;
+  st->req_headers = Qnil;
+  st->req_body = Qnil;
+
+  return request;
+}
+
+/*
+ * Captures a request header field when request assembly is enabled.
+ * Returns 1 if the field was consumed and should not reach Ruby.
+ */
+int nghttp3_rb_assemble_header(VALUE rb_conn, int64_t stream_id,
+                               void *stream_user_data, nghttp3_rcbuf *name,
+                               nghttp3_rcbuf *value) {
+  ConnectionObj *obj;
+  nghttp3_vec name_vec, value_vec;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  if (!obj->assemble_requests) {
+    return 0;
+  }
+
+  name_vec = nghttp3_rcbuf_get_buf(name);
+  value_vec = nghttp3_rcbuf_get_buf(value);
+  assemble_header(
+      obj, connection_callback_state(obj, stream_id, stream_user_data, 1),
+      (const char *)name_vec.base, name_vec.len, (const char *)value_vec.base,
+      value_vec.len);
+
+  return 1;
+}
+
+/*
+ * Appends request body data to a stream whose headers were assembled.
+ * Returns 1 if the data was consumed and should not reach Ruby.
+ */
+int nghttp3_rb_assemble_data(VALUE rb_conn, int64_t stream_id,
+                             void *stream_user_data, const uint8_t *data,
+                             size_t datalen) {
+  ConnectionObj *obj;
+  stream_state *st;
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+
+  if (!obj->assemble_requests) {
+    return 0;
+  }
+  st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+  if (st == NULL || !st->assembling) {
+    return 0;
+  }
+
+  assemble_data(obj, st, (const char *)data, datalen);
+
+  return 1;
+}
+
+/*
+ * Creates the underlying nghttp3 connection for a fresh or recycled object.
+ */
+static void connection_open(VALUE self, ConnectionObj *obj, VALUE rb_settings,
+                            VALUE rb_callbacks, int is_server) {
+  nghttp3_settings settings;
+  nghttp3_settings *settings_ptr;
+  nghttp3_callbacks callbacks;
+  int rv;
+
+  if (NIL_P(rb_settings)) {
+    nghttp3_settings_default(&settings);
+    settings_ptr = &settings;
+  } else {
+    settings_ptr = nghttp3_rb_get_settings(rb_settings);
+  }
+  CONNECTION_WRITE(obj, obj->settings, rb_settings);
+
+  /* Initialize callbacks structure */
+  memset(&callbacks, 0, sizeof(callbacks));
+
+  /* C callbacks are always installed for memory accounting */
+  nghttp3_rb_setup_callbacks(&callbacks);
+  CONNECTION_WRITE(obj, obj->callbacks, rb_callbacks);
+
+  if (is_server) {
+    rv = nghttp3_conn_server_new(&obj->conn, &callbacks, settings_ptr, NULL,
+                                 &obj->self);
+  } else {
+    rv = nghttp3_conn_client_new(&obj->conn, &callbacks, settings_ptr, NULL,
+                                 &obj->self);
+  }
+
+  if (rv != 0) {
+    obj->conn = NULL;
+    obj->is_closed = 1;
+    nghttp3_rb_raise(rv, is_server ? "Failed to create server connection"
+                                   : "Failed to create client connection");
+  }
+
+  obj->is_closed = 0;
+  obj->is_server = is_server;
+}
+
+/*
+ * call-seq:
+ *   Connection.client_new(settings = nil, callbacks = nil) -> Connection
+ *
+ * Creates a new client HTTP/3 connection.
+ * If settings is nil, default settings are used.
+ * If callbacks is provided, it will be used for HTTP/3 event notifications.
+ */
+static VALUE rb_nghttp3_connection_client_new(int argc, VALUE *argv,
+                                              VALUE klass) {
+  VALUE rb_settings, rb_callbacks;
+  ConnectionObj *obj;
+  VALUE self;
+
+  rb_scan_args(argc, argv, "02", &rb_settings, &rb_callbacks);
+
+  self = connection_alloc(klass);
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  connection_open(self, obj, rb_settings, rb_callbacks, 0);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   Connection.server_new(settings = nil, callbacks = nil) -> Connection
+ *
+ * Creates a new server HTTP/3 connection.
+ * If settings is nil, default settings are used.
+ * If callbacks is provided, it will be used for HTTP/3 event notifications.
+ */
+static VALUE rb_nghttp3_connection_server_new(int argc, VALUE *argv,
+                                              VALUE klass) {
+  VALUE rb_settings, rb_callbacks;
+  ConnectionObj *obj;
+  VALUE self;
+
+  rb_scan_args(argc, argv, "02", &rb_settings, &rb_callbacks);
+
+  self = connection_alloc(klass);
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  connection_open(self, obj, rb_settings, rb_callbacks, 1);
+
+  return self;
+}
+
+/*
+ * Deletes the nghttp3 connection and releases all per-stream state and
+ * memory accounting in one pass. Settings, callbacks and limits are kept.
+ */
+static void connection_teardown(ConnectionObj *obj) {
+  if (obj->conn != NULL && !obj->is_closed) {
+    nghttp3_conn_del(obj->conn);
+  }
+  obj->conn = NULL;
+  obj->is_closed = 1;
+
+  connection_free_states(obj);
+  process_memory_used -= obj->memory_used;
+  obj->memory_used = 0;
+  obj->read_credit = 0;
+  obj->drain_pending = 0;
+  obj->in_read = 0;
+  obj->closing_stream = 0;
+}
+
+/*
+ * call-seq:
+ *   connection.recycle -> self
+ *   connection.recycle(settings, callbacks = nil) -> self
+ *
+ * Resets the connection for reuse by a new peer. Closes the current nghttp3
+ * connection if still open, clears all per-stream tables while keeping their
+ * allocated capacity, and opens a fresh connection of the same role. The
+ * previous settings and callbacks are reused unless new ones are given. The
+ * memory budget is kept.
+ */
+static VALUE rb_nghttp3_connection_recycle(int argc, VALUE *argv, VALUE self) {
+  VALUE rb_settings, rb_callbacks;
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  rb_scan_args(argc, argv, "02", &rb_settings, &rb_callbacks);
+  if (argc < 1) {
+    rb_settings = obj->settings;
+  }
+  if (argc < 2) {
+    rb_callbacks = obj->callbacks;
+  }
+
+  connection_teardown(obj);
+  bucket_configure(&obj->write_bucket, obj->write_bucket.rate,
+                   obj->write_bucket.burst, nghttp3_rb_monotonic_ns());
+  abuse_reset(obj);
+
+  connection_open(self, obj, rb_settings, rb_callbacks, obj->is_server);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.bind_control_stream(stream_id) -> self
+ *
+ * Binds the control stream to the given stream_id.
+ * This must be called before sending any HTTP frames.
+ */
+static VALUE rb_nghttp3_connection_bind_control_stream(VALUE self,
+                                                       VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  rv = nghttp3_conn_bind_control_stream(obj->conn, stream_id);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to bind control stream");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.bind_qpack_streams(encoder_stream_id, decoder_stream_id) -> self
+ *
+ * Binds the QPACK encoder and decoder streams.
+ * This must be called before sending any HTTP frames.
+ */
+static VALUE rb_nghttp3_connection_bind_qpack_streams(VALUE self,
+                                                      VALUE rb_enc_stream_id,
+                                                      VALUE rb_dec_stream_id) {
+  ConnectionObj *obj;
+  int64_t enc_stream_id, dec_stream_id;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  enc_stream_id = NUM2LL(rb_enc_stream_id);
+  dec_stream_id = NUM2LL(rb_dec_stream_id);
+
+  rv = nghttp3_conn_bind_qpack_streams(obj->conn, enc_stream_id, dec_stream_id);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to bind QPACK streams");
+  }
+
+  return self;
+}
+
+static int connection_header_bytes_i(VALUE name, VALUE value, VALUE arg) {
+  size_t *bytes = (size_t *)arg;
+
+  if (RB_TYPE_P(name, T_STRING)) {
+    *bytes += RSTRING_LEN(name);
+  }
+  if (RB_TYPE_P(value, T_STRING)) {
+    *bytes += RSTRING_LEN(value);
+  }
+  return ST_CONTINUE;
+}
+
+/* Body and header bytes held by the stream states, budget or not. Walks Ruby
+ * objects, so it must not run from connection_free. */
+static size_t connection_held_bytes(const ConnectionObj *obj) {
+  const stream_state *st;
+  size_t bytes = 0;
+  long i;
+
+  for (st = obj->state_list; st != NULL; st = st->next) {
+    const VALUE strings[] = {st->reader,   st->req_method,
+                             st->req_scheme, st->req_authority,
+                             st->req_path,   st->req_body};
+
+    for (i = 0; i < (long)(sizeof(strings) / sizeof(strings[0])); i++) {
+      if (RB_TYPE_P(strings[i], T_STRING)) {
+        bytes += RSTRING_LEN(strings[i]);
+      }
+    }
+    if (!NIL_P(st->pending)) {
+      for (i = 0; i < RARRAY_LEN(st->pending); i++) {
+        bytes += RSTRING_LEN(RARRAY_AREF(st->pending, i));
+      }
+    }
+    if (RB_TYPE_P(st->req_headers, T_HASH)) {
+      rb_hash_foreach(st->req_headers, connection_header_bytes_i,
+                      (VALUE)&bytes);
+    }
+  }
+  return bytes;
+}
+
+/*
+ * call-seq:
+ *   connection.close -> Hash
+ *
+ * Explicitly closes the connection and frees resources.
+ * After calling this, the connection object cannot be used.
+ *
+ * Every per-stream table is released at once, including body readers, user
+ * data and bodies awaiting acknowledgement, rather than when the connection
+ * is garbage collected. Returns what was released:
+ *
+ *   {streams: 12, bytes: 65536}
+ *
+ * where bytes counts the body and header data the streams held: bodies not
+ * yet sent or awaiting acknowledgement and assembled requests, whether or not
+ * a memory_budget is set. Closing an already closed connection releases
+ * nothing.
+ */
+static VALUE rb_nghttp3_connection_close(VALUE self) {
+  ConnectionObj *obj;
+  size_t streams = 0, bytes = 0;
+  VALUE result;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn != NULL && !obj->is_closed) {
+    streams = obj->states.len;
+    bytes = connection_held_bytes(obj);
+    connection_teardown(obj);
+    xfree(obj->states.slots);
+    memset(&obj->states, 0, sizeof(obj->states));
+  }
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("streams")), SIZET2NUM(streams));
+  rb_hash_aset(result, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+
+  return result;
+}
+
+/*
+ * call-seq:
+ *   connection.closed? -> true or false
+ *
+ * Returns true if the connection has been closed.
+ */
+static VALUE rb_nghttp3_connection_closed_p(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return obj->is_closed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   connection.server? -> true or false
+ *
+ * Returns true if this is a server connection.
+ */
+static VALUE rb_nghttp3_connection_server_p(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return obj->is_server ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   connection.client? -> true or false
+ *
+ * Returns true if this is a client connection.
+ */
+static VALUE rb_nghttp3_connection_client_p(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return obj->is_server ? Qfalse : Qtrue;
+}
+
+/* Returned by connection_read_stream once the peer crossed an abuse limit */
+#define CONNECTION_ERR_EXCESSIVE_LOAD (-100000)
+
+typedef struct {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  VALUE data;
+  int fin;
+  nghttp3_ssize rv;
+} read_stream_args;
+
+static VALUE connection_read_stream_body(VALUE arg) {
+  read_stream_args *args = (read_stream_args *)arg;
+  args->rv = nghttp3_conn_read_stream(
+      args->obj->conn, args->stream_id,
+      (const uint8_t *)RSTRING_PTR(args->data), RSTRING_LEN(args->data),
+      args->fin);
+  return Qnil;
+}
+
+/* Leaves read_stream even if a callback raised, so reject_stream goes back
+ * to closing streams at once */
+static VALUE connection_read_stream_ensure(VALUE arg) {
+  ((read_stream_args *)arg)->obj->in_read = 0;
+  return Qnil;
+}
+
+/* Shared by read_stream and read_stream_nonblock: feeds data to nghttp3, then
+ * processes rejections and drains credit. Returns the nghttp3 result plus
+ * credit, or CONNECTION_ERR_EXCESSIVE_LOAD */
+static nghttp3_ssize connection_read_stream(VALUE self, ConnectionObj *obj,
+                                            int argc, VALUE *argv) {
+  VALUE rb_stream_id, rb_data, rb_opts;
+  VALUE rb_fin = Qfalse;
+  read_stream_args args;
+  nghttp3_ssize rv;
+
+  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_data, &rb_opts);
+
+  if (!NIL_P(rb_opts)) {
+    VALUE rb_fin_val = rb_hash_aref(rb_opts, ID2SYM(rb_intern("fin")));
     if (!NIL_P(rb_fin_val)) {
       rb_fin = rb_fin_val;
     }
   }
 
+  Check_Type(rb_data, T_STRING);
+  args.obj = obj;
+  args.stream_id = NUM2LL(rb_stream_id);
+  args.data = rb_data;
+  args.fin = RTEST(rb_fin) ? 1 : 0;
+  args.rv = 0;
+
+  obj->read_credit = 0;
+  obj->in_read = 1;
+  rb_ensure(connection_read_stream_body, (VALUE)&args,
+            connection_read_stream_ensure, (VALUE)&args);
+  rv = args.rv;
+
+  if (obj->abuse_tripped >= 0) {
+    rb_nghttp3_connection_close(self);
+    return CONNECTION_ERR_EXCESSIVE_LOAD;
+  }
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  connection_process_rejections(self, obj);
+  connection_process_drain(self, obj);
+
+  if (obj->memory_budget > 0 || process_memory_budget > 0) {
+    rv += (nghttp3_ssize)obj->read_credit;
+  }
+
+  return rv;
+}
+
+/*
+ * call-seq:
+ *   connection.read_stream(stream_id, data, fin: false) -> Integer
+ *
+ * Reads data on a stream. This should be called when data is received from
+ * the QUIC layer. Returns the number of bytes consumed (for flow control).
+ *
+ * When a memory budget is set, the return value also includes the DATA
+ * payload the budget has room for. Payload withheld from the largest
+ * consumers is reported later through on_deferred_consume.
+ */
+static VALUE rb_nghttp3_connection_read_stream(int argc, VALUE *argv,
+                                               VALUE self) {
+  ConnectionObj *obj;
+  nghttp3_ssize rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  rv = connection_read_stream(self, obj, argc, argv);
+
+  if (rv == CONNECTION_ERR_EXCESSIVE_LOAD) {
+    rb_raise(rb_eNghttp3ExcessiveLoadError,
+             "Peer exceeded the %s limit; close the connection with "
+             "H3_EXCESSIVE_LOAD",
+             abuse_names[obj->abuse_tripped]);
+  }
+
+  if (rv < 0) {
+    nghttp3_rb_raise((int)rv, "Failed to read stream");
+  }
+
+  return LL2NUM(rv);
+}
+
+/*
+ * call-seq:
+ *   connection.read_stream_nonblock(stream_id, data, fin: false) -> Integer or Symbol
+ *
+ * Like read_stream, but returns a Symbol naming the error instead of raising,
+ * e.g. :stream_not_found, or :excessive_load once the peer crossed an abuse
+ * limit.
+ */
+static VALUE rb_nghttp3_connection_read_stream_nonblock(int argc, VALUE *argv,
+                                                        VALUE self) {
+  ConnectionObj *obj;
+  nghttp3_ssize rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  rv = connection_read_stream(self, obj, argc, argv);
+
+  if (rv == CONNECTION_ERR_EXCESSIVE_LOAD) {
+    return ID2SYM(rb_intern("excessive_load"));
+  }
+
+  if (rv < 0) {
+    return nghttp3_rb_error_symbol((int)rv);
+  }
+
+  return LL2NUM(rv);
+}
+
+/*
+ * call-seq:
+ *   connection.writev_stream -> Hash or nil
+ *
+ * Gets stream data to send to the QUIC layer.
+ * Returns a Hash with :stream_id, :fin, and :data keys, or nil if no data.
+ *
+ * With write rates set, :data is capped at the available tokens and nil is
+ * also returned while the connection is out of tokens; next_write_time tells
+ * when to try again.
+ */
+static VALUE rb_nghttp3_connection_writev_stream(VALUE self) {
+  ConnectionObj *obj;
+  nghttp3_vec vec[16];
+  nghttp3_ssize rv;
+  int64_t stream_id;
+  int fin;
+  VALUE rb_result, rb_data;
+  size_t i, total_len, limit, left;
+  uint64_t now = 0;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  limit = SIZE_MAX;
+  if (obj->write_bucket.rate > 0 || obj->shaped_streams > 0) {
+    now = nghttp3_rb_monotonic_ns();
+    limit = connection_shaper_refresh(obj, now);
+    if (limit == 0) {
+      return Qnil;
+    }
+  }
+
+  for (;;) {
+    size_t stream_limit;
+
+    rv = nghttp3_conn_writev_stream(obj->conn, &stream_id, &fin, vec, 16);
+
+    if (rv < 0) {
+      nghttp3_rb_raise((int)rv, "Failed to writev stream");
+    }
+
+    if (rv == 0 && stream_id == -1) {
+      return Qnil;
+    }
+
+    /* Calculate total length */
+    total_len = 0;
+    for (i = 0; i < (size_t)rv; i++) {
+      total_len += vec[i].len;
+    }
+
+    if (total_len == 0 || obj->shaped_streams == 0) {
+      break;
+    }
+    /* A stream out of tokens is blocked; let nghttp3 pick another */
+    stream_limit = connection_shaper_admit(obj, stream_id, now);
+    if (stream_limit > 0) {
+      if (stream_limit < limit) {
+        limit = stream_limit;
+      }
+      break;
+    }
+  }
+
+  if (total_len > limit) {
+    total_len = limit;
+    fin = 0;
+  }
+
+  rb_data = rb_str_buf_new(total_len);
+  left = total_len;
+  for (i = 0; i < (size_t)rv && left > 0; i++) {
+    size_t len = vec[i].len < left ? vec[i].len : left;
+    rb_str_buf_cat(rb_data, (const char *)vec[i].base, len);
+    left -= len;
+  }
+
+  rb_result = rb_hash_new();
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("stream_id")), LL2NUM(stream_id));
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("fin")), fin ? Qtrue : Qfalse);
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("data")), rb_data);
+
+  return rb_result;
+}
+
+/*
+ * call-seq:
+ *   connection.writev_packets(max_payload = 1200, max_packets = 64) -> Array
+ *
+ * Collects pending stream data across streams into packet-sized batches for
+ * transports that build QUIC packets themselves. Returns an Array of Hashes
+ * with :data (a String of at most max_payload bytes) and :slices, an Array of
+ * [stream_id, offset, length, fin] entries locating each stream's bytes
+ * within :data. Chunks that do not fit are split across batches.
+ *
+ * Unlike writev_stream, the write offset is advanced for every byte returned,
+ * so the transport must send everything it is given.
+ */
+static VALUE rb_nghttp3_connection_writev_packets(int argc, VALUE *argv,
+                                                  VALUE self) {
+  VALUE rb_max_payload, rb_max_packets;
+  ConnectionObj *obj;
+  nghttp3_vec vec[16];
+  nghttp3_ssize rv;
+  int64_t stream_id;
+  int fin;
+  size_t max_payload, max_packets, i, total, take, left, space, limit;
+  VALUE rb_packets, rb_data, rb_slices, rb_packet, rb_slice[4];
+  int rv2;
+  int shaped;
+  uint64_t now = 0;
+
+  rb_scan_args(argc, argv, "02", &rb_max_payload, &rb_max_packets);
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  max_payload = NIL_P(rb_max_payload) ? 1200 : NUM2SIZET(rb_max_payload);
+  max_packets = NIL_P(rb_max_packets) ? 64 : NUM2SIZET(rb_max_packets);
+
+  if (max_payload == 0 || max_packets == 0) {
+    rb_raise(rb_eArgError, "max_payload and max_packets must be positive");
+  }
+
+  rb_packets = rb_ary_new();
+  rb_data = Qnil;
+  rb_slices = Qnil;
+
+  shaped = obj->write_bucket.rate > 0 || obj->shaped_streams > 0;
+  limit = SIZE_MAX;
+  if (shaped) {
+    now = nghttp3_rb_monotonic_ns();
+    limit = connection_shaper_refresh(obj, now);
+  }
+
+  while (limit > 0) {
+    if (NIL_P(rb_data) || (size_t)RSTRING_LEN(rb_data) == max_payload) {
+      if ((size_t)RARRAY_LEN(rb_packets) == max_packets) {
+        break;
+      }
+      rb_data = rb_str_buf_new(max_payload);
+      rb_slices = rb_ary_new();
+      rb_packet = rb_hash_new();
+      rb_hash_aset(rb_packet, ID2SYM(rb_intern("data")), rb_data);
+      rb_hash_aset(rb_packet, ID2SYM(rb_intern("slices")), rb_slices);
+      rb_ary_push(rb_packets, rb_packet);
+    }
+
+    rv = nghttp3_conn_writev_stream(obj->conn, &stream_id, &fin, vec, 16);
+
+    if (rv < 0) {
+      nghttp3_rb_raise((int)rv, "Failed to writev stream");
+    }
+
+    if (rv == 0 && stream_id == -1) {
+      break;
+    }
+
+    total = 0;
+    for (i = 0; i < (size_t)rv; i++) {
+      total += vec[i].len;
+    }
+
+    if (total > 0 && obj->shaped_streams > 0) {
+      size_t stream_limit = connection_shaper_admit(obj, stream_id, now);
+      if (stream_limit == 0) {
+        continue;
+      }
+      if (total > stream_limit) {
+        total = stream_limit;
+        fin = 0;
+      }
+    }
+    if (total > limit) {
+      total = limit;
+      fin = 0;
+    }
+
+    /* Take as much as fits; nghttp3 hands back the rest on the next call */
+    space = max_payload - RSTRING_LEN(rb_data);
+    take = total < space ? total : space;
+
+    rb_slice[0] = LL2NUM(stream_id);
+    rb_slice[1] = LONG2NUM(RSTRING_LEN(rb_data));
+    rb_slice[2] = SIZET2NUM(take);
+    rb_slice[3] = (fin && take == total) ? Qtrue : Qfalse;
+    rb_ary_push(rb_slices, rb_ary_new_from_values(4, rb_slice));
+
+    left = take;
+    for (i = 0; i < (size_t)rv && left > 0; i++) {
+      size_t len = vec[i].len < left ? vec[i].len : left;
+      rb_str_buf_cat(rb_data, (const char *)vec[i].base, len);
+      left -= len;
+    }
+
+    rv2 = nghttp3_conn_add_write_offset(obj->conn, stream_id, take);
+
+    if (rv2 != 0) {
+      nghttp3_rb_raise(rv2, "Failed to add write offset");
+    }
+
+    if (shaped) {
+      connection_shaper_consume(obj, stream_id, take);
+      limit -= take;
+    }
+  }
+
+  /* Drop a trailing empty batch */
+  if (!NIL_P(rb_data) && RSTRING_LEN(rb_data) == 0 &&
+      RARRAY_LEN(rb_slices) == 0) {
+    rb_ary_pop(rb_packets);
+  }
+
+  return rb_packets;
+}
+
+/* Shared by add_write_offset and add_write_offset_nonblock */
+static int connection_add_write_offset(ConnectionObj *obj,
+                                       VALUE rb_stream_id, VALUE rb_n) {
+  int64_t stream_id = NUM2LL(rb_stream_id);
+  size_t n = NUM2SIZET(rb_n);
+  int rv;
+
+  rv = nghttp3_conn_add_write_offset(obj->conn, stream_id, n);
+
+  if (rv == 0) {
+    connection_shaper_consume(obj, stream_id, n);
+  }
+
+  return rv;
+}
+
+/*
+ * call-seq:
+ *   connection.add_write_offset(stream_id, n) -> self
+ *
+ * Tells the connection that n bytes have been accepted by the QUIC layer.
+ */
+static VALUE rb_nghttp3_connection_add_write_offset(VALUE self,
+                                                    VALUE rb_stream_id,
+                                                    VALUE rb_n) {
+  ConnectionObj *obj;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  rv = connection_add_write_offset(obj, rb_stream_id, rb_n);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to add write offset");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.add_write_offset_nonblock(stream_id, n) -> nil or Symbol
+ *
+ * Like add_write_offset, but returns a Symbol naming the error instead of
+ * raising.
+ */
+static VALUE rb_nghttp3_connection_add_write_offset_nonblock(VALUE self,
+                                                             VALUE rb_stream_id,
+                                                             VALUE rb_n) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  return nghttp3_rb_error_symbol(
+      connection_add_write_offset(obj, rb_stream_id, rb_n));
+}
+
+/* Shared by add_ack_offset and add_ack_offset_nonblock */
+static int connection_add_ack_offset(VALUE self, ConnectionObj *obj,
+                                     VALUE rb_stream_id, VALUE rb_n) {
+  int rv;
+
+  rv = nghttp3_conn_add_ack_offset(obj->conn, NUM2LL(rb_stream_id),
+                                   NUM2ULL(rb_n));
+
+  if (rv == 0) {
+    connection_process_drain(self, obj);
+  }
+
+  return rv;
+}
+
+/*
+ * call-seq:
+ *   connection.add_ack_offset(stream_id, n) -> self
+ *
+ * Tells the connection that n bytes have been acknowledged by the remote peer.
+ */
+static VALUE rb_nghttp3_connection_add_ack_offset(VALUE self,
+                                                  VALUE rb_stream_id,
+                                                  VALUE rb_n) {
+  ConnectionObj *obj;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  rv = connection_add_ack_offset(self, obj, rb_stream_id, rb_n);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to add ack offset");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.add_ack_offset_nonblock(stream_id, n) -> nil or Symbol
+ *
+ * Like add_ack_offset, but returns a Symbol naming the error instead of
+ * raising.
+ */
+static VALUE rb_nghttp3_connection_add_ack_offset_nonblock(VALUE self,
+                                                           VALUE rb_stream_id,
+                                                           VALUE rb_n) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  return nghttp3_rb_error_symbol(
+      connection_add_ack_offset(self, obj, rb_stream_id, rb_n));
+}
+
+/*
+ * call-seq:
+ *   connection.block_stream(stream_id) -> self
+ *
+ * Marks a stream as blocked due to QUIC flow control.
+ */
+static VALUE rb_nghttp3_connection_block_stream(VALUE self,
+                                                VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  stream_state *st;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  nghttp3_conn_block_stream(obj->conn, stream_id);
+
+  if (obj->shaped_streams > 0 &&
+      (st = connection_find_state(obj, stream_id, 0)) != NULL) {
+    st->flow_blocked = 1;
+  }
+
+  return self;
+}
+
+/* Shared by unblock_stream and unblock_stream_nonblock */
+static int connection_unblock_stream(ConnectionObj *obj, VALUE rb_stream_id) {
+  int64_t stream_id = NUM2LL(rb_stream_id);
+  stream_state *st;
+
+  if (obj->shaped_streams > 0 &&
+      (st = connection_find_state(obj, stream_id, 0)) != NULL) {
+    st->flow_blocked = 0;
+    if (st->shape_timer.armed) {
+      return 0;
+    }
+  }
+
+  return nghttp3_conn_unblock_stream(obj->conn, stream_id);
+}
+
+/*
+ * call-seq:
+ *   connection.unblock_stream(stream_id) -> self
+ *
+ * Marks a stream as unblocked (no longer blocked by QUIC flow control).
+ * A stream waiting for its write rate stays blocked until it may send.
+ */
+static VALUE rb_nghttp3_connection_unblock_stream(VALUE self,
+                                                  VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  rv = connection_unblock_stream(obj, rb_stream_id);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to unblock stream");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.unblock_stream_nonblock(stream_id) -> nil or Symbol
+ *
+ * Like unblock_stream, but returns a Symbol naming the error instead of
+ * raising.
+ */
+static VALUE rb_nghttp3_connection_unblock_stream_nonblock(VALUE self,
+                                                           VALUE rb_stream_id) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  return nghttp3_rb_error_symbol(connection_unblock_stream(obj, rb_stream_id));
+}
+
+/*
+ * call-seq:
+ *   connection.stream_writable?(stream_id) -> true or false
+ *
+ * Returns true if the stream is writable.
+ */
+static VALUE rb_nghttp3_connection_stream_writable_p(VALUE self,
+                                                     VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  rv = nghttp3_conn_is_stream_writable(obj->conn, stream_id);
+
+  return rv ? Qtrue : Qfalse;
+}
+
+/* Shared by close_stream and close_stream_nonblock */
+static int connection_close_stream(VALUE self, ConnectionObj *obj,
+                                   VALUE rb_stream_id, VALUE rb_error_code) {
+  int rv = connection_close_stream_locally(obj, NUM2LL(rb_stream_id),
+                                           NUM2ULL(rb_error_code));
+
+  if (rv == 0) {
+    connection_process_drain(self, obj);
+  }
+
+  return rv;
+}
+
+/*
+ * call-seq:
+ *   connection.close_stream(stream_id, app_error_code) -> self
+ *
+ * Closes the stream with the given error code.
+ */
+static VALUE rb_nghttp3_connection_close_stream(VALUE self, VALUE rb_stream_id,
+                                                VALUE rb_error_code) {
+  ConnectionObj *obj;
+  int rv;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  rv = connection_close_stream(self, obj, rb_stream_id, rb_error_code);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to close stream");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.close_stream_nonblock(stream_id, app_error_code) -> nil or Symbol
+ *
+ * Like close_stream, but returns a Symbol naming the error instead of
+ * raising, e.g. :stream_not_found for a stream that is already gone.
+ */
+static VALUE rb_nghttp3_connection_close_stream_nonblock(VALUE self,
+                                                         VALUE rb_stream_id,
+                                                         VALUE rb_error_code) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  return nghttp3_rb_error_symbol(
+      connection_close_stream(self, obj, rb_stream_id, rb_error_code));
+}
+
+/*
+ * call-seq:
+ *   connection.reject_stream(stream_id) -> self
+ *
+ * Rejects a peer request stream with H3_REQUEST_REJECTED, or cancels a
+ * request with H3_REQUEST_CANCELLED on a client connection. Safe to call from
+ * callbacks: the stream's remaining events are suppressed at once, and the
+ * stream is closed when read_stream returns. Once closed, the stream is
+ * reported through on_stream_rejected so the QUIC layer can reset it.
+ */
+static VALUE rb_nghttp3_connection_reject_stream(VALUE self,
+                                                 VALUE rb_stream_id) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  connection_mark_rejected(
+      obj, connection_find_state(obj, NUM2LL(rb_stream_id), 1));
+  if (!obj->in_read) {
+    connection_process_rejections(self, obj);
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.shutdown_stream_write(stream_id) -> self
+ *
+ * Prevents any further write operations on the stream.
+ */
+static VALUE rb_nghttp3_connection_shutdown_stream_write(VALUE self,
+                                                         VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int64_t stream_id;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  nghttp3_conn_shutdown_stream_write(obj->conn, stream_id);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.resume_stream(stream_id) -> self
+ *
+ * Resumes a stream that was blocked for input data.
+ */
+static VALUE rb_nghttp3_connection_resume_stream(VALUE self,
+                                                 VALUE rb_stream_id) {
+  ConnectionObj *obj;
+  int rv;
+  int64_t stream_id;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  rv = nghttp3_conn_resume_stream(obj->conn, stream_id);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to resume stream");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.resume_stream_nonblock(stream_id) -> nil or Symbol
+ *
+ * Like resume_stream, but returns a Symbol naming the error instead of
+ * raising.
+ */
+static VALUE rb_nghttp3_connection_resume_stream_nonblock(VALUE self,
+                                                          VALUE rb_stream_id) {
+  ConnectionObj *obj;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    return nghttp3_rb_error_symbol(NGHTTP3_ERR_INVALID_STATE);
+  }
+
+  return nghttp3_rb_error_symbol(
+      nghttp3_conn_resume_stream(obj->conn, NUM2LL(rb_stream_id)));
+}
+
+/*
+ * Callback function for providing body data to nghttp3.
+ */
+static nghttp3_ssize read_data_callback(nghttp3_conn *conn, int64_t stream_id,
+                                        nghttp3_vec *vec, size_t veccnt,
+                                        uint32_t *pflags, void *conn_user_data,
+                                        void *stream_user_data) {
+  VALUE rb_conn = nghttp3_rb_conn_from_user_data(conn_user_data);
+  ConnectionObj *obj;
+  stream_state *st;
+  VALUE reader, result;
+  VALUE rb_stream_id = LL2NUM(stream_id);
+
+  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
+  st = connection_callback_state(obj, stream_id, stream_user_data, 0);
+  reader = st != NULL ? st->reader : Qnil;
+
+  if (NIL_P(reader)) {
+    *pflags |= NGHTTP3_DATA_FLAG_EOF;
+    return 0;
+  }
+
+  if (RB_TYPE_P(reader, T_STRING)) {
+    /* String: return all data at once */
+    vec[0].base = (uint8_t *)RSTRING_PTR(reader);
+    vec[0].len = RSTRING_LEN(reader);
+    *pflags |= NGHTTP3_DATA_FLAG_EOF;
+
+    /* Keep string pending until ACKed */
+    if (NIL_P(st->pending)) {
+      CONNECTION_WRITE(obj, st->pending, rb_ary_new());
+    }
+    rb_ary_push(st->pending, reader);
+    connection_charge(obj, st, RSTRING_LEN(reader));
+    st->reader = Qnil;
+    return 1;
+  }
+
+  /* Pause producers while over budget; resumed when memory drains */
+  if (connection_over_budget(obj)) {
+    connection_block_producer(obj, st);
+    return NGHTTP3_ERR_WOULDBLOCK;
+  }
+
+  /* Proc: call it to get data */
+  result = rb_funcall(reader, rb_intern("call"), 1, rb_stream_id);
+
+  if (NIL_P(result)) {
+    *pflags |= NGHTTP3_DATA_FLAG_EOF;
+    st->reader = Qnil;
+    return 0;
+  }
+
+  if (SYMBOL_P(result) && SYM2ID(result) == rb_intern("wouldblock")) {
+    return NGHTTP3_ERR_WOULDBLOCK;
+  }
+
+  /* Result should be a String */
+  StringValue(result);
+
+  /* Keep pending for GC protection until ACKed */
+  if (NIL_P(st->pending)) {
+    CONNECTION_WRITE(obj, st->pending, rb_ary_new());
+  }
+  rb_ary_push(st->pending, result);
+  connection_charge(obj, st, RSTRING_LEN(result));
+
+  vec[0].base = (uint8_t *)RSTRING_PTR(result);
+  vec[0].len = RSTRING_LEN(result);
+
+  return 1;
+}
+
+/* Static data_reader structure for use in submit functions */
+static const nghttp3_data_reader data_reader = {.read_data =
+                                                    read_data_callback};
+
+/*
+ * call-seq:
+ *   connection.submit_request(stream_id, headers, body: nil) -> self
+ *   connection.submit_request(stream_id, headers) { |stream_id| ... } -> self
+ *
+ * Submits an HTTP request on the given stream.
+ * Headers should be an array of Nghttp3::NV objects.
+ */
+static VALUE rb_nghttp3_connection_submit_request(int argc, VALUE *argv,
+                                                  VALUE self) {
+  VALUE rb_stream_id, rb_headers, rb_opts, rb_body;
+  ConnectionObj *obj;
+  stream_state *st;
+  int64_t stream_id;
+  nghttp3_nv *nva;
+  size_t nvlen, i;
+  int rv, created;
+  int has_body = 0;
+
+  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_headers, &rb_opts);
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  if (obj->is_server) {
+    rb_raise(rb_eNghttp3InvalidStateError,
+             "submit_request can only be called on client connections");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  Check_Type(rb_headers, T_ARRAY);
+  nvlen = RARRAY_LEN(rb_headers);
+
+  /* Allocate and convert headers */
+  nva = ALLOCA_N(nghttp3_nv, nvlen);
+  for (i = 0; i < nvlen; i++) {
+    VALUE rb_nv = rb_ary_entry(rb_headers, i);
+    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
+  }
+
+  /* Check for body */
+  rb_body = Qnil;
+  if (!NIL_P(rb_opts)) {
+    rb_body = rb_hash_aref(rb_opts, ID2SYM(rb_intern("body")));
+  }
+
+  if (!NIL_P(rb_body)) {
+    StringValue(rb_body);
+  } else if (rb_block_given_p()) {
+    rb_body = rb_block_proc();
+  }
+  has_body = !NIL_P(rb_body);
+
+  /* The stream does not exist yet; its state is handed to nghttp3 here */
+  st = connection_find_state(obj, stream_id, 0);
+  created = st == NULL;
+  if (created) {
+    st = connection_find_state(obj, stream_id, 1);
+  }
+  CONNECTION_WRITE(obj, st->reader, rb_body);
+
+  rv = nghttp3_conn_submit_request(obj->conn, stream_id, nva, nvlen,
+                                   has_body ? &data_reader : NULL, st);
+
+  if (rv != 0) {
+    connection_abandon_state(obj, st, created);
+    nghttp3_rb_raise(rv, "Failed to submit request");
+  }
+  st->attached = 1;
+
+  return self;
+}
+
+/* Header fields of one request in a submit_requests batch */
+typedef struct {
+  nghttp3_nv *nva;
+  size_t nvlen;
+} submit_nva;
+
+static void submit_nva_add(submit_nva *batch, const char *name,
+                           size_t namelen, VALUE value) {
+  nghttp3_nv *nv = &batch->nva[batch->nvlen++];
+
+  /* Not StringValue: a converted String would not outlive this call */
+  Check_Type(value, T_STRING);
+  nv->name = (uint8_t *)name;
+  nv->namelen = namelen;
+  nv->value = (uint8_t *)RSTRING_PTR(value);
+  nv->valuelen = (size_t)RSTRING_LEN(value);
+  nv->flags = NGHTTP3_NV_FLAG_NONE;
+}
+
+static int submit_nva_header_i(VALUE name, VALUE value, VALUE arg) {
+  Check_Type(name, T_STRING);
+  submit_nva_add((submit_nva *)arg, RSTRING_PTR(name),
+                 (size_t)RSTRING_LEN(name), value);
+  return ST_CONTINUE;
+}
+
+typedef struct {
+  submit_nva *batch;
+  VALUE request;
+  VALUE authority;
+  VALUE fields;
+} submit_nva_fill_args;
+
+/*
+ * Fills the batch with a request's header fields. Runs under rb_protect, so
+ * a field of the wrong type does not leave its stream state behind.
+ */
+static VALUE submit_nva_fill(VALUE arg) {
+  submit_nva_fill_args *args = (submit_nva_fill_args *)arg;
+  submit_nva *batch = args->batch;
+
+  batch->nvlen = 0;
+  submit_nva_add(batch, ":method", 7, rb_attr_get(args->request, id_iv_method));
+  submit_nva_add(batch, ":scheme", 7, rb_attr_get(args->request, id_iv_scheme));
+  if (!NIL_P(args->authority)) {
+    submit_nva_add(batch, ":authority", 10, args->authority);
+  }
+  submit_nva_add(batch, ":path", 5, rb_attr_get(args->request, id_iv_path));
+  if (RB_TYPE_P(args->fields, T_HASH)) {
+    rb_hash_foreach(args->fields, submit_nva_header_i, (VALUE)batch);
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   connection.submit_requests(stream_id, requests) -> self
+ *   connection.submit_requests(stream_id, requests) { |id, request| ... }
+ *
+ * Submits many Nghttp3::Request objects in one call, on consecutive client
+ * bidirectional streams starting at stream_id. Header fields are read
+ * straight from each request, without building Nghttp3::NV objects, and
+ * must be Strings.
+ *
+ * The block, if given, is called for each request just before it is
+ * submitted. For a request without a String body it returns the data
+ * reader (any object responding to call, like submit_request's block) or
+ * nil for no body; its result is ignored for String bodies.
+ *
+ * Submission stops at the first error; the requests before it stay
+ * submitted.
+ */
+static VALUE rb_nghttp3_connection_submit_requests(VALUE self,
+                                                   VALUE rb_first_stream_id,
+                                                   VALUE rb_requests) {
+  ConnectionObj *obj;
+  stream_state *st;
+  submit_nva batch;
+  submit_nva_fill_args fill;
+  VALUE tmp = 0;
+  size_t cap = 0;
+  int64_t stream_id;
+  long i;
+  int rv, created, state;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  if (obj->is_server) {
+    rb_raise(rb_eNghttp3InvalidStateError,
+             "submit_requests can only be called on client connections");
+  }
+
+  stream_id = NUM2LL(rb_first_stream_id);
+  Check_Type(rb_requests, T_ARRAY);
+  resolve_request_classes();
+  batch.nva = NULL;
+
+  /* Check the whole batch first so a bad element submits nothing */
+  for (i = 0; i < RARRAY_LEN(rb_requests); i++) {
+    if (!rb_obj_is_kind_of(RARRAY_AREF(rb_requests, i), request_class)) {
+      rb_raise(rb_eTypeError, "expected a Nghttp3::Request");
+    }
+  }
+
+  for (i = 0; i < RARRAY_LEN(rb_requests); i++, stream_id += 4) {
+    VALUE request = RARRAY_AREF(rb_requests, i);
+    VALUE authority, headers, fields, body;
+    size_t nvlen;
+
+    /* The block may have changed the array */
+    if (!rb_obj_is_kind_of(request, request_class)) {
+      rb_raise(rb_eTypeError, "expected a Nghttp3::Request");
+    }
+
+    body = rb_attr_get(request, id_iv_body);
+    if (rb_block_given_p()) {
+      VALUE reader = rb_yield_values(2, LL2NUM(stream_id), request);
+      if (!RB_TYPE_P(body, T_STRING)) {
+        body = reader;
+      }
+    } else if (!NIL_P(body) && !RB_TYPE_P(body, T_STRING)) {
+      rb_raise(rb_eArgError, "streaming request bodies need a reader block");
+    }
+
+    authority = rb_attr_get(request, id_iv_authority);
+    headers = rb_attr_get(request, id_iv_headers);
+    fields = rb_obj_is_kind_of(headers, headers_class)
+                 ? rb_attr_get(headers, id_iv_headers)
+                 : Qnil;
+    nvlen = 4 + (RB_TYPE_P(fields, T_HASH) ? RHASH_SIZE(fields) : 0);
+
+    /* The stream does not exist yet; its state is handed to nghttp3 here */
+    st = connection_find_state(obj, stream_id, 0);
+    created = st == NULL;
+    if (created) {
+      st = connection_find_state(obj, stream_id, 1);
+    }
+    CONNECTION_WRITE(obj, st->reader, body);
+
+    if (nvlen > cap) {
+      if (tmp) {
+        ALLOCV_END(tmp);
+      }
+      cap = nvlen * 2;
+      batch.nva = ALLOCV_N(nghttp3_nv, tmp, cap);
+    }
+
+    /*
+     * Nothing below allocates Ruby objects, so the String pointers in the
+     * batch stay valid until nghttp3 has copied them.
+     */
+    fill.batch = &batch;
+    fill.request = request;
+    fill.authority = authority;
+    fill.fields = fields;
+    rb_protect(submit_nva_fill, (VALUE)&fill, &state);
+
+    rv = 0;
+    if (state == 0) {
+      rv = nghttp3_conn_submit_request(obj->conn, stream_id, batch.nva,
+                                       batch.nvlen,
+                                       NIL_P(body) ? NULL : &data_reader, st);
+    }
+    if (state != 0 || rv != 0) {
+      connection_abandon_state(obj, st, created);
+      if (tmp) {
+        ALLOCV_END(tmp);
+      }
+      if (state != 0) {
+        rb_jump_tag(state);
+      }
+      nghttp3_rb_raise(rv, "Failed to submit request");
+    }
+    st->attached = 1;
+  }
+
+  if (tmp) {
+    ALLOCV_END(tmp);
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.submit_response(stream_id, headers, body: nil) -> self
+ *   connection.submit_response(stream_id, headers) { |stream_id| ... } -> self
+ *
+ * Submits an HTTP response on the given stream.
+ * Headers should be an array of Nghttp3::NV objects.
+ */
+static VALUE rb_nghttp3_connection_submit_response(int argc, VALUE *argv,
+                                                   VALUE self) {
+  VALUE rb_stream_id, rb_headers, rb_opts, rb_body;
+  ConnectionObj *obj;
+  stream_state *st;
+  int64_t stream_id;
+  nghttp3_nv *nva;
+  size_t nvlen, i;
+  int rv;
+  int has_body = 0;
+
+  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_headers, &rb_opts);
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  if (obj->conn == NULL || obj->is_closed) {
+    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  }
+
+  if (!obj->is_server) {
+    rb_raise(rb_eNghttp3InvalidStateError,
+             "submit_response can only be called on server connections");
+  }
+
+  stream_id = NUM2LL(rb_stream_id);
+  Check_Type(rb_headers, T_ARRAY);
+  nvlen = RARRAY_LEN(rb_headers);
+
+  /* Allocate and convert headers */
+  nva = ALLOCA_N(nghttp3_nv, nvlen);
+  for (i = 0; i < nvlen; i++) {
+    VALUE rb_nv = rb_ary_entry(rb_headers, i);
+    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
+  }
+
+  /* Check for body */
+  rb_body = Qnil;
+  if (!NIL_P(rb_opts)) {
+    rb_body = rb_hash_aref(rb_opts, ID2SYM(rb_intern("body")));
+  }
+
+  if (!NIL_P(rb_body)) {
+    StringValue(rb_body);
+  } else if (rb_block_given_p()) {
+    rb_body = rb_block_proc();
+  }
+  has_body = !NIL_P(rb_body);
+
+  st = connection_find_state(obj, stream_id, has_body);
+  if (st != NULL) {
+    CONNECTION_WRITE(obj, st->reader, rb_body);
+  }
+
+  rv = nghttp3_conn_submit_response(obj->conn, stream_id, nva, nvlen,
+                                    has_body ? &data_reader : NULL);
+
+  if (rv != 0) {
+    if (st != NULL) {
+      st->reader = Qnil;
+    }
+    nghttp3_rb_raise(rv, "Failed to submit response");
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   connection.submit_info(stream_id, headers) -> self
+ *
+ * Submits a 1xx informational response on the given stream.
+ * Headers should be an array of Nghttp3::NV objects.
+ */
+static VALUE rb_nghttp3_connection_submit_info(VALUE self, VALUE rb_stream_id,
+                                               VALUE rb_headers) {
+  ConnectionObj *obj;
+  int64_t stream_id;
+  nghttp3_nv *nva;
+  size_t nvlen, i;
+  int rv;
+
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
   if (obj->conn == NULL || obj->is_closed) {
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  Check_Type(rb_data, T_STRING);
   stream_id = NUM2LL(rb_stream_id);
-  fin = RTEST(rb_fin) ? 1 : 0;
+  Check_Type(rb_headers, T_ARRAY);
+  nvlen = RARRAY_LEN(rb_headers);
 
-  rv = nghttp3_conn_read_stream(obj->conn, stream_id,
-                                (const uint8_t *)RSTRING_PTR(rb_data),
-                                RSTRING_LEN(rb_data), fin);
+  nva = ALLOCA_N(nghttp3_nv, nvlen);
+  for (i = 0; i < nvlen; i++) {
+    VALUE rb_nv = rb_ary_entry(rb_headers, i);
+    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
+  }
 
-  if (rv < 0) {
-    nghttp3_rb_raise((int)rv, "Failed to read stream");
+  rv = nghttp3_conn_submit_info(obj->conn, stream_id, nva, nvlen);
+
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to submit info");
   }
 
-  return LL2NUM(rv);
+  return self;
 }
 
 /*
  * call-seq:
- *   connection.writev_stream -> Hash or nil
+ *   connection.submit_trailers(stream_id, trailers) -> self
  *
- * Gets stream data to send to the QUIC layer.
- * Returns a Hash with :stream_id, :fin, and :data keys, or nil if no data.
+ * Submits trailer headers on the given stream.
+ * This implicitly ends the stream.
+ * Trailers should be an array of Nghttp3::NV objects.
  */
-static VALUE rb_nghttp3_connection_writev_stream(VALUE self) {
+static VALUE rb_nghttp3_connection_submit_trailers(VALUE self,
+                                                   VALUE rb_stream_id,
+                                                   VALUE rb_trailers) {
   ConnectionObj *obj;
-  nghttp3_vec vec[16];
-  nghttp3_ssize rv;
   int64_t stream_id;
-  int fin;
-  VALUE rb_result, rb_data;
-  size_t i, total_len;
+  nghttp3_nv *nva;
+  size_t nvlen, i;
+  int rv;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -367,48 +2996,35 @@ static VALUE rb_nghttp3_connection_writev_stream(VALUE self) {
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  rv = nghttp3_conn_writev_stream(obj->conn, &stream_id, &fin, vec, 16);
-
-  if (rv < 0) {
-    nghttp3_rb_raise((int)rv, "Failed to writev stream");
-  }
+  stream_id = NUM2LL(rb_stream_id);
+  Check_Type(rb_trailers, T_ARRAY);
+  nvlen = RARRAY_LEN(rb_trailers);
 
-  if (rv == 0 && stream_id == -1) {
-    return Qnil;
+  nva = ALLOCA_N(nghttp3_nv, nvlen);
+  for (i = 0; i < nvlen; i++) {
+    VALUE rb_nv = rb_ary_entry(rb_trailers, i);
+    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
   }
 
-  /* Calculate total length and concatenate data */
-  total_len = 0;
-  for (i = 0; i < (size_t)rv; i++) {
-    total_len += vec[i].len;
-  }
+  rv = nghttp3_conn_submit_trailers(obj->conn, stream_id, nva, nvlen);
 
-  rb_data = rb_str_buf_new(total_len);
-  for (i = 0; i < (size_t)rv; i++) {
-    rb_str_buf_cat(rb_data, (const char *)vec[i].base, vec[i].len);
+  if (rv != 0) {
+    nghttp3_rb_raise(rv, "Failed to submit trailers");
   }
 
-  rb_result = rb_hash_new();
-  rb_hash_aset(rb_result, ID2SYM(rb_intern("stream_id")), LL2NUM(stream_id));
-  rb_hash_aset(rb_result, ID2SYM(rb_intern("fin")), fin ? Qtrue : Qfalse);
-  rb_hash_aset(rb_result, ID2SYM(rb_intern("data")), rb_data);
-
-  return rb_result;
+  return self;
 }
 
 /*
  * call-seq:
- *   connection.add_write_offset(stream_id, n) -> self
+ *   connection.submit_shutdown_notice -> self
  *
- * Tells the connection that n bytes have been accepted by the QUIC layer.
+ * Signals the intention to shut down the connection gracefully.
+ * After calling this, no new streams will be accepted.
  */
-static VALUE rb_nghttp3_connection_add_write_offset(VALUE self,
-                                                    VALUE rb_stream_id,
-                                                    VALUE rb_n) {
+static VALUE rb_nghttp3_connection_submit_shutdown_notice(VALUE self) {
   ConnectionObj *obj;
   int rv;
-  int64_t stream_id;
-  size_t n;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -416,13 +3032,10 @@ static VALUE rb_nghttp3_connection_add_write_offset(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  n = NUM2SIZET(rb_n);
-
-  rv = nghttp3_conn_add_write_offset(obj->conn, stream_id, n);
+  rv = nghttp3_conn_submit_shutdown_notice(obj->conn);
 
   if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to add write offset");
+    nghttp3_rb_raise(rv, "Failed to submit shutdown notice");
   }
 
   return self;
@@ -430,17 +3043,13 @@ static VALUE rb_nghttp3_connection_add_write_offset(VALUE self,
 
 /*
  * call-seq:
- *   connection.add_ack_offset(stream_id, n) -> self
+ *   connection.shutdown -> self
  *
- * Tells the connection that n bytes have been acknowledged by the remote peer.
+ * Initiates graceful shutdown. Should be called after submit_shutdown_notice.
  */
-static VALUE rb_nghttp3_connection_add_ack_offset(VALUE self,
-                                                  VALUE rb_stream_id,
-                                                  VALUE rb_n) {
+static VALUE rb_nghttp3_connection_shutdown(VALUE self) {
   ConnectionObj *obj;
   int rv;
-  int64_t stream_id;
-  uint64_t n;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -448,13 +3057,10 @@ static VALUE rb_nghttp3_connection_add_ack_offset(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  n = NUM2ULL(rb_n);
-
-  rv = nghttp3_conn_add_ack_offset(obj->conn, stream_id, n);
+  rv = nghttp3_conn_shutdown(obj->conn);
 
   if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to add ack offset");
+    nghttp3_rb_raise(rv, "Failed to shutdown connection");
   }
 
   return self;
@@ -462,14 +3068,15 @@ static VALUE rb_nghttp3_connection_add_ack_offset(VALUE self,
 
 /*
  * call-seq:
- *   connection.block_stream(stream_id) -> self
+ *   connection.set_stream_user_data(stream_id, data) -> self
  *
- * Marks a stream as blocked due to QUIC flow control.
+ * Associates arbitrary data with the given stream.
  */
-static VALUE rb_nghttp3_connection_block_stream(VALUE self,
-                                                VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_set_stream_user_data(VALUE self,
+                                                        VALUE rb_stream_id,
+                                                        VALUE rb_data) {
   ConnectionObj *obj;
-  int64_t stream_id;
+  stream_state *st;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -477,23 +3084,22 @@ static VALUE rb_nghttp3_connection_block_stream(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  nghttp3_conn_block_stream(obj->conn, stream_id);
+  st = connection_find_state(obj, NUM2LL(rb_stream_id), 1);
+  CONNECTION_WRITE(obj, st->user_data, rb_data);
 
   return self;
 }
 
 /*
  * call-seq:
- *   connection.unblock_stream(stream_id) -> self
+ *   connection.get_stream_user_data(stream_id) -> Object or nil
  *
- * Marks a stream as unblocked (no longer blocked by QUIC flow control).
+ * Returns the data associated with the given stream, or nil if none.
  */
-static VALUE rb_nghttp3_connection_unblock_stream(VALUE self,
-                                                  VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_get_stream_user_data(VALUE self,
+                                                        VALUE rb_stream_id) {
   ConnectionObj *obj;
-  int rv;
-  int64_t stream_id;
+  stream_state *st;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -501,52 +3107,71 @@ static VALUE rb_nghttp3_connection_unblock_stream(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  rv = nghttp3_conn_unblock_stream(obj->conn, stream_id);
+  st = connection_find_state(obj, NUM2LL(rb_stream_id), 0);
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to unblock stream");
-  }
+  return st != NULL ? st->user_data : Qnil;
+}
 
-  return self;
+/*
+ * call-seq:
+ *   connection.assemble_requests? -> true or false
+ *
+ * Returns true if request header blocks are assembled in C.
+ */
+static VALUE rb_nghttp3_connection_assemble_requests_p(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return obj->assemble_requests ? Qtrue : Qfalse;
 }
 
 /*
  * call-seq:
- *   connection.stream_writable?(stream_id) -> true or false
+ *   connection.assemble_requests = enabled
  *
- * Returns true if the stream is writable.
+ * Enables request assembly on a server connection. Header fields and body
+ * data of incoming requests are then stored with the stream instead of
+ * being passed to the on_recv_header and on_recv_data callbacks, and
+ * #take_request returns them as a frozen Request. Trailers and all other
+ * callbacks are unaffected.
  */
-static VALUE rb_nghttp3_connection_stream_writable_p(VALUE self,
-                                                     VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_set_assemble_requests(VALUE self,
+                                                         VALUE rb_enabled) {
   ConnectionObj *obj;
-  int64_t stream_id;
-  int rv;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  if (RTEST(rb_enabled)) {
+    if (!obj->is_server) {
+      rb_raise(rb_eNghttp3InvalidStateError,
+               "Request assembly requires a server connection");
+    }
   }
+  obj->assemble_requests = RTEST(rb_enabled);
 
-  stream_id = NUM2LL(rb_stream_id);
-  rv = nghttp3_conn_is_stream_writable(obj->conn, stream_id);
-
-  return rv ? Qtrue : Qfalse;
+  return rb_enabled;
 }
 
 /*
  * call-seq:
- *   connection.close_stream(stream_id, app_error_code) -> self
+ *   connection.take_request(stream_id) -> Request or nil
+ *   connection.take_request(stream_id, into) -> Request or nil
  *
- * Closes the stream with the given error code.
+ * Returns the request assembled for the stream, with the body received so
+ * far, and clears it from the stream. Returns nil if no header block was
+ * assembled or the request was already taken.
+ *
+ * The request is a new frozen Request unless an unfrozen Request is given
+ * as into (for example Request.allocate, or one released to a RequestPool),
+ * which is refilled in place together with its Headers. The header Hash it
+ * held is kept for the connection's next request.
  */
-static VALUE rb_nghttp3_connection_close_stream(VALUE self, VALUE rb_stream_id,
-                                                VALUE rb_error_code) {
+static VALUE rb_nghttp3_connection_take_request(int argc, VALUE *argv,
+                                                VALUE self) {
+  VALUE rb_stream_id, rb_into;
   ConnectionObj *obj;
-  int rv;
-  int64_t stream_id;
-  uint64_t app_error_code;
+  stream_state *st;
+
+  rb_scan_args(argc, argv, "11", &rb_stream_id, &rb_into);
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -554,28 +3179,26 @@ static VALUE rb_nghttp3_connection_close_stream(VALUE self, VALUE rb_stream_id,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  app_error_code = NUM2ULL(rb_error_code);
-
-  rv = nghttp3_conn_close_stream(obj->conn, stream_id, app_error_code);
-
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to close stream");
+  st = connection_find_state(obj, NUM2LL(rb_stream_id), 0);
+  if (st == NULL || !st->assembling) {
+    return Qnil;
   }
 
-  return self;
+  return assemble_request(obj, st, rb_into);
 }
 
 /*
  * call-seq:
- *   connection.shutdown_stream_write(stream_id) -> self
+ *   connection.assemble_header(stream_id, name, value) -> self
  *
- * Prevents any further write operations on the stream.
+ * Adds a request header field to the stream as if it had been received
+ * from the peer. For transports that decode header blocks themselves.
  */
-static VALUE rb_nghttp3_connection_shutdown_stream_write(VALUE self,
-                                                         VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_assemble_header(VALUE self,
+                                                   VALUE rb_stream_id,
+                                                   VALUE rb_name,
+                                                   VALUE rb_value) {
   ConnectionObj *obj;
-  int64_t stream_id;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -583,23 +3206,29 @@ static VALUE rb_nghttp3_connection_shutdown_stream_write(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  nghttp3_conn_shutdown_stream_write(obj->conn, stream_id);
+  StringValue(rb_name);
+  StringValue(rb_value);
+  if (has_upper(RSTRING_PTR(rb_name), RSTRING_LEN(rb_name))) {
+    rb_name = rb_funcall(rb_name, rb_intern("downcase"), 0);
+  }
+  assemble_header(obj, connection_find_state(obj, NUM2LL(rb_stream_id), 1),
+                  RSTRING_PTR(rb_name), RSTRING_LEN(rb_name),
+                  RSTRING_PTR(rb_value), RSTRING_LEN(rb_value));
 
   return self;
 }
 
 /*
  * call-seq:
- *   connection.resume_stream(stream_id) -> self
+ *   connection.assemble_data(stream_id, data) -> self
  *
- * Resumes a stream that was blocked for input data.
+ * Appends request body data to the stream as if it had been received from
+ * the peer.
  */
-static VALUE rb_nghttp3_connection_resume_stream(VALUE self,
-                                                 VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_assemble_data(VALUE self,
+                                                 VALUE rb_stream_id,
+                                                 VALUE rb_data) {
   ConnectionObj *obj;
-  int rv;
-  int64_t stream_id;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -607,107 +3236,171 @@ static VALUE rb_nghttp3_connection_resume_stream(VALUE self,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  rv = nghttp3_conn_resume_stream(obj->conn, stream_id);
-
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to resume stream");
-  }
+  StringValue(rb_data);
+  assemble_data(obj, connection_find_state(obj, NUM2LL(rb_stream_id), 1),
+                RSTRING_PTR(rb_data), RSTRING_LEN(rb_data));
 
   return self;
 }
 
 /*
- * Callback function for providing body data to nghttp3.
+ * call-seq:
+ *   connection.memory_budget -> Integer
+ *
+ * Returns the per-connection memory budget in bytes (0 means unlimited).
  */
-static nghttp3_ssize read_data_callback(nghttp3_conn *conn, int64_t stream_id,
-                                        nghttp3_vec *vec, size_t veccnt,
-                                        uint32_t *pflags, void *conn_user_data,
-                                        void *stream_user_data) {
-  VALUE rb_conn = (VALUE)conn_user_data;
+static VALUE rb_nghttp3_connection_get_memory_budget(VALUE self) {
   ConnectionObj *obj;
-  VALUE readers, reader, result;
-  VALUE rb_stream_id = LL2NUM(stream_id);
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return SIZET2NUM(obj->memory_budget);
+}
 
-  TypedData_Get_Struct(rb_conn, ConnectionObj, &connection_data_type, obj);
-  readers = obj->stream_data_readers;
-  reader = rb_hash_aref(readers, rb_stream_id);
+/*
+ * call-seq:
+ *   connection.memory_budget = bytes
+ *
+ * Sets the byte budget covering decoded headers, buffered request bodies and
+ * response data retained until acknowledged. While over budget the connection
+ * withholds receive credit from the largest consumers, pauses body producers
+ * and rejects new request streams with H3_REQUEST_REJECTED. Once every stream
+ * holding memory has its credit withheld, e.g. for a body larger than the
+ * budget, the largest is reset (see on_stream_rejected) rather than left
+ * waiting for credit that would never come. Set to 0 to disable.
+ */
+static VALUE rb_nghttp3_connection_set_memory_budget(VALUE self,
+                                                     VALUE rb_budget) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  obj->memory_budget = NUM2SIZET(rb_budget);
+  obj->drain_pending = 1;
+  connection_process_drain(self, obj);
+  return rb_budget;
+}
 
-  if (NIL_P(reader)) {
-    *pflags |= NGHTTP3_DATA_FLAG_EOF;
-    return 0;
-  }
+/*
+ * call-seq:
+ *   connection.memory_used -> Integer
+ *
+ * Returns the number of bytes currently charged to this connection. Nothing
+ * is charged while neither the connection nor the process has a budget.
+ */
+static VALUE rb_nghttp3_connection_get_memory_used(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return SIZET2NUM(obj->memory_used);
+}
 
-  if (RB_TYPE_P(reader, T_STRING)) {
-    /* String: return all data at once */
-    vec[0].base = (uint8_t *)RSTRING_PTR(reader);
-    vec[0].len = RSTRING_LEN(reader);
-    *pflags |= NGHTTP3_DATA_FLAG_EOF;
+/*
+ * call-seq:
+ *   connection.over_memory_budget? -> true or false
+ *
+ * Returns true if the connection or process budget is exceeded.
+ */
+static VALUE rb_nghttp3_connection_over_memory_budget_p(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return connection_over_budget(obj) ? Qtrue : Qfalse;
+}
 
-    /* Keep string in pending_data until ACKed */
-    VALUE pending = rb_hash_aref(obj->pending_data, rb_stream_id);
-    if (NIL_P(pending)) {
-      pending = rb_ary_new();
-      rb_hash_aset(obj->pending_data, rb_stream_id, pending);
-    }
-    rb_ary_push(pending, reader);
-    rb_hash_delete(readers, rb_stream_id);
-    return 1;
-  }
+/*
+ * call-seq:
+ *   connection.release_memory(stream_id, bytes = nil) -> Integer
+ *
+ * Releases bytes charged to the stream, or everything if bytes is nil. Call
+ * this once buffered request data has been handed off. Returns the number of
+ * bytes released. From a callback, withheld credit is handed out once
+ * read_stream returns.
+ */
+static VALUE rb_nghttp3_connection_release_memory(int argc, VALUE *argv,
+                                                  VALUE self) {
+  VALUE rb_stream_id, rb_bytes;
+  ConnectionObj *obj;
+  stream_state *st;
+  size_t released = 0;
 
-  /* Proc: call it to get data */
-  result = rb_funcall(reader, rb_intern("call"), 1, rb_stream_id);
+  rb_scan_args(argc, argv, "11", &rb_stream_id, &rb_bytes);
 
-  if (NIL_P(result)) {
-    *pflags |= NGHTTP3_DATA_FLAG_EOF;
-    rb_hash_delete(readers, rb_stream_id);
-    return 0;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  st = connection_find_state(obj, NUM2LL(rb_stream_id), 0);
+  if (st != NULL) {
+    released = connection_release(
+        obj, st, NIL_P(rb_bytes) ? st->charged : NUM2SIZET(rb_bytes));
+  }
+  if (!obj->in_read) {
+    connection_process_drain(self, obj);
   }
 
-  if (SYMBOL_P(result) && SYM2ID(result) == rb_intern("wouldblock")) {
-    return NGHTTP3_ERR_WOULDBLOCK;
+  return SIZET2NUM(released);
+}
+
+/*
+ * call-seq:
+ *   connection.stream_timeouts -> Hash
+ *
+ * Returns the per-stream timeouts in milliseconds as
+ * <tt>{header:, idle:, deadline:}</tt>; 0 means disabled.
+ */
+static VALUE rb_nghttp3_connection_get_stream_timeouts(VALUE self) {
+  ConnectionObj *obj;
+  VALUE hash = rb_hash_new();
+  int i;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(stream_timer_names[i])),
+                 ULL2NUM(obj->timeouts[i]));
   }
 
-  /* Result should be a String */
-  StringValue(result);
+  return hash;
+}
+
+/*
+ * call-seq:
+ *   connection.stream_timeouts = {header: ms, idle: ms, deadline: ms}
+ *
+ * Configures timeouts armed automatically for each stream. The header timer
+ * runs from the start of a header block until it completes, the idle timer
+ * restarts on every chunk of body data until the peer ends the stream, and
+ * the deadline runs from the first header block until the stream closes.
+ * Omitted or nil entries are disabled. Applies to streams started afterwards.
+ */
+static VALUE rb_nghttp3_connection_set_stream_timeouts(VALUE self,
+                                                       VALUE rb_timeouts) {
+  ConnectionObj *obj;
+  int i;
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  Check_Type(rb_timeouts, T_HASH);
 
-  /* Store in pending_data for GC protection until ACKed */
-  VALUE pending = rb_hash_aref(obj->pending_data, rb_stream_id);
-  if (NIL_P(pending)) {
-    pending = rb_ary_new();
-    rb_hash_aset(obj->pending_data, rb_stream_id, pending);
+  for (i = 0; i < STREAM_TIMER_MAX; i++) {
+    VALUE v =
+        rb_hash_aref(rb_timeouts, ID2SYM(rb_intern(stream_timer_names[i])));
+    obj->timeouts[i] = NIL_P(v) ? 0 : NUM2ULL(v);
   }
-  rb_ary_push(pending, result);
-
-  vec[0].base = (uint8_t *)RSTRING_PTR(result);
-  vec[0].len = RSTRING_LEN(result);
 
-  return 1;
+  return rb_timeouts;
 }
 
-/* Static data_reader structure for use in submit functions */
-static const nghttp3_data_reader data_reader = {.read_data =
-                                                    read_data_callback};
-
 /*
  * call-seq:
- *   connection.submit_request(stream_id, headers, body: nil) -> self
- *   connection.submit_request(stream_id, headers) { |stream_id| ... } -> self
+ *   connection.arm_timer(stream_id, kind, timeout_ms, now = nil) -> self
  *
- * Submits an HTTP request on the given stream.
- * Headers should be an array of Nghttp3::NV objects.
+ * Arms or re-arms a stream timer of the given kind (:header, :idle or
+ * :deadline) to fire timeout_ms after now. Times are monotonic milliseconds as
+ * returned by <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC,
+ * :millisecond)</tt>; nil means the current time.
  */
-static VALUE rb_nghttp3_connection_submit_request(int argc, VALUE *argv,
-                                                  VALUE self) {
-  VALUE rb_stream_id, rb_headers, rb_opts, rb_body;
+static VALUE rb_nghttp3_connection_arm_timer(int argc, VALUE *argv,
+                                             VALUE self) {
+  VALUE rb_stream_id, rb_kind, rb_timeout, rb_now;
   ConnectionObj *obj;
-  int64_t stream_id;
-  nghttp3_nv *nva;
-  size_t nvlen, i;
-  int rv;
-  int has_body = 0;
+  int kind;
 
-  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_headers, &rb_opts);
+  rb_scan_args(argc, argv, "31", &rb_stream_id, &rb_kind, &rb_timeout,
+               &rb_now);
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -715,132 +3408,153 @@ static VALUE rb_nghttp3_connection_submit_request(int argc, VALUE *argv,
     rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
   }
 
-  if (obj->is_server) {
-    rb_raise(rb_eNghttp3InvalidStateError,
-             "submit_request can only be called on client connections");
-  }
-
-  stream_id = NUM2LL(rb_stream_id);
-  Check_Type(rb_headers, T_ARRAY);
-  nvlen = RARRAY_LEN(rb_headers);
+  kind = stream_timer_kind(rb_kind);
+  connection_arm_timer(obj, NUM2LL(rb_stream_id), kind, NUM2ULL(rb_timeout),
+                       NIL_P(rb_now) ? nghttp3_rb_monotonic_ms()
+                                     : NUM2ULL(rb_now));
 
-  /* Allocate and convert headers */
-  nva = ALLOCA_N(nghttp3_nv, nvlen);
-  for (i = 0; i < nvlen; i++) {
-    VALUE rb_nv = rb_ary_entry(rb_headers, i);
-    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
-  }
+  return self;
+}
 
-  /* Check for body */
-  rb_body = Qnil;
-  if (!NIL_P(rb_opts)) {
-    rb_body = rb_hash_aref(rb_opts, ID2SYM(rb_intern("body")));
-  }
+/*
+ * call-seq:
+ *   connection.cancel_timer(stream_id, kind = nil) -> self
+ *
+ * Cancels one stream timer, or all of the stream's timers if kind is nil.
+ */
+static VALUE rb_nghttp3_connection_cancel_timer(int argc, VALUE *argv,
+                                                VALUE self) {
+  VALUE rb_stream_id, rb_kind;
+  ConnectionObj *obj;
+  int64_t stream_id;
+  int i;
 
-  if (!NIL_P(rb_body)) {
-    StringValue(rb_body);
-    rb_hash_aset(obj->stream_data_readers, LL2NUM(stream_id), rb_body);
-    has_body = 1;
-  } else if (rb_block_given_p()) {
-    VALUE block = rb_block_proc();
-    rb_hash_aset(obj->stream_data_readers, LL2NUM(stream_id), block);
-    has_body = 1;
-  }
+  rb_scan_args(argc, argv, "11", &rb_stream_id, &rb_kind);
 
-  rv = nghttp3_conn_submit_request(obj->conn, stream_id, nva, nvlen,
-                                   has_body ? &data_reader : NULL, NULL);
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (rv != 0) {
-    rb_hash_delete(obj->stream_data_readers, LL2NUM(stream_id));
-    nghttp3_rb_raise(rv, "Failed to submit request");
+  stream_id = NUM2LL(rb_stream_id);
+  if (NIL_P(rb_kind)) {
+    connection_drop_timers(obj, stream_id);
+  } else {
+    i = stream_timer_kind(rb_kind);
+    connection_cancel_timer(obj, stream_id, i);
   }
 
   return self;
 }
 
+static void expire_timer_cb(nghttp3_rb_timer *timer, void *arg) {
+  VALUE expired = (VALUE)arg;
+  rb_ary_push(expired,
+              rb_assoc_new(LL2NUM(timer->stream_id),
+                           ID2SYM(rb_intern(stream_timer_names[timer->kind]))));
+}
+
 /*
  * call-seq:
- *   connection.submit_response(stream_id, headers, body: nil) -> self
- *   connection.submit_response(stream_id, headers) { |stream_id| ... } -> self
+ *   connection.expire_timers(now = nil) -> Array
  *
- * Submits an HTTP response on the given stream.
- * Headers should be an array of Nghttp3::NV objects.
+ * Advances the timer wheel to now and returns <tt>[stream_id, kind]</tt> for
+ * every timer that fired, in expiry order. Fired timers are disarmed; the
+ * caller decides how to end the streams, typically with close_stream and a
+ * QUIC stream reset.
  */
-static VALUE rb_nghttp3_connection_submit_response(int argc, VALUE *argv,
-                                                   VALUE self) {
-  VALUE rb_stream_id, rb_headers, rb_opts, rb_body;
+static VALUE rb_nghttp3_connection_expire_timers(int argc, VALUE *argv,
+                                                 VALUE self) {
+  VALUE rb_now;
   ConnectionObj *obj;
-  int64_t stream_id;
-  nghttp3_nv *nva;
-  size_t nvlen, i;
-  int rv;
-  int has_body = 0;
+  VALUE expired = rb_ary_new();
 
-  rb_scan_args(argc, argv, "2:", &rb_stream_id, &rb_headers, &rb_opts);
+  rb_scan_args(argc, argv, "01", &rb_now);
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
-  }
+  nghttp3_rb_timer_wheel_advance(
+      &obj->wheel,
+      NIL_P(rb_now) ? nghttp3_rb_monotonic_ms() : NUM2ULL(rb_now),
+      expire_timer_cb, (void *)expired);
 
-  if (!obj->is_server) {
-    rb_raise(rb_eNghttp3InvalidStateError,
-             "submit_response can only be called on server connections");
-  }
+  return expired;
+}
 
-  stream_id = NUM2LL(rb_stream_id);
-  Check_Type(rb_headers, T_ARRAY);
-  nvlen = RARRAY_LEN(rb_headers);
+/*
+ * call-seq:
+ *   connection.next_timer_expiry -> Integer or nil
+ *
+ * Returns the monotonic millisecond time by which expire_timers should next be
+ * called, or nil if no timer is armed. The value may be earlier than the
+ * actual expiry of far-off timers, never later.
+ */
+static VALUE rb_nghttp3_connection_next_timer_expiry(VALUE self) {
+  ConnectionObj *obj;
+  uint64_t expiry;
 
-  /* Allocate and convert headers */
-  nva = ALLOCA_N(nghttp3_nv, nvlen);
-  for (i = 0; i < nvlen; i++) {
-    VALUE rb_nv = rb_ary_entry(rb_headers, i);
-    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
-  }
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  /* Check for body */
-  rb_body = Qnil;
-  if (!NIL_P(rb_opts)) {
-    rb_body = rb_hash_aref(rb_opts, ID2SYM(rb_intern("body")));
+  if (!nghttp3_rb_timer_wheel_next_expiry(&obj->wheel, &expiry)) {
+    return Qnil;
   }
 
-  if (!NIL_P(rb_body)) {
-    StringValue(rb_body);
-    rb_hash_aset(obj->stream_data_readers, LL2NUM(stream_id), rb_body);
-    has_body = 1;
-  } else if (rb_block_given_p()) {
-    VALUE block = rb_block_proc();
-    rb_hash_aset(obj->stream_data_readers, LL2NUM(stream_id), block);
-    has_body = 1;
-  }
+  return ULL2NUM(expiry);
+}
 
-  rv = nghttp3_conn_submit_response(obj->conn, stream_id, nva, nvlen,
-                                    has_body ? &data_reader : NULL);
+/*
+ * call-seq:
+ *   connection.timer_count -> Integer
+ *
+ * Returns the number of armed stream timers.
+ */
+static VALUE rb_nghttp3_connection_timer_count(VALUE self) {
+  ConnectionObj *obj;
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+  return SIZET2NUM(obj->wheel.count);
+}
 
-  if (rv != 0) {
-    rb_hash_delete(obj->stream_data_readers, LL2NUM(stream_id));
-    nghttp3_rb_raise(rv, "Failed to submit response");
-  }
+/*
+ * call-seq:
+ *   connection.set_write_rate(bytes_per_second, burst = nil) -> self
+ *
+ * Limits the bytes handed out by writev_stream and writev_packets across all
+ * streams with a token bucket. The bucket holds up to burst bytes (one second
+ * of traffic by default) and starts full. A rate of nil or 0 removes the
+ * limit.
+ */
+static VALUE rb_nghttp3_connection_set_write_rate(int argc, VALUE *argv,
+                                                  VALUE self) {
+  VALUE rb_rate, rb_burst;
+  ConnectionObj *obj;
+  uint64_t rate, burst;
+
+  rb_scan_args(argc, argv, "11", &rb_rate, &rb_burst);
+
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
+
+  rate = NIL_P(rb_rate) ? 0 : NUM2ULL(rb_rate);
+  burst = NIL_P(rb_burst) ? rate : NUM2ULL(rb_burst);
+  check_bucket_args(rate, burst);
+  bucket_configure(&obj->write_bucket, rate, burst, nghttp3_rb_monotonic_ns());
 
   return self;
 }
 
 /*
  * call-seq:
- *   connection.submit_info(stream_id, headers) -> self
+ *   connection.set_stream_write_rate(stream_id, bytes_per_second, burst = nil) -> self
  *
- * Submits a 1xx informational response on the given stream.
- * Headers should be an array of Nghttp3::NV objects.
+ * Limits a single stream like set_write_rate. A stream out of tokens is
+ * blocked so other streams can send, and is unblocked once it may send
+ * again. A rate of nil or 0 removes the limit.
  */
-static VALUE rb_nghttp3_connection_submit_info(VALUE self, VALUE rb_stream_id,
-                                               VALUE rb_headers) {
+static VALUE rb_nghttp3_connection_set_stream_write_rate(int argc, VALUE *argv,
+                                                         VALUE self) {
+  VALUE rb_stream_id, rb_rate, rb_burst;
   ConnectionObj *obj;
+  stream_state *st;
   int64_t stream_id;
-  nghttp3_nv *nva;
-  size_t nvlen, i;
-  int rv;
+  uint64_t rate, burst;
+
+  rb_scan_args(argc, argv, "21", &rb_stream_id, &rb_rate, &rb_burst);
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
@@ -849,162 +3563,236 @@ static VALUE rb_nghttp3_connection_submit_info(VALUE self, VALUE rb_stream_id,
   }
 
   stream_id = NUM2LL(rb_stream_id);
-  Check_Type(rb_headers, T_ARRAY);
-  nvlen = RARRAY_LEN(rb_headers);
-
-  nva = ALLOCA_N(nghttp3_nv, nvlen);
-  for (i = 0; i < nvlen; i++) {
-    VALUE rb_nv = rb_ary_entry(rb_headers, i);
-    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
-  }
-
-  rv = nghttp3_conn_submit_info(obj->conn, stream_id, nva, nvlen);
-
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to submit info");
+  rate = NIL_P(rb_rate) ? 0 : NUM2ULL(rb_rate);
+  burst = NIL_P(rb_burst) ? rate : NUM2ULL(rb_burst);
+  check_bucket_args(rate, burst);
+  st = connection_find_state(obj, stream_id, rate > 0);
+  if (st == NULL) {
+    return self;
+  }
+
+  if (st->bucket.rate > 0) {
+    obj->shaped_streams--;
+  }
+  if (rate > 0) {
+    obj->shaped_streams++;
+  } else if (st->shape_timer.armed) {
+    nghttp3_rb_timer_wheel_cancel(&obj->shaper_wheel, &st->shape_timer);
+    if (!st->flow_blocked) {
+      nghttp3_conn_unblock_stream(obj->conn, stream_id);
+    }
   }
+  bucket_configure(&st->bucket, rate, burst, nghttp3_rb_monotonic_ns());
 
   return self;
 }
 
 /*
  * call-seq:
- *   connection.submit_trailers(stream_id, trailers) -> self
+ *   connection.write_tokens(stream_id = nil) -> Integer or nil
  *
- * Submits trailer headers on the given stream.
- * This implicitly ends the stream.
- * Trailers should be an array of Nghttp3::NV objects.
+ * Returns the bytes the connection, or the given stream, may write now, or
+ * nil if it has no write rate.
  */
-static VALUE rb_nghttp3_connection_submit_trailers(VALUE self,
-                                                   VALUE rb_stream_id,
-                                                   VALUE rb_trailers) {
+static VALUE rb_nghttp3_connection_write_tokens(int argc, VALUE *argv,
+                                                VALUE self) {
+  VALUE rb_stream_id;
   ConnectionObj *obj;
-  int64_t stream_id;
-  nghttp3_nv *nva;
-  size_t nvlen, i;
-  int rv;
+  token_bucket *b;
+  stream_state *st;
+
+  rb_scan_args(argc, argv, "01", &rb_stream_id);
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  if (NIL_P(rb_stream_id)) {
+    b = &obj->write_bucket;
+  } else {
+    st = connection_find_state(obj, NUM2LL(rb_stream_id), 0);
+    if (st == NULL) {
+      return Qnil;
+    }
+    b = &st->bucket;
+  }
+  if (b->rate == 0) {
+    return Qnil;
   }
 
-  stream_id = NUM2LL(rb_stream_id);
-  Check_Type(rb_trailers, T_ARRAY);
-  nvlen = RARRAY_LEN(rb_trailers);
+  bucket_refill(b, nghttp3_rb_monotonic_ns());
+  return SIZET2NUM(bucket_available(b));
+}
 
-  nva = ALLOCA_N(nghttp3_nv, nvlen);
-  for (i = 0; i < nvlen; i++) {
-    VALUE rb_nv = rb_ary_entry(rb_trailers, i);
-    nva[i] = nghttp3_rb_nv_to_c(rb_nv);
-  }
+/*
+ * call-seq:
+ *   connection.next_write_time -> Integer or nil
+ *
+ * Returns the monotonic millisecond time at which a write rate next lets
+ * data through, or nil if nothing is waiting for tokens. Event loops can
+ * sleep until then instead of polling writev_stream.
+ */
+static VALUE rb_nghttp3_connection_next_write_time(VALUE self) {
+  ConnectionObj *obj;
+  uint64_t next = UINT64_MAX;
+  uint64_t expiry;
 
-  rv = nghttp3_conn_submit_trailers(obj->conn, stream_id, nva, nvlen);
+  TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to submit trailers");
+  if (obj->write_bucket.rate > 0) {
+    bucket_refill(&obj->write_bucket, nghttp3_rb_monotonic_ns());
+    if (bucket_available(&obj->write_bucket) == 0) {
+      next = (bucket_eligible_at(&obj->write_bucket) + 999999) / 1000000;
+    }
+  }
+  if (nghttp3_rb_timer_wheel_next_expiry(&obj->shaper_wheel, &expiry) &&
+      expiry < next) {
+    next = expiry;
   }
 
-  return self;
+  return next == UINT64_MAX ? Qnil : ULL2NUM(next);
 }
 
 /*
  * call-seq:
- *   connection.submit_shutdown_notice -> self
+ *   connection.abuse_limits -> Hash
  *
- * Signals the intention to shut down the connection gracefully.
- * After calling this, no new streams will be accepted.
+ * Returns the stream abuse limits as events per window, plus the window in
+ * milliseconds. A limit of 0 is disabled.
  */
-static VALUE rb_nghttp3_connection_submit_shutdown_notice(VALUE self) {
+static VALUE rb_nghttp3_connection_get_abuse_limits(VALUE self) {
   ConnectionObj *obj;
-  int rv;
+  VALUE hash = rb_hash_new();
+  int i;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
-  }
-
-  rv = nghttp3_conn_submit_shutdown_notice(obj->conn);
-
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to submit shutdown notice");
+  for (i = 0; i < NGHTTP3_RB_ABUSE_MAX; i++) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(abuse_names[i])),
+                 ULL2NUM(obj->abuse[i].limit));
   }
+  rb_hash_aset(hash, ID2SYM(rb_intern("window")), ULL2NUM(obj->abuse_window));
 
-  return self;
+  return hash;
 }
 
 /*
  * call-seq:
- *   connection.shutdown -> self
+ *   connection.abuse_limits = {opens:, resets:, stop_sending:, cancels:, window: 1000}
  *
- * Initiates graceful shutdown. Should be called after submit_shutdown_notice.
+ * Sets how many request streams the peer may open, reset, stop or cancel per
+ * window of milliseconds. When a rate goes over its limit, read_stream stops
+ * processing the peer's data before any Ruby callback runs, closes this
+ * connection and raises ExcessiveLoadError; the QUIC connection should then
+ * be closed with H3_EXCESSIVE_LOAD. Omitted or nil limits are disabled.
  */
-static VALUE rb_nghttp3_connection_shutdown(VALUE self) {
+static VALUE rb_nghttp3_connection_set_abuse_limits(VALUE self,
+                                                    VALUE rb_limits) {
   ConnectionObj *obj;
-  int rv;
+  VALUE v;
+  int i;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
-  }
-
-  rv = nghttp3_conn_shutdown(obj->conn);
+  Check_Type(rb_limits, T_HASH);
 
-  if (rv != 0) {
-    nghttp3_rb_raise(rv, "Failed to shutdown connection");
+  v = rb_hash_aref(rb_limits, ID2SYM(rb_intern("window")));
+  if (!NIL_P(v)) {
+    if (NUM2ULL(v) == 0) {
+      rb_raise(rb_eArgError, "window must be positive");
+    }
+    obj->abuse_window = NUM2ULL(v);
+  }
+  for (i = 0; i < NGHTTP3_RB_ABUSE_MAX; i++) {
+    v = rb_hash_aref(rb_limits, ID2SYM(rb_intern(abuse_names[i])));
+    obj->abuse[i].limit = NIL_P(v) ? 0 : NUM2ULL(v);
   }
 
-  return self;
+  return rb_limits;
 }
 
 /*
  * call-seq:
- *   connection.set_stream_user_data(stream_id, data) -> self
+ *   connection.abuse_counters -> Hash
  *
- * Associates arbitrary data with the given stream.
+ * Returns the number of request streams the peer has opened, reset, stopped
+ * and cancelled on this connection.
  */
-static VALUE rb_nghttp3_connection_set_stream_user_data(VALUE self,
-                                                        VALUE rb_stream_id,
-                                                        VALUE rb_data) {
+static VALUE rb_nghttp3_connection_abuse_counters(VALUE self) {
   ConnectionObj *obj;
+  VALUE hash = rb_hash_new();
+  int i;
 
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  for (i = 0; i < NGHTTP3_RB_ABUSE_MAX; i++) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(abuse_names[i])),
+                 ULL2NUM(obj->abuse[i].total));
   }
 
-  rb_hash_aset(obj->stream_user_data, rb_stream_id, rb_data);
-
-  return self;
+  return hash;
 }
 
 /*
  * call-seq:
- *   connection.get_stream_user_data(stream_id) -> Object or nil
+ *   connection.abuse_reason -> Symbol or nil
  *
- * Returns the data associated with the given stream, or nil if none.
+ * Returns the counter whose limit closed the connection, or nil.
  */
-static VALUE rb_nghttp3_connection_get_stream_user_data(VALUE self,
-                                                        VALUE rb_stream_id) {
+static VALUE rb_nghttp3_connection_abuse_reason(VALUE self) {
   ConnectionObj *obj;
-
   TypedData_Get_Struct(self, ConnectionObj, &connection_data_type, obj);
 
-  if (obj->conn == NULL || obj->is_closed) {
-    rb_raise(rb_eNghttp3InvalidStateError, "Connection is closed");
+  if (obj->abuse_tripped < 0) {
+    return Qnil;
   }
+  return ID2SYM(rb_intern(abuse_names[obj->abuse_tripped]));
+}
+
+/*
+ * call-seq:
+ *   Connection.process_memory_budget -> Integer
+ *
+ * Returns the process-wide memory budget in bytes (0 means unlimited).
+ */
+static VALUE rb_nghttp3_connection_s_get_process_memory_budget(VALUE klass) {
+  return SIZET2NUM(process_memory_budget);
+}
+
+/*
+ * call-seq:
+ *   Connection.process_memory_budget = bytes
+ *
+ * Sets a budget shared by all connections in the process. Set to 0 to
+ * disable.
+ */
+static VALUE rb_nghttp3_connection_s_set_process_memory_budget(VALUE klass,
+                                                               VALUE rb_budget) {
+  process_memory_budget = NUM2SIZET(rb_budget);
+  return rb_budget;
+}
 
-  return rb_hash_aref(obj->stream_user_data, rb_stream_id);
+/*
+ * call-seq:
+ *   Connection.process_memory_used -> Integer
+ *
+ * Returns the number of bytes charged across all connections.
+ */
+static VALUE rb_nghttp3_connection_s_get_process_memory_used(VALUE klass) {
+  return SIZET2NUM(process_memory_used);
 }
 
 void Init_nghttp3_connection(void) {
   rb_cNghttp3Connection =
       rb_define_class_under(rb_mNghttp3, "Connection", rb_cObject);
 
+  rb_gc_register_address(&request_class);
+  rb_gc_register_address(&headers_class);
+  id_iv_method = rb_intern("@method");
+  id_iv_scheme = rb_intern("@scheme");
+  id_iv_authority = rb_intern("@authority");
+  id_iv_path = rb_intern("@path");
+  id_iv_headers = rb_intern("@headers");
+  id_iv_body = rb_intern("@body");
+
   /* Disable direct instantiation with new */
   rb_undef_alloc_func(rb_cNghttp3Connection);
 
@@ -1023,6 +3811,8 @@ void Init_nghttp3_connection(void) {
                    0);
   rb_define_method(rb_cNghttp3Connection, "closed?",
                    rb_nghttp3_connection_closed_p, 0);
+  rb_define_method(rb_cNghttp3Connection, "recycle",
+                   rb_nghttp3_connection_recycle, -1);
   rb_define_method(rb_cNghttp3Connection, "server?",
                    rb_nghttp3_connection_server_p, 0);
   rb_define_method(rb_cNghttp3Connection, "client?",
@@ -1031,28 +3821,46 @@ void Init_nghttp3_connection(void) {
   /* Stream operation methods */
   rb_define_method(rb_cNghttp3Connection, "read_stream",
                    rb_nghttp3_connection_read_stream, -1);
+  rb_define_method(rb_cNghttp3Connection, "read_stream_nonblock",
+                   rb_nghttp3_connection_read_stream_nonblock, -1);
   rb_define_method(rb_cNghttp3Connection, "writev_stream",
                    rb_nghttp3_connection_writev_stream, 0);
+  rb_define_method(rb_cNghttp3Connection, "writev_packets",
+                   rb_nghttp3_connection_writev_packets, -1);
   rb_define_method(rb_cNghttp3Connection, "add_write_offset",
                    rb_nghttp3_connection_add_write_offset, 2);
+  rb_define_method(rb_cNghttp3Connection, "add_write_offset_nonblock",
+                   rb_nghttp3_connection_add_write_offset_nonblock, 2);
   rb_define_method(rb_cNghttp3Connection, "add_ack_offset",
                    rb_nghttp3_connection_add_ack_offset, 2);
+  rb_define_method(rb_cNghttp3Connection, "add_ack_offset_nonblock",
+                   rb_nghttp3_connection_add_ack_offset_nonblock, 2);
   rb_define_method(rb_cNghttp3Connection, "block_stream",
                    rb_nghttp3_connection_block_stream, 1);
   rb_define_method(rb_cNghttp3Connection, "unblock_stream",
                    rb_nghttp3_connection_unblock_stream, 1);
+  rb_define_method(rb_cNghttp3Connection, "unblock_stream_nonblock",
+                   rb_nghttp3_connection_unblock_stream_nonblock, 1);
   rb_define_method(rb_cNghttp3Connection, "stream_writable?",
                    rb_nghttp3_connection_stream_writable_p, 1);
   rb_define_method(rb_cNghttp3Connection, "close_stream",
                    rb_nghttp3_connection_close_stream, 2);
+  rb_define_method(rb_cNghttp3Connection, "close_stream_nonblock",
+                   rb_nghttp3_connection_close_stream_nonblock, 2);
+  rb_define_method(rb_cNghttp3Connection, "reject_stream",
+                   rb_nghttp3_connection_reject_stream, 1);
   rb_define_method(rb_cNghttp3Connection, "shutdown_stream_write",
                    rb_nghttp3_connection_shutdown_stream_write, 1);
   rb_define_method(rb_cNghttp3Connection, "resume_stream",
                    rb_nghttp3_connection_resume_stream, 1);
+  rb_define_method(rb_cNghttp3Connection, "resume_stream_nonblock",
+                   rb_nghttp3_connection_resume_stream_nonblock, 1);
 
   /* HTTP operation methods */
   rb_define_method(rb_cNghttp3Connection, "submit_request",
                    rb_nghttp3_connection_submit_request, -1);
+  rb_define_method(rb_cNghttp3Connection, "submit_requests",
+                   rb_nghttp3_connection_submit_requests, 2);
   rb_define_method(rb_cNghttp3Connection, "submit_response",
                    rb_nghttp3_connection_submit_response, -1);
   rb_define_method(rb_cNghttp3Connection, "submit_info",
@@ -1067,4 +3875,73 @@ void Init_nghttp3_connection(void) {
                    rb_nghttp3_connection_set_stream_user_data, 2);
   rb_define_method(rb_cNghttp3Connection, "get_stream_user_data",
                    rb_nghttp3_connection_get_stream_user_data, 1);
+
+  /* Request assembly */
+  rb_define_method(rb_cNghttp3Connection, "assemble_requests?",
+                   rb_nghttp3_connection_assemble_requests_p, 0);
+  rb_define_method(rb_cNghttp3Connection, "assemble_requests=",
+                   rb_nghttp3_connection_set_assemble_requests, 1);
+  rb_define_method(rb_cNghttp3Connection, "take_request",
+                   rb_nghttp3_connection_take_request, -1);
+  rb_define_method(rb_cNghttp3Connection, "assemble_header",
+                   rb_nghttp3_connection_assemble_header, 3);
+  rb_define_method(rb_cNghttp3Connection, "assemble_data",
+                   rb_nghttp3_connection_assemble_data, 2);
+
+  /* Memory budget methods */
+  rb_define_singleton_method(rb_cNghttp3Connection, "process_memory_budget",
+                             rb_nghttp3_connection_s_get_process_memory_budget,
+                             0);
+  rb_define_singleton_method(rb_cNghttp3Connection, "process_memory_budget=",
+                             rb_nghttp3_connection_s_set_process_memory_budget,
+                             1);
+  rb_define_singleton_method(rb_cNghttp3Connection, "process_memory_used",
+                             rb_nghttp3_connection_s_get_process_memory_used,
+                             0);
+  rb_define_method(rb_cNghttp3Connection, "memory_budget",
+                   rb_nghttp3_connection_get_memory_budget, 0);
+  rb_define_method(rb_cNghttp3Connection, "memory_budget=",
+                   rb_nghttp3_connection_set_memory_budget, 1);
+  rb_define_method(rb_cNghttp3Connection, "memory_used",
+                   rb_nghttp3_connection_get_memory_used, 0);
+  rb_define_method(rb_cNghttp3Connection, "over_memory_budget?",
+                   rb_nghttp3_connection_over_memory_budget_p, 0);
+  rb_define_method(rb_cNghttp3Connection, "release_memory",
+                   rb_nghttp3_connection_release_memory, -1);
+
+  /* Stream timers */
+  rb_define_method(rb_cNghttp3Connection, "stream_timeouts",
+                   rb_nghttp3_connection_get_stream_timeouts, 0);
+  rb_define_method(rb_cNghttp3Connection, "stream_timeouts=",
+                   rb_nghttp3_connection_set_stream_timeouts, 1);
+  rb_define_method(rb_cNghttp3Connection, "arm_timer",
+                   rb_nghttp3_connection_arm_timer, -1);
+  rb_define_method(rb_cNghttp3Connection, "cancel_timer",
+                   rb_nghttp3_connection_cancel_timer, -1);
+  rb_define_method(rb_cNghttp3Connection, "expire_timers",
+                   rb_nghttp3_connection_expire_timers, -1);
+  rb_define_method(rb_cNghttp3Connection, "next_timer_expiry",
+                   rb_nghttp3_connection_next_timer_expiry, 0);
+  rb_define_method(rb_cNghttp3Connection, "timer_count",
+                   rb_nghttp3_connection_timer_count, 0);
+
+  /* Write rate limiting */
+  rb_define_method(rb_cNghttp3Connection, "set_write_rate",
+                   rb_nghttp3_connection_set_write_rate, -1);
+  rb_define_method(rb_cNghttp3Connection, "set_stream_write_rate",
+                   rb_nghttp3_connection_set_stream_write_rate, -1);
+  rb_define_method(rb_cNghttp3Connection, "write_tokens",
+                   rb_nghttp3_connection_write_tokens, -1);
+  rb_define_method(rb_cNghttp3Connection, "next_write_time",
+                   rb_nghttp3_connection_next_write_time, 0);
+
+  /* Stream abuse protection */
+  rb_define_method(rb_cNghttp3Connection, "abuse_limits",
+                   rb_nghttp3_connection_get_abuse_limits, 0);
+  rb_define_method(rb_cNghttp3Connection, "abuse_limits=",
+                   rb_nghttp3_connection_set_abuse_limits, 1);
+  rb_define_method(rb_cNghttp3Connection, "abuse_counters",
+                   rb_nghttp3_connection_abuse_counters, 0);
+  rb_define_method(rb_cNghttp3Connection, "abuse_reason",
+                   rb_nghttp3_connection_abuse_reason, 0);
 }
@@ -0,0 +1,535 @@
+#include "nghttp3.h"
+#include <inttypes.h>
+#include <math.h>
+
+VALUE rb_cNghttp3Metrics;
+
+/* Upper bounds of the latency histogram buckets in microseconds */
+static const uint64_t metrics_bounds_us[] = {
+    1000,   2500,   5000,    10000,   25000,   50000,    100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+static const char *const metrics_bounds_label[] = {
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1",
+    "0.25",  "0.5",    "1",     "2.5",  "5",     "10",
+};
+#define METRICS_NBOUNDS                                                        \
+  (sizeof(metrics_bounds_us) / sizeof(metrics_bounds_us[0]))
+
+/* 1xx to 5xx, then anything else */
+#define METRICS_NCLASSES 6
+static const char *const metrics_class_label[METRICS_NCLASSES] = {
+    "1xx", "2xx", "3xx", "4xx", "5xx", "other",
+};
+
+#define METRICS_DEFAULT_MAX_SERIES 1024
+
+/*
+ * Counters are plain integers: every update happens with the GVL held, so
+ * neither locks nor atomics are needed.
+ */
+typedef struct {
+  char *route;
+  size_t routelen;
+  char *authority;
+  size_t authoritylen;
+  st_index_t hash;
+  int64_t in_flight;
+  uint64_t status[METRICS_NCLASSES];
+  uint64_t buckets[METRICS_NBOUNDS + 1];
+  uint64_t count;
+  uint64_t sum_us;
+} metrics_series;
+
+typedef struct {
+  metrics_series *series;
+  size_t len;
+  size_t cap;
+  size_t max_series;
+  /* Index of the series absorbing requests beyond max_series, or -1 */
+  long overflow;
+  /* Open-addressing index of the named series by hash; slots hold a series
+   * index plus one, 0 marks an empty slot */
+  size_t *slots;
+  size_t slots_cap; /* power of two, or 0 before the first series */
+  size_t indexed;
+} MetricsObj;
+
+static void metrics_free(void *ptr) {
+  MetricsObj *obj = (MetricsObj *)ptr;
+  size_t i;
+
+  for (i = 0; i < obj->len; i++) {
+    xfree(obj->series[i].route);
+    xfree(obj->series[i].authority);
+  }
+  xfree(obj->series);
+  xfree(obj->slots);
+  xfree(obj);
+}
+
+static size_t metrics_memsize(const void *ptr) {
+  const MetricsObj *obj = (const MetricsObj *)ptr;
+  size_t size = sizeof(MetricsObj) + obj->cap * sizeof(metrics_series) +
+                obj->slots_cap * sizeof(size_t);
+  size_t i;
+
+  for (i = 0; i < obj->len; i++) {
+    size += obj->series[i].routelen + obj->series[i].authoritylen + 2;
+  }
+  return size;
+}
+
+static const rb_data_type_t metrics_data_type = {
+    .wrap_struct_name = "nghttp3_metrics_rb",
+    .function =
+        {
+            .dmark = NULL,
+            .dfree = metrics_free,
+            .dsize = metrics_memsize,
+        },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static VALUE metrics_alloc(VALUE klass) {
+  MetricsObj *obj;
+  VALUE self =
+      TypedData_Make_Struct(klass, MetricsObj, &metrics_data_type, obj);
+  obj->max_series = METRICS_DEFAULT_MAX_SERIES;
+  obj->overflow = -1;
+  return self;
+}
+
+static MetricsObj *metrics_get(VALUE self) {
+  MetricsObj *obj;
+  TypedData_Get_Struct(self, MetricsObj, &metrics_data_type, obj);
+  return obj;
+}
+
+static metrics_series *metrics_series_at(MetricsObj *obj, VALUE rb_id) {
+  long id = NUM2LONG(rb_id);
+  if (id < 0 || (size_t)id >= obj->len) {
+    rb_raise(rb_eArgError, "unknown series %ld", id);
+  }
+  return &obj->series[id];
+}
+
+static long metrics_find_series(const MetricsObj *obj, const char *route,
+                                size_t routelen, const char *authority,
+                                size_t authoritylen, st_index_t hash) {
+  size_t i;
+
+  if (obj->indexed == 0) {
+    return -1;
+  }
+  for (i = hash & (obj->slots_cap - 1); obj->slots[i] != 0;
+       i = (i + 1) & (obj->slots_cap - 1)) {
+    const metrics_series *s = &obj->series[obj->slots[i] - 1];
+    if (s->hash == hash && s->routelen == routelen &&
+        s->authoritylen == authoritylen &&
+        memcmp(s->route, route, routelen) == 0 &&
+        memcmp(s->authority, authority, authoritylen) == 0) {
+      return (long)(obj->slots[i] - 1);
+    }
+  }
+  return -1;
+}
+
+static void metrics_index_insert(MetricsObj *obj, size_t id) {
+  size_t i;
+
+  /* Keep the load factor at or below 3/4 */
+  if ((obj->indexed + 1) * 4 > obj->slots_cap * 3) {
+    size_t *old = obj->slots;
+    size_t old_cap = obj->slots_cap;
+
+    obj->slots_cap = old_cap ? old_cap * 2 : 16;
+    obj->slots = ZALLOC_N(size_t, obj->slots_cap);
+    for (i = 0; i < old_cap; i++) {
+      if (old[i] != 0) {
+        size_t j = obj->series[old[i] - 1].hash & (obj->slots_cap - 1);
+        while (obj->slots[j] != 0) {
+          j = (j + 1) & (obj->slots_cap - 1);
+        }
+        obj->slots[j] = old[i];
+      }
+    }
+    xfree(old);
+  }
+
+  for (i = obj->series[id].hash & (obj->slots_cap - 1); obj->slots[i] != 0;
+       i = (i + 1) & (obj->slots_cap - 1))
+    ;
+  obj->slots[i] = id + 1;
+  obj->indexed++;
+}
+
+static long metrics_add_series(MetricsObj *obj, const char *route,
+                               size_t routelen, const char *authority,
+                               size_t authoritylen, st_index_t hash) {
+  metrics_series *s;
+
+  if (obj->len == obj->cap) {
+    size_t cap = obj->cap ? obj->cap * 2 : 16;
+    REALLOC_N(obj->series, metrics_series, cap);
+    obj->cap = cap;
+  }
+  s = &obj->series[obj->len];
+  memset(s, 0, sizeof(*s));
+  s->route = ALLOC_N(char, routelen + 1);
+  memcpy(s->route, route, routelen);
+  s->route[routelen] = '\0';
+  s->routelen = routelen;
+  s->authority = ALLOC_N(char, authoritylen + 1);
+  memcpy(s->authority, authority, authoritylen);
+  s->authority[authoritylen] = '\0';
+  s->authoritylen = authoritylen;
+  s->hash = hash;
+  return (long)obj->len++;
+}
+
+/*
+ * call-seq:
+ *   Metrics.new(max_series: 1024) -> Metrics
+ *
+ * Creates an empty metrics registry. Once max_series route/authority pairs
+ * exist, further pairs are counted in one series labelled "_other".
+ */
+static VALUE rb_nghttp3_metrics_initialize(int argc, VALUE *argv,
+                                           VALUE self) {
+  MetricsObj *obj = metrics_get(self);
+  VALUE rb_opts, rb_max;
+  ID kw[1];
+  VALUE kwv[1];
+
+  rb_scan_args(argc, argv, ":", &rb_opts);
+  if (!NIL_P(rb_opts)) {
+    kw[0] = rb_intern("max_series");
+    rb_get_kwargs(rb_opts, kw, 0, 1, kwv);
+    rb_max = kwv[0];
+    if (rb_max != Qundef) {
+      long max = NUM2LONG(rb_max);
+      if (max < 1) {
+        rb_raise(rb_eArgError, "max_series must be positive");
+      }
+      obj->max_series = (size_t)max;
+    }
+  }
+  return self;
+}
+
+/*
+ * call-seq:
+ *   metrics.series(route, authority) -> Integer
+ *
+ * Returns the ID of the series for a route label and authority, creating it
+ * on first use. Looking up an existing series allocates nothing; series are
+ * indexed by hash, so the lookup cost does not grow with their number.
+ */
+static VALUE rb_nghttp3_metrics_series(VALUE self, VALUE rb_route,
+                                       VALUE rb_authority) {
+  MetricsObj *obj = metrics_get(self);
+  const char *route, *authority = "";
+  size_t routelen, authoritylen = 0;
+  st_index_t hash;
+  long id;
+
+  StringValue(rb_route);
+  route = RSTRING_PTR(rb_route);
+  routelen = (size_t)RSTRING_LEN(rb_route);
+  if (!NIL_P(rb_authority)) {
+    StringValue(rb_authority);
+    authority = RSTRING_PTR(rb_authority);
+    authoritylen = (size_t)RSTRING_LEN(rb_authority);
+  }
+
+  hash = rb_memhash(route, (long)routelen) ^
+         (rb_memhash(authority, (long)authoritylen) * 31);
+
+  id = metrics_find_series(obj, route, routelen, authority, authoritylen, hash);
+  if (id >= 0) {
+    return LONG2NUM(id);
+  }
+
+  if (obj->len >= obj->max_series) {
+    if (obj->overflow < 0) {
+      obj->overflow = metrics_add_series(obj, "_other", 6, "_other", 6, 0);
+    }
+    return LONG2NUM(obj->overflow);
+  }
+
+  /* The "_other" series stays out of the index, so a real route of that
+   * name gets its own series */
+  id = metrics_add_series(obj, route, routelen, authority, authoritylen, hash);
+  metrics_index_insert(obj, (size_t)id);
+  return LONG2NUM(id);
+}
+
+/*
+ * call-seq:
+ *   metrics.start(id) -> self
+ *
+ * Counts a request of the series as in flight.
+ */
+static VALUE rb_nghttp3_metrics_start(VALUE self, VALUE rb_id) {
+  metrics_series_at(metrics_get(self), rb_id)->in_flight++;
+  return self;
+}
+
+/*
+ * call-seq:
+ *   metrics.finish(id, status, duration_us) -> self
+ *
+ * Records a completed request of the series: its status class and latency
+ * in microseconds. The request stops counting as in flight.
+ */
+static VALUE rb_nghttp3_metrics_finish(VALUE self, VALUE rb_id,
+                                       VALUE rb_status, VALUE rb_duration) {
+  metrics_series *s = metrics_series_at(metrics_get(self), rb_id);
+  long status = NIL_P(rb_status) ? 0 : NUM2LONG(rb_status);
+  long duration = NUM2LONG(rb_duration);
+  uint64_t us = duration < 0 ? 0 : (uint64_t)duration;
+  size_t b;
+
+  if (s->in_flight > 0) {
+    s->in_flight--;
+  }
+  s->status[(status >= 100 && status < 600) ? status / 100 - 1
+                                            : METRICS_NCLASSES - 1]++;
+  for (b = 0; b < METRICS_NBOUNDS && us > metrics_bounds_us[b]; b++)
+    ;
+  s->buckets[b]++;
+  s->count++;
+  s->sum_us += us;
+  return self;
+}
+
+/*
+ * call-seq:
+ *   metrics.cancel(id) -> self
+ *
+ * Stops counting a request of the series as in flight without recording
+ * it, for streams reset or torn down before completing.
+ */
+static VALUE rb_nghttp3_metrics_cancel(VALUE self, VALUE rb_id) {
+  metrics_series *s = metrics_series_at(metrics_get(self), rb_id);
+  if (s->in_flight > 0) {
+    s->in_flight--;
+  }
+  return self;
+}
+
+/*
+ * call-seq:
+ *   metrics.reset -> self
+ *
+ * Zeroes all counters and histograms. Series IDs and in-flight gauges are
+ * kept.
+ */
+static VALUE rb_nghttp3_metrics_reset(VALUE self) {
+  MetricsObj *obj = metrics_get(self);
+  size_t i;
+
+  for (i = 0; i < obj->len; i++) {
+    metrics_series *s = &obj->series[i];
+    memset(s->status, 0, sizeof(s->status));
+    memset(s->buckets, 0, sizeof(s->buckets));
+    s->count = 0;
+    s->sum_us = 0;
+  }
+  return self;
+}
+
+/*
+ * call-seq:
+ *   metrics.size -> Integer
+ *
+ * Returns the number of series.
+ */
+static VALUE rb_nghttp3_metrics_size(VALUE self) {
+  return SIZET2NUM(metrics_get(self)->len);
+}
+
+static void metrics_cat_escaped(VALUE buf, const char *s, size_t len) {
+  size_t i, start = 0;
+
+  for (i = 0; i < len; i++) {
+    const char *esc;
+    switch (s[i]) {
+    case '\\':
+      esc = "\\\\";
+      break;
+    case '"':
+      esc = "\\\"";
+      break;
+    case '\n':
+      esc = "\\n";
+      break;
+    default:
+      continue;
+    }
+    rb_str_cat(buf, s + start, (long)(i - start));
+    rb_str_cat_cstr(buf, esc);
+    start = i + 1;
+  }
+  rb_str_cat(buf, s + start, (long)(len - start));
+}
+
+static void metrics_cat_labels(VALUE buf, const metrics_series *s) {
+  rb_str_cat_cstr(buf, "{route=\"");
+  metrics_cat_escaped(buf, s->route, s->routelen);
+  rb_str_cat_cstr(buf, "\",authority=\"");
+  metrics_cat_escaped(buf, s->authority, s->authoritylen);
+  rb_str_cat_cstr(buf, "\"");
+}
+
+static void metrics_cat_u64(VALUE buf, uint64_t n) {
+  char num[24];
+  int len = snprintf(num, sizeof(num), " %" PRIu64 "\n", n);
+  rb_str_cat(buf, num, len);
+}
+
+/*
+ * call-seq:
+ *   metrics.to_prometheus -> String
+ *
+ * Renders all series in the Prometheus text exposition format. The output
+ * is written into one String sized from the number of series, so the cost
+ * of a scrape does not grow with traffic.
+ */
+static VALUE rb_nghttp3_metrics_to_prometheus(VALUE self) {
+  MetricsObj *obj = metrics_get(self);
+  VALUE buf;
+  size_t i, b, c;
+  char sum[32];
+
+  buf = rb_str_buf_new((long)(512 + obj->len * 2048));
+
+  rb_str_cat_cstr(buf, "# HELP nghttp3_requests_total Completed requests "
+                       "by status class.\n"
+                       "# TYPE nghttp3_requests_total counter\n");
+  for (i = 0; i < obj->len; i++) {
+    const metrics_series *s = &obj->series[i];
+    for (c = 0; c < METRICS_NCLASSES; c++) {
+      if (s->status[c] == 0) {
+        continue;
+      }
+      rb_str_cat_cstr(buf, "nghttp3_requests_total");
+      metrics_cat_labels(buf, s);
+      rb_str_cat_cstr(buf, ",status=\"");
+      rb_str_cat_cstr(buf, metrics_class_label[c]);
+      rb_str_cat_cstr(buf, "\"}");
+      metrics_cat_u64(buf, s->status[c]);
+    }
+  }
+
+  rb_str_cat_cstr(buf, "# HELP nghttp3_requests_in_flight Requests being "
+                       "handled or sent.\n"
+                       "# TYPE nghttp3_requests_in_flight gauge\n");
+  for (i = 0; i < obj->len; i++) {
+    const metrics_series *s = &obj->series[i];
+    rb_str_cat_cstr(buf, "nghttp3_requests_in_flight");
+    metrics_cat_labels(buf, s);
+    rb_str_cat_cstr(buf, "}");
+    metrics_cat_u64(buf, s->in_flight < 0 ? 0 : (uint64_t)s->in_flight);
+  }
+
+  rb_str_cat_cstr(buf, "# HELP nghttp3_request_duration_seconds Time from "
+                       "dispatch until the stream closes.\n"
+                       "# TYPE nghttp3_request_duration_seconds histogram\n");
+  for (i = 0; i < obj->len; i++) {
+    const metrics_series *s = &obj->series[i];
+    uint64_t cumulative = 0;
+
+    for (b = 0; b <= METRICS_NBOUNDS; b++) {
+      cumulative += s->buckets[b];
+      rb_str_cat_cstr(buf, "nghttp3_request_duration_seconds_bucket");
+      metrics_cat_labels(buf, s);
+      rb_str_cat_cstr(buf, ",le=\"");
+      rb_str_cat_cstr(buf, b < METRICS_NBOUNDS ? metrics_bounds_label[b]
+                                               : "+Inf");
+      rb_str_cat_cstr(buf, "\"}");
+      metrics_cat_u64(buf, cumulative);
+    }
+    rb_str_cat_cstr(buf, "nghttp3_request_duration_seconds_sum");
+    metrics_cat_labels(buf, s);
+    snprintf(sum, sizeof(sum), "} %.6f\n", (double)s->sum_us / 1e6);
+    rb_str_cat_cstr(buf, sum);
+    rb_str_cat_cstr(buf, "nghttp3_request_duration_seconds_count");
+    metrics_cat_labels(buf, s);
+    rb_str_cat_cstr(buf, "}");
+    metrics_cat_u64(buf, s->count);
+  }
+
+  return buf;
+}
+
+/*
+ * call-seq:
+ *   metrics.snapshot -> Array<Hash>
+ *
+ * Returns one Hash per series with :route, :authority, :in_flight,
+ * :requests (by status class), :count, :sum (seconds) and :buckets
+ * (cumulative counts by upper bound in seconds, ending with Infinity).
+ */
+static VALUE rb_nghttp3_metrics_snapshot(VALUE self) {
+  MetricsObj *obj = metrics_get(self);
+  VALUE result = rb_ary_new_capa((long)obj->len);
+  size_t i, b, c;
+
+  for (i = 0; i < obj->len; i++) {
+    const metrics_series *s = &obj->series[i];
+    VALUE h = rb_hash_new();
+    VALUE requests = rb_hash_new();
+    VALUE buckets = rb_ary_new_capa((long)METRICS_NBOUNDS + 1);
+    uint64_t cumulative = 0;
+
+    for (c = 0; c < METRICS_NCLASSES; c++) {
+      rb_hash_aset(requests, ID2SYM(rb_intern(metrics_class_label[c])),
+                   ULL2NUM(s->status[c]));
+    }
+    for (b = 0; b <= METRICS_NBOUNDS; b++) {
+      cumulative += s->buckets[b];
+      rb_ary_push(buckets,
+                  rb_assoc_new(DBL2NUM(b < METRICS_NBOUNDS
+                                           ? (double)metrics_bounds_us[b] / 1e6
+                                           : HUGE_VAL),
+                               ULL2NUM(cumulative)));
+    }
+
+    rb_hash_aset(h, ID2SYM(rb_intern("route")),
+                 rb_utf8_str_new(s->route, (long)s->routelen));
+    rb_hash_aset(h, ID2SYM(rb_intern("authority")),
+                 rb_utf8_str_new(s->authority, (long)s->authoritylen));
+    rb_hash_aset(h, ID2SYM(rb_intern("in_flight")), LL2NUM(s->in_flight));
+    rb_hash_aset(h, ID2SYM(rb_intern("requests")), requests);
+    rb_hash_aset(h, ID2SYM(rb_intern("count")), ULL2NUM(s->count));
+    rb_hash_aset(h, ID2SYM(rb_intern("sum")),
+                 DBL2NUM((double)s->sum_us / 1e6));
+    rb_hash_aset(h, ID2SYM(rb_intern("buckets")), buckets);
+    rb_ary_push(result, h);
+  }
+  return result;
+}
+
+void Init_nghttp3_metrics(void) {
+  rb_cNghttp3Metrics =
+      rb_define_class_under(rb_mNghttp3, "Metrics", rb_cObject);
+  rb_define_alloc_func(rb_cNghttp3Metrics, metrics_alloc);
+
+  rb_define_method(rb_cNghttp3Metrics, "initialize",
+                   rb_nghttp3_metrics_initialize, -1);
+  rb_define_method(rb_cNghttp3Metrics, "series", rb_nghttp3_metrics_series,
+                   2);
+  rb_define_method(rb_cNghttp3Metrics, "start", rb_nghttp3_metrics_start, 1);
+  rb_define_method(rb_cNghttp3Metrics, "finish", rb_nghttp3_metrics_finish,
+                   3);
+  rb_define_method(rb_cNghttp3Metrics, "cancel", rb_nghttp3_metrics_cancel,
+                   1);
+  rb_define_method(rb_cNghttp3Metrics, "reset", rb_nghttp3_metrics_reset, 0);
+  rb_define_method(rb_cNghttp3Metrics, "size", rb_nghttp3_metrics_size, 0);
+  rb_define_method(rb_cNghttp3Metrics, "to_prometheus",
+                   rb_nghttp3_metrics_to_prometheus, 0);
+  rb_define_method(rb_cNghttp3Metrics, "snapshot",
+                   rb_nghttp3_metrics_snapshot, 0);
+}
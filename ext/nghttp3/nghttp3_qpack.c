@@ -30,7 +30,7 @@ static const rb_data_type_t encoder_data_type = {
             .dfree = encoder_free,
             .dsize = encoder_memsize,
         },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
 };
 
 static VALUE encoder_alloc(VALUE klass) {
@@ -247,9 +247,12 @@ typedef struct {
 
 static void decoder_mark(void *ptr) {
   DecoderObj *obj = (DecoderObj *)ptr;
-  if (obj->stream_contexts != Qnil) {
-    rb_gc_mark(obj->stream_contexts);
-  }
+  rb_gc_mark_movable(obj->stream_contexts);
+}
+
+static void decoder_compact(void *ptr) {
+  DecoderObj *obj = (DecoderObj *)ptr;
+  obj->stream_contexts = rb_gc_location(obj->stream_contexts);
 }
 
 /* Callback to free stream contexts */
@@ -285,8 +288,9 @@ static const rb_data_type_t decoder_data_type = {
             .dmark = decoder_mark,
             .dfree = decoder_free,
             .dsize = decoder_memsize,
+            .dcompact = decoder_compact,
         },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
 };
 
 static VALUE decoder_alloc(VALUE klass) {
@@ -319,7 +323,7 @@ static VALUE rb_nghttp3_qpack_decoder_initialize(VALUE self,
   max_blocked = NUM2SIZET(rb_max_blocked);
   obj->hard_max_dtable_capacity = max_capacity;
   obj->max_blocked_streams = max_blocked;
-  obj->stream_contexts = rb_hash_new();
+  RB_OBJ_WRITE(self, &obj->stream_contexts, rb_hash_new());
 
   rv = nghttp3_qpack_decoder_new(&obj->decoder, max_capacity, max_blocked,
                                  nghttp3_mem_default());
@@ -366,11 +370,19 @@ get_or_create_stream_context(DecoderObj *obj, int64_t stream_id) {
 }
 
 /*
- * Helper to convert nghttp3_rcbuf to Ruby String and decref
+ * Helpers to convert a decoded name or value to a frozen Ruby String and
+ * decref. Names are interned; values go through the header value cache.
  */
-static VALUE rcbuf_to_string(nghttp3_rcbuf *rcbuf) {
+static VALUE rcbuf_to_name(nghttp3_rcbuf *rcbuf) {
+  nghttp3_vec vec = nghttp3_rcbuf_get_buf(rcbuf);
+  VALUE str = nghttp3_rb_interned_bytes(vec.base, vec.len);
+  nghttp3_rcbuf_decref(rcbuf);
+  return str;
+}
+
+static VALUE rcbuf_to_value(nghttp3_rcbuf *rcbuf) {
   nghttp3_vec vec = nghttp3_rcbuf_get_buf(rcbuf);
-  VALUE str = rb_str_new((const char *)vec.base, vec.len);
+  VALUE str = nghttp3_rb_header_string(vec.base, vec.len);
   nghttp3_rcbuf_decref(rcbuf);
   return str;
 }
@@ -443,9 +455,9 @@ static VALUE rb_nghttp3_qpack_decoder_decode(int argc, VALUE *argv,
     if (flags & NGHTTP3_QPACK_DECODE_FLAG_EMIT) {
       VALUE header = rb_hash_new();
       rb_hash_aset(header, ID2SYM(rb_intern("name")),
-                   rcbuf_to_string(nv.name));
+                   rcbuf_to_name(nv.name));
       rb_hash_aset(header, ID2SYM(rb_intern("value")),
-                   rcbuf_to_string(nv.value));
+                   rcbuf_to_value(nv.value));
       rb_hash_aset(header, ID2SYM(rb_intern("token")), INT2NUM(nv.token));
       rb_ary_push(headers, header);
     }
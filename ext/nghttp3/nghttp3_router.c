@@ -0,0 +1,530 @@
+#include "nghttp3.h"
+
+VALUE rb_cNghttp3Router;
+
+/* Maximum number of :param and *wildcard captures in one pattern */
+#define ROUTER_MAX_PARAMS 32
+
+/*
+ * Routes hang off the trie node reached by their pattern. A NULL method or
+ * authority matches any request.
+ */
+typedef struct router_route {
+  struct router_route *next;
+  char *method;
+  size_t methodlen;
+  char *authority;
+  size_t authoritylen;
+  VALUE handler;
+  VALUE param_names;
+} router_route;
+
+/*
+ * One node per path segment. Static children are matched before the
+ * :param child, which is matched before the *wildcard child.
+ */
+typedef struct router_node {
+  char *seg;
+  size_t seglen;
+  struct router_node **children;
+  size_t nchildren;
+  size_t childcap;
+  struct router_node *param;
+  struct router_node *wildcard;
+  router_route *routes;
+} router_node;
+
+typedef struct {
+  router_node *root;
+  size_t nroutes;
+  size_t memsize;
+} RouterObj;
+
+typedef struct {
+  const char *base;
+  const char *method;
+  size_t methodlen;
+  const char *authority;
+  size_t authoritylen;
+  size_t ncaptures;
+  struct {
+    size_t offset;
+    size_t len;
+  } captures[ROUTER_MAX_PARAMS];
+} router_match_ctx;
+
+static char *router_strdup(RouterObj *obj, const char *s, size_t len) {
+  char *p = ALLOC_N(char, len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  obj->memsize += len + 1;
+  return p;
+}
+
+static router_node *router_node_new(RouterObj *obj, const char *seg,
+                                    size_t seglen) {
+  router_node *node = ZALLOC(router_node);
+  obj->memsize += sizeof(router_node);
+  if (seglen > 0) {
+    node->seg = router_strdup(obj, seg, seglen);
+    node->seglen = seglen;
+  }
+  return node;
+}
+
+static void router_node_free(router_node *node) {
+  router_route *route, *next;
+  size_t i;
+
+  if (node == NULL) {
+    return;
+  }
+  for (i = 0; i < node->nchildren; i++) {
+    router_node_free(node->children[i]);
+  }
+  router_node_free(node->param);
+  router_node_free(node->wildcard);
+  for (route = node->routes; route; route = next) {
+    next = route->next;
+    xfree(route->method);
+    xfree(route->authority);
+    xfree(route);
+  }
+  xfree(node->children);
+  xfree(node->seg);
+  xfree(node);
+}
+
+static void router_node_mark(router_node *node) {
+  router_route *route;
+  size_t i;
+
+  if (node == NULL) {
+    return;
+  }
+  for (i = 0; i < node->nchildren; i++) {
+    router_node_mark(node->children[i]);
+  }
+  router_node_mark(node->param);
+  router_node_mark(node->wildcard);
+  for (route = node->routes; route; route = route->next) {
+    rb_gc_mark_movable(route->handler);
+    rb_gc_mark_movable(route->param_names);
+  }
+}
+
+static void router_node_compact(router_node *node) {
+  router_route *route;
+  size_t i;
+
+  if (node == NULL) {
+    return;
+  }
+  for (i = 0; i < node->nchildren; i++) {
+    router_node_compact(node->children[i]);
+  }
+  router_node_compact(node->param);
+  router_node_compact(node->wildcard);
+  for (route = node->routes; route; route = route->next) {
+    route->handler = rb_gc_location(route->handler);
+    route->param_names = rb_gc_location(route->param_names);
+  }
+}
+
+static void router_mark(void *ptr) {
+  RouterObj *obj = (RouterObj *)ptr;
+  router_node_mark(obj->root);
+}
+
+static void router_compact(void *ptr) {
+  RouterObj *obj = (RouterObj *)ptr;
+  router_node_compact(obj->root);
+}
+
+static void router_free(void *ptr) {
+  RouterObj *obj = (RouterObj *)ptr;
+  router_node_free(obj->root);
+  xfree(obj);
+}
+
+static size_t router_memsize(const void *ptr) {
+  const RouterObj *obj = (const RouterObj *)ptr;
+  return sizeof(RouterObj) + obj->memsize;
+}
+
+static const rb_data_type_t router_data_type = {
+    .wrap_struct_name = "nghttp3_router_rb",
+    .function =
+        {
+            .dmark = router_mark,
+            .dfree = router_free,
+            .dsize = router_memsize,
+            .dcompact = router_compact,
+        },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static VALUE router_alloc(VALUE klass) {
+  RouterObj *obj;
+  VALUE self =
+      TypedData_Make_Struct(klass, RouterObj, &router_data_type, obj);
+  obj->root = router_node_new(obj, NULL, 0);
+  return self;
+}
+
+static router_node *router_static_child(RouterObj *obj, router_node *node,
+                                        const char *seg, size_t seglen) {
+  router_node *child;
+  size_t i;
+
+  for (i = 0; i < node->nchildren; i++) {
+    child = node->children[i];
+    if (child->seglen == seglen && memcmp(child->seg, seg, seglen) == 0) {
+      return child;
+    }
+  }
+
+  if (node->nchildren == node->childcap) {
+    size_t cap = node->childcap ? node->childcap * 2 : 4;
+    REALLOC_N(node->children, router_node *, cap);
+    obj->memsize += (cap - node->childcap) * sizeof(router_node *);
+    node->childcap = cap;
+  }
+  child = router_node_new(obj, seg, seglen);
+  node->children[node->nchildren++] = child;
+  return child;
+}
+
+/* ASCII case-insensitive comparison for authorities */
+static int router_authority_eq(const char *a, const char *b, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (rb_tolower((unsigned char)a[i]) != rb_tolower((unsigned char)b[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static router_route *router_node_route(router_node *node,
+                                       const router_match_ctx *ctx) {
+  router_route *route;
+
+  for (route = node->routes; route; route = route->next) {
+    if (route->method &&
+        (route->methodlen != ctx->methodlen ||
+         memcmp(route->method, ctx->method, ctx->methodlen) != 0)) {
+      continue;
+    }
+    if (route->authority &&
+        (ctx->authority == NULL || route->authoritylen != ctx->authoritylen ||
+         !router_authority_eq(route->authority, ctx->authority,
+                              ctx->authoritylen))) {
+      continue;
+    }
+    return route;
+  }
+  return NULL;
+}
+
+static void router_push_capture(router_match_ctx *ctx, const char *p,
+                                size_t len) {
+  ctx->captures[ctx->ncaptures].offset = (size_t)(p - ctx->base);
+  ctx->captures[ctx->ncaptures].len = len;
+  ctx->ncaptures++;
+}
+
+/*
+ * Depth-first match of the path from p to end against node, backtracking
+ * from static to :param to *wildcard children. Segments are compared in
+ * place; captures record offsets into the path.
+ */
+static router_route *router_match_node(router_node *node, const char *p,
+                                       const char *end,
+                                       router_match_ctx *ctx) {
+  router_route *route;
+  const char *q;
+  size_t i, seglen, ncaptures;
+
+  while (p < end && *p == '/') {
+    p++;
+  }
+
+  if (p == end) {
+    route = router_node_route(node, ctx);
+    if (route) {
+      return route;
+    }
+    if (node->wildcard && ctx->ncaptures < ROUTER_MAX_PARAMS) {
+      router_push_capture(ctx, p, 0);
+      route = router_node_route(node->wildcard, ctx);
+      if (route) {
+        return route;
+      }
+      ctx->ncaptures--;
+    }
+    return NULL;
+  }
+
+  q = memchr(p, '/', (size_t)(end - p));
+  if (q == NULL) {
+    q = end;
+  }
+  seglen = (size_t)(q - p);
+
+  for (i = 0; i < node->nchildren; i++) {
+    router_node *child = node->children[i];
+    if (child->seglen == seglen && memcmp(child->seg, p, seglen) == 0) {
+      route = router_match_node(child, q, end, ctx);
+      if (route) {
+        return route;
+      }
+      break;
+    }
+  }
+
+  ncaptures = ctx->ncaptures;
+  if (ncaptures >= ROUTER_MAX_PARAMS) {
+    return NULL;
+  }
+
+  if (node->param) {
+    router_push_capture(ctx, p, seglen);
+    route = router_match_node(node->param, q, end, ctx);
+    if (route) {
+      return route;
+    }
+    ctx->ncaptures = ncaptures;
+  }
+
+  if (node->wildcard) {
+    router_push_capture(ctx, p, (size_t)(end - p));
+    route = router_node_route(node->wildcard, ctx);
+    if (route) {
+      return route;
+    }
+    ctx->ncaptures = ncaptures;
+  }
+
+  return NULL;
+}
+
+static VALUE router_method_string(VALUE rb_method) {
+  if (NIL_P(rb_method)) {
+    return Qnil;
+  }
+  if (SYMBOL_P(rb_method)) {
+    rb_method = rb_funcall(rb_sym2str(rb_method), rb_intern("upcase"), 0);
+  }
+  StringValue(rb_method);
+  if (RSTRING_LEN(rb_method) == 1 && RSTRING_PTR(rb_method)[0] == '*') {
+    return Qnil;
+  }
+  return rb_method;
+}
+
+/*
+ * call-seq:
+ *   router.add(method, pattern, handler, authority = nil) -> self
+ *
+ * Registers a route. The pattern is a path of "/"-separated segments, each
+ * literal, ":name" to capture one segment, or "*name" as the last segment to
+ * capture the rest of the path. Empty segments are ignored, so a trailing
+ * slash does not matter. A method of nil or "*" matches any method; an
+ * authority of nil matches any authority. Routes on the same pattern are
+ * tried in the order they were added.
+ */
+static VALUE rb_nghttp3_router_add(int argc, VALUE *argv, VALUE self) {
+  VALUE rb_method, rb_pattern, rb_handler, rb_authority, param_names;
+  RouterObj *obj;
+  router_node *node;
+  router_route *route, **tail;
+  const char *p, *end, *q;
+  size_t seglen;
+
+  rb_scan_args(argc, argv, "31", &rb_method, &rb_pattern, &rb_handler,
+               &rb_authority);
+
+  TypedData_Get_Struct(self, RouterObj, &router_data_type, obj);
+
+  rb_method = router_method_string(rb_method);
+  StringValue(rb_pattern);
+  if (!NIL_P(rb_authority)) {
+    StringValue(rb_authority);
+  }
+
+  p = RSTRING_PTR(rb_pattern);
+  end = p + RSTRING_LEN(rb_pattern);
+  if (p == end || *p != '/') {
+    rb_raise(rb_eArgError, "pattern must start with '/'");
+  }
+  if (memchr(p, '?', (size_t)(end - p))) {
+    rb_raise(rb_eArgError, "pattern must not contain a query");
+  }
+
+  /* Validate the whole pattern before touching the trie */
+  param_names = rb_ary_new();
+  for (q = p; q < end;) {
+    const char *segend;
+    while (q < end && *q == '/') {
+      q++;
+    }
+    if (q == end) {
+      break;
+    }
+    segend = memchr(q, '/', (size_t)(end - q));
+    if (segend == NULL) {
+      segend = end;
+    }
+    seglen = (size_t)(segend - q);
+    if (*q == ':' || *q == '*') {
+      if (seglen == 1) {
+        rb_raise(rb_eArgError, "parameter name missing in pattern");
+      }
+      if (*q == '*' && segend != end) {
+        rb_raise(rb_eArgError, "wildcard must be the last segment");
+      }
+      rb_ary_push(param_names, rb_obj_freeze(rb_utf8_str_new(q + 1,
+                                                             seglen - 1)));
+    }
+    q = segend;
+  }
+  if (RARRAY_LEN(param_names) > ROUTER_MAX_PARAMS) {
+    rb_raise(rb_eArgError, "pattern has more than %d parameters",
+             ROUTER_MAX_PARAMS);
+  }
+  rb_obj_freeze(param_names);
+
+  node = obj->root;
+  while (p < end) {
+    while (p < end && *p == '/') {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    q = memchr(p, '/', (size_t)(end - p));
+    if (q == NULL) {
+      q = end;
+    }
+    seglen = (size_t)(q - p);
+    if (*p == ':') {
+      if (node->param == NULL) {
+        node->param = router_node_new(obj, NULL, 0);
+      }
+      node = node->param;
+    } else if (*p == '*') {
+      if (node->wildcard == NULL) {
+        node->wildcard = router_node_new(obj, NULL, 0);
+      }
+      node = node->wildcard;
+    } else {
+      node = router_static_child(obj, node, p, seglen);
+    }
+    p = q;
+  }
+
+  route = ZALLOC(router_route);
+  obj->memsize += sizeof(router_route);
+  if (!NIL_P(rb_method)) {
+    route->methodlen = (size_t)RSTRING_LEN(rb_method);
+    route->method = router_strdup(obj, RSTRING_PTR(rb_method),
+                                  route->methodlen);
+  }
+  if (!NIL_P(rb_authority)) {
+    route->authoritylen = (size_t)RSTRING_LEN(rb_authority);
+    route->authority = router_strdup(obj, RSTRING_PTR(rb_authority),
+                                     route->authoritylen);
+  }
+  RB_OBJ_WRITE(self, &route->handler, rb_handler);
+  RB_OBJ_WRITE(self, &route->param_names, param_names);
+
+  for (tail = &node->routes; *tail; tail = &(*tail)->next)
+    ;
+  *tail = route;
+  obj->nroutes++;
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   router.match(method, path, authority = nil) -> [handler, params] or nil
+ *
+ * Finds the first route matching the request. The query string is ignored.
+ * Path segments are compared in place; Strings are created only for the
+ * captured parameters of a matching route. Returns nil if no route matches.
+ */
+static VALUE rb_nghttp3_router_match(int argc, VALUE *argv, VALUE self) {
+  VALUE rb_method, rb_path, rb_authority, params;
+  RouterObj *obj;
+  router_match_ctx ctx;
+  router_route *route;
+  const char *path, *end, *query;
+  long i;
+
+  rb_scan_args(argc, argv, "21", &rb_method, &rb_path, &rb_authority);
+
+  TypedData_Get_Struct(self, RouterObj, &router_data_type, obj);
+
+  StringValue(rb_method);
+  StringValue(rb_path);
+
+  path = RSTRING_PTR(rb_path);
+  end = path + RSTRING_LEN(rb_path);
+  query = memchr(path, '?', (size_t)(end - path));
+  if (query) {
+    end = query;
+  }
+
+  ctx.base = path;
+  ctx.method = RSTRING_PTR(rb_method);
+  ctx.methodlen = (size_t)RSTRING_LEN(rb_method);
+  if (NIL_P(rb_authority)) {
+    ctx.authority = NULL;
+    ctx.authoritylen = 0;
+  } else {
+    StringValue(rb_authority);
+    ctx.authority = RSTRING_PTR(rb_authority);
+    ctx.authoritylen = (size_t)RSTRING_LEN(rb_authority);
+  }
+  ctx.ncaptures = 0;
+
+  route = router_match_node(obj->root, path, end, &ctx);
+  if (route == NULL) {
+    return Qnil;
+  }
+
+  params = rb_hash_new();
+  for (i = 0; i < RARRAY_LEN(route->param_names) && (size_t)i < ctx.ncaptures;
+       i++) {
+    rb_hash_aset(params, RARRAY_AREF(route->param_names, i),
+                 rb_utf8_str_new(path + ctx.captures[i].offset,
+                                 (long)ctx.captures[i].len));
+  }
+  RB_GC_GUARD(rb_path);
+
+  return rb_assoc_new(route->handler, params);
+}
+
+/*
+ * call-seq:
+ *   router.size -> Integer
+ *
+ * Returns the number of registered routes.
+ */
+static VALUE rb_nghttp3_router_size(VALUE self) {
+  RouterObj *obj;
+  TypedData_Get_Struct(self, RouterObj, &router_data_type, obj);
+  return SIZET2NUM(obj->nroutes);
+}
+
+void Init_nghttp3_router(void) {
+  rb_cNghttp3Router =
+      rb_define_class_under(rb_mNghttp3, "Router", rb_cObject);
+  rb_define_alloc_func(rb_cNghttp3Router, router_alloc);
+
+  rb_define_method(rb_cNghttp3Router, "add", rb_nghttp3_router_add, -1);
+  rb_define_method(rb_cNghttp3Router, "match", rb_nghttp3_router_match, -1);
+  rb_define_method(rb_cNghttp3Router, "size", rb_nghttp3_router_size, 0);
+}
@@ -18,7 +18,7 @@ const rb_data_type_t settings_data_type = {
             .dfree = settings_free,
             .dsize = settings_memsize,
         },
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
 };
 
 static VALUE settings_alloc(VALUE klass) {
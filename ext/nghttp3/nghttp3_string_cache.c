@@ -0,0 +1,288 @@
+#include "nghttp3.h"
+#include "ruby/encoding.h"
+#include <string.h>
+
+VALUE rb_mNghttp3StringCache;
+
+#define STRING_CACHE_DEFAULT_CAPACITY 1024
+#define STRING_CACHE_DEFAULT_ADMIT_AFTER 4
+#define STRING_CACHE_MAX_CAPACITY (1 << 20)
+
+/* Longer values (paths, cookies, tokens) rarely repeat byte for byte */
+#define STRING_CACHE_MAX_LENGTH 64
+
+/*
+ * Direct-mapped slot. A value seen for the first time becomes the slot's
+ * candidate; only once the candidate has been seen admit_after times is a
+ * frozen String allocated and made resident, so one-off values never
+ * displace hot ones. Everything runs with the GVL held.
+ */
+typedef struct {
+  VALUE str; /* resident frozen String, or Qnil */
+  st_index_t hash;
+  st_index_t cand_hash;
+  uint32_t cand_len;
+  uint32_t cand_hits;
+} cache_slot;
+
+static struct {
+  cache_slot *slots;
+  size_t capacity; /* power of two */
+  size_t size;
+  uint32_t admit_after;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t admitted;
+  uint64_t evicted;
+} cache;
+
+static void cache_mark(void *ptr) {
+  size_t i;
+
+  for (i = 0; i < cache.capacity; i++) {
+    rb_gc_mark_movable(cache.slots[i].str);
+  }
+}
+
+static void cache_compact(void *ptr) {
+  size_t i;
+
+  for (i = 0; i < cache.capacity; i++) {
+    cache.slots[i].str = rb_gc_location(cache.slots[i].str);
+  }
+}
+
+static const rb_data_type_t cache_data_type = {
+    .wrap_struct_name = "nghttp3_string_cache",
+    .function =
+        {
+            .dmark = cache_mark,
+            .dfree = NULL,
+            .dsize = NULL,
+            .dcompact = cache_compact,
+        },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void cache_allocate(size_t capacity) {
+  cache_slot *slots = ALLOC_N(cache_slot, capacity);
+  cache_slot *old = cache.slots;
+  size_t i;
+
+  for (i = 0; i < capacity; i++) {
+    slots[i].str = Qnil;
+    slots[i].hash = 0;
+    slots[i].cand_hash = 0;
+    slots[i].cand_len = 0;
+    slots[i].cand_hits = 0;
+  }
+
+  /* Swap before freeing so marking never sees a freed table */
+  cache.slots = slots;
+  cache.capacity = capacity;
+  cache.size = 0;
+  xfree(old);
+}
+
+/*
+ * Returns the deduplicated frozen String for the given bytes. Like every
+ * String built from received data, it is binary.
+ */
+VALUE nghttp3_rb_interned_bytes(const void *p, size_t len) {
+  return rb_enc_interned_str((const char *)p, (long)len,
+                             rb_ascii8bit_encoding());
+}
+
+/*
+ * Returns a frozen String with the given bytes, shared between all callers
+ * once the value has proved to repeat.
+ */
+VALUE nghttp3_rb_header_string(const uint8_t *p, size_t len) {
+  cache_slot *slot;
+  st_index_t hash;
+
+  if (len == 0) {
+    return nghttp3_rb_interned_bytes("", 0);
+  }
+  if (len > STRING_CACHE_MAX_LENGTH) {
+    return rb_str_freeze(rb_str_new((const char *)p, (long)len));
+  }
+
+  hash = rb_memhash(p, (long)len);
+  slot = &cache.slots[hash & (cache.capacity - 1)];
+
+  if (!NIL_P(slot->str) && slot->hash == hash &&
+      RSTRING_LEN(slot->str) == (long)len &&
+      memcmp(RSTRING_PTR(slot->str), p, len) == 0) {
+    cache.hits++;
+    return slot->str;
+  }
+
+  cache.misses++;
+  if (slot->cand_hash == hash && slot->cand_len == len) {
+    slot->cand_hits++;
+  } else {
+    slot->cand_hash = hash;
+    slot->cand_len = (uint32_t)len;
+    slot->cand_hits = 1;
+  }
+
+  if (slot->cand_hits < cache.admit_after) {
+    return rb_str_freeze(rb_str_new((const char *)p, (long)len));
+  }
+
+  if (NIL_P(slot->str)) {
+    cache.size++;
+  } else {
+    cache.evicted++;
+  }
+  cache.admitted++;
+  slot->str = nghttp3_rb_interned_bytes(p, len);
+  slot->hash = hash;
+  slot->cand_hash = 0;
+  slot->cand_len = 0;
+  slot->cand_hits = 0;
+
+  return slot->str;
+}
+
+/*
+ * call-seq:
+ *   StringCache.lookup(string) -> String
+ *
+ * Returns the frozen String the cache hands out for the given bytes,
+ * counting the lookup toward admission like a received header value.
+ */
+static VALUE rb_nghttp3_string_cache_s_lookup(VALUE self, VALUE rb_str) {
+  StringValue(rb_str);
+  return nghttp3_rb_header_string((const uint8_t *)RSTRING_PTR(rb_str),
+                                  RSTRING_LEN(rb_str));
+}
+
+/*
+ * call-seq:
+ *   StringCache.capacity -> Integer
+ *
+ * Returns the number of slots.
+ */
+static VALUE rb_nghttp3_string_cache_s_capacity(VALUE self) {
+  return SIZET2NUM(cache.capacity);
+}
+
+/*
+ * call-seq:
+ *   StringCache.capacity = slots
+ *
+ * Resizes the cache, rounding up to a power of two, and drops every cached
+ * value.
+ */
+static VALUE rb_nghttp3_string_cache_s_set_capacity(VALUE self,
+                                                    VALUE rb_capacity) {
+  size_t want = NUM2SIZET(rb_capacity);
+  size_t capacity = 1;
+
+  if (want < 1 || want > STRING_CACHE_MAX_CAPACITY) {
+    rb_raise(rb_eArgError, "capacity must be between 1 and %d",
+             STRING_CACHE_MAX_CAPACITY);
+  }
+  while (capacity < want) {
+    capacity <<= 1;
+  }
+  cache_allocate(capacity);
+
+  return rb_capacity;
+}
+
+/*
+ * call-seq:
+ *   StringCache.admit_after -> Integer
+ *
+ * Returns how many times a value must be seen before it is cached.
+ */
+static VALUE rb_nghttp3_string_cache_s_admit_after(VALUE self) {
+  return UINT2NUM(cache.admit_after);
+}
+
+/*
+ * call-seq:
+ *   StringCache.admit_after = count
+ *
+ * Sets how many times a value must be seen before it is cached.
+ */
+static VALUE rb_nghttp3_string_cache_s_set_admit_after(VALUE self,
+                                                       VALUE rb_count) {
+  unsigned int count = NUM2UINT(rb_count);
+
+  if (count < 1) {
+    rb_raise(rb_eArgError, "admit_after must be positive");
+  }
+  cache.admit_after = count;
+
+  return rb_count;
+}
+
+/*
+ * call-seq:
+ *   StringCache.stats -> Hash
+ *
+ * Returns the cache counters: :size, :capacity, :hits, :misses, :admitted
+ * and :evicted.
+ */
+static VALUE rb_nghttp3_string_cache_s_stats(VALUE self) {
+  VALUE stats = rb_hash_new();
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("size")), SIZET2NUM(cache.size));
+  rb_hash_aset(stats, ID2SYM(rb_intern("capacity")),
+               SIZET2NUM(cache.capacity));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULL2NUM(cache.hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULL2NUM(cache.misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("admitted")), ULL2NUM(cache.admitted));
+  rb_hash_aset(stats, ID2SYM(rb_intern("evicted")), ULL2NUM(cache.evicted));
+
+  return stats;
+}
+
+/*
+ * call-seq:
+ *   StringCache.clear -> nil
+ *
+ * Drops every cached value and resets the counters.
+ */
+static VALUE rb_nghttp3_string_cache_s_clear(VALUE self) {
+  cache_allocate(cache.capacity);
+  cache.hits = 0;
+  cache.misses = 0;
+  cache.admitted = 0;
+  cache.evicted = 0;
+  return Qnil;
+}
+
+void Init_nghttp3_string_cache(void) {
+  rb_mNghttp3StringCache = rb_define_module_under(rb_mNghttp3, "StringCache");
+
+  cache.admit_after = STRING_CACHE_DEFAULT_ADMIT_AFTER;
+  cache_allocate(STRING_CACHE_DEFAULT_CAPACITY);
+
+  /* Marks the resident Strings for the life of the process */
+  rb_gc_register_mark_object(
+      TypedData_Wrap_Struct(rb_cObject, &cache_data_type, &cache));
+
+  /* Values longer than this many bytes are never cached */
+  rb_define_const(rb_mNghttp3StringCache, "MAX_LENGTH",
+                  INT2NUM(STRING_CACHE_MAX_LENGTH));
+
+  rb_define_singleton_method(rb_mNghttp3StringCache, "lookup",
+                             rb_nghttp3_string_cache_s_lookup, 1);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "capacity",
+                             rb_nghttp3_string_cache_s_capacity, 0);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "capacity=",
+                             rb_nghttp3_string_cache_s_set_capacity, 1);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "admit_after",
+                             rb_nghttp3_string_cache_s_admit_after, 0);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "admit_after=",
+                             rb_nghttp3_string_cache_s_set_admit_after, 1);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "stats",
+                             rb_nghttp3_string_cache_s_stats, 0);
+  rb_define_singleton_method(rb_mNghttp3StringCache, "clear",
+                             rb_nghttp3_string_cache_s_clear, 0);
+}
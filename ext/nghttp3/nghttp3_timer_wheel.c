@@ -0,0 +1,236 @@
+#include "nghttp3.h"
+
+/*
+ * Hierarchical timer wheel with 1ms ticks.
+ *
+ * Level l holds timers due between 64^l and 64^(l+1) ticks from now, in slot
+ * (expiry >> 6l) & 63. When the wheel reaches a level boundary the matching
+ * slot is cascaded into the lower levels. Timers further out than the top
+ * level are parked in its last reachable slot and re-filed when cascaded.
+ * Arm, cancel and expire are O(1); advancing skips empty levels using
+ * per-level occupancy bitmaps.
+ */
+
+#define WHEEL_MAX_DELTA                                                        \
+  ((uint64_t)1 << (NGHTTP3_RB_WHEEL_BITS * NGHTTP3_RB_WHEEL_LEVELS))
+
+static void wheel_link(nghttp3_rb_timer_wheel *wheel, nghttp3_rb_timer *timer,
+                       int level, int slot) {
+  nghttp3_rb_timer **head = &wheel->slots[level][slot];
+
+  timer->prev = NULL;
+  timer->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = timer;
+  }
+  *head = timer;
+  timer->level = level;
+  timer->slot = slot;
+  wheel->bitmap[level] |= (uint64_t)1 << slot;
+}
+
+static void wheel_unlink(nghttp3_rb_timer_wheel *wheel,
+                         nghttp3_rb_timer *timer) {
+  nghttp3_rb_timer **head = &wheel->slots[timer->level][timer->slot];
+
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    *head = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  if (*head == NULL) {
+    wheel->bitmap[timer->level] &= ~((uint64_t)1 << timer->slot);
+  }
+  timer->prev = timer->next = NULL;
+}
+
+/* Files a timer relative to wheel->now; a due timer lands in the current
+ * level 0 slot. */
+static void wheel_file(nghttp3_rb_timer_wheel *wheel, nghttp3_rb_timer *timer) {
+  uint64_t expiry = timer->expiry;
+  uint64_t delta;
+  int level;
+
+  if (expiry < wheel->now) {
+    expiry = wheel->now;
+  }
+  delta = expiry - wheel->now;
+  if (delta >= WHEEL_MAX_DELTA) {
+    expiry = wheel->now + WHEEL_MAX_DELTA - 1;
+    delta = WHEEL_MAX_DELTA - 1;
+  }
+
+  for (level = 0; level < NGHTTP3_RB_WHEEL_LEVELS - 1; level++) {
+    if (delta < ((uint64_t)1 << (NGHTTP3_RB_WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  wheel_link(wheel, timer, level,
+             (int)((expiry >> (NGHTTP3_RB_WHEEL_BITS * level)) &
+                   (NGHTTP3_RB_WHEEL_SLOTS - 1)));
+}
+
+void nghttp3_rb_timer_wheel_init(nghttp3_rb_timer_wheel *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->now = now;
+}
+
+void nghttp3_rb_timer_init(nghttp3_rb_timer *timer, int64_t stream_id,
+                           int kind) {
+  memset(timer, 0, sizeof(*timer));
+  timer->stream_id = stream_id;
+  timer->kind = kind;
+}
+
+void nghttp3_rb_timer_wheel_arm(nghttp3_rb_timer_wheel *wheel,
+                                nghttp3_rb_timer *timer, uint64_t expiry) {
+  if (timer->armed) {
+    wheel_unlink(wheel, timer);
+  } else {
+    wheel->count++;
+  }
+  /* Ticks up to wheel->now have already been processed */
+  timer->expiry = expiry > wheel->now ? expiry : wheel->now + 1;
+  timer->armed = 1;
+  wheel_file(wheel, timer);
+}
+
+void nghttp3_rb_timer_wheel_cancel(nghttp3_rb_timer_wheel *wheel,
+                                   nghttp3_rb_timer *timer) {
+  if (!timer->armed) {
+    return;
+  }
+  wheel_unlink(wheel, timer);
+  timer->armed = 0;
+  wheel->count--;
+}
+
+static void wheel_cascade(nghttp3_rb_timer_wheel *wheel, int level, int slot) {
+  nghttp3_rb_timer *timer = wheel->slots[level][slot];
+
+  wheel->slots[level][slot] = NULL;
+  wheel->bitmap[level] &= ~((uint64_t)1 << slot);
+
+  while (timer != NULL) {
+    nghttp3_rb_timer *next = timer->next;
+    wheel_file(wheel, timer);
+    timer = next;
+  }
+}
+
+/* Tick of the first occupied level 0 slot, capped at the next level 1
+ * boundary where a cascade may add earlier timers */
+static uint64_t wheel_next_level0(const nghttp3_rb_timer_wheel *wheel) {
+  uint64_t boundary = ((wheel->now >> NGHTTP3_RB_WHEEL_BITS) + 1)
+                      << NGHTTP3_RB_WHEEL_BITS;
+  unsigned int cur =
+      (unsigned int)((wheel->now + 1) & (NGHTTP3_RB_WHEEL_SLOTS - 1));
+  uint64_t rotated = wheel->bitmap[0] >> cur;
+  uint64_t next;
+
+  if (cur != 0) {
+    rotated |= wheel->bitmap[0] << (NGHTTP3_RB_WHEEL_SLOTS - cur);
+  }
+  next = wheel->now + 1 + (uint64_t)__builtin_ctzll(rotated);
+
+  return next < boundary ? next : boundary;
+}
+
+size_t nghttp3_rb_timer_wheel_advance(nghttp3_rb_timer_wheel *wheel,
+                                      uint64_t to,
+                                      nghttp3_rb_timer_expire_cb cb,
+                                      void *arg) {
+  size_t expired = 0;
+
+  while (wheel->now < to) {
+    uint64_t next;
+    int level, slot;
+    nghttp3_rb_timer *timer;
+
+    if (wheel->count == 0) {
+      wheel->now = to;
+      break;
+    }
+
+    /* With levels below l empty, nothing happens before the next multiple of
+     * 64^l; within level 0 jump straight to the next occupied slot */
+    for (level = 0; level < NGHTTP3_RB_WHEEL_LEVELS; level++) {
+      if (wheel->bitmap[level] != 0) {
+        break;
+      }
+    }
+    if (level == NGHTTP3_RB_WHEEL_LEVELS) {
+      level--;
+    }
+    next = ((wheel->now >> (NGHTTP3_RB_WHEEL_BITS * level)) + 1)
+           << (NGHTTP3_RB_WHEEL_BITS * level);
+    if (level == 0) {
+      next = wheel_next_level0(wheel);
+    }
+    if (next > to) {
+      wheel->now = to;
+      break;
+    }
+    wheel->now = next;
+
+    for (level = NGHTTP3_RB_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint64_t mask = ((uint64_t)1 << (NGHTTP3_RB_WHEEL_BITS * level)) - 1;
+      if ((wheel->now & mask) == 0) {
+        wheel_cascade(wheel, level,
+                      (int)((wheel->now >> (NGHTTP3_RB_WHEEL_BITS * level)) &
+                            (NGHTTP3_RB_WHEEL_SLOTS - 1)));
+      }
+    }
+
+    slot = (int)(wheel->now & (NGHTTP3_RB_WHEEL_SLOTS - 1));
+    while ((timer = wheel->slots[0][slot]) != NULL) {
+      wheel_unlink(wheel, timer);
+      timer->armed = 0;
+      wheel->count--;
+      expired++;
+      cb(timer, arg);
+    }
+  }
+
+  return expired;
+}
+
+int nghttp3_rb_timer_wheel_next_expiry(const nghttp3_rb_timer_wheel *wheel,
+                                       uint64_t *pexpiry) {
+  int level;
+
+  if (wheel->count == 0) {
+    return 0;
+  }
+
+  /* Exact for level 0; otherwise the next cascade, which is never late */
+  for (level = 0; level < NGHTTP3_RB_WHEEL_LEVELS; level++) {
+    if (wheel->bitmap[level] != 0) {
+      break;
+    }
+  }
+  if (level == 0) {
+    *pexpiry = wheel_next_level0(wheel);
+    return 1;
+  }
+  if (level == NGHTTP3_RB_WHEEL_LEVELS) {
+    level--;
+  }
+  *pexpiry = ((wheel->now >> (NGHTTP3_RB_WHEEL_BITS * level)) + 1)
+             << (NGHTTP3_RB_WHEEL_BITS * level);
+  return 1;
+}
+
+uint64_t nghttp3_rb_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t nghttp3_rb_monotonic_ms(void) {
+  return nghttp3_rb_monotonic_ns() / 1000000;
+}
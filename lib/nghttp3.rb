@@ -7,9 +7,15 @@ require_relative "nghttp3/nghttp3"
 require_relative "nghttp3/headers"
 require_relative "nghttp3/request"
 require_relative "nghttp3/response"
+require_relative "nghttp3/request_pool"
 require_relative "nghttp3/stream_manager"
+require_relative "nghttp3/latency_histogram"
+require_relative "nghttp3/body_reader"
+require_relative "nghttp3/loopback"
+require_relative "nghttp3/admission_controller"
 require_relative "nghttp3/client"
 require_relative "nghttp3/server"
+require_relative "nghttp3/rack_adapter"
 
 module Nghttp3
   class Error < StandardError; end
@@ -0,0 +1,164 @@
+# frozen_string_literal: true
+
+module Nghttp3
+  # Admission control for incoming requests
+  #
+  # Decides whether a new request stream is accepted before its headers and
+  # body are buffered. Two policies can be combined:
+  #
+  # - Concurrency limit: at most +max_concurrency+ requests in flight, counted
+  #   from admission until the stream closes.
+  # - Latency target (CoDel-style): the time a complete request waits before
+  #   its handler starts is sampled. If the smallest wait seen during a whole
+  #   +latency_interval+ stays above +latency_target+, the queue is standing
+  #   rather than bursty, and new requests are shed until an interval passes
+  #   with a minimum wait at or below the target. The wait is measured from
+  #   the +received_at:+ time passed to Server#read_stream, which is required
+  #   with this policy.
+  #
+  # One controller may be shared by several servers to enforce a limit across
+  # connections. All times are monotonic milliseconds.
+  #
+  # @example
+  #   admission = Nghttp3::AdmissionController.new(max_concurrency: 256, latency_target: 5)
+  #   server = Nghttp3::Server.new(admission: admission)
+  #   admission.stats # => {in_flight: 0, admitted: 0, shed_concurrency: 0, ...}
+  class AdmissionController
+    # @return [Integer, nil] maximum number of in-flight requests
+    attr_reader :max_concurrency
+
+    # @return [Numeric, nil] acceptable standing queue delay in milliseconds
+    attr_reader :latency_target
+
+    # @return [Numeric] window in milliseconds over which the minimum delay is taken
+    attr_reader :latency_interval
+
+    # @return [Integer] requests admitted and not yet released
+    attr_reader :in_flight
+
+    # @return [Integer] requests admitted since the last stats reset
+    attr_reader :admitted
+
+    # @return [Integer] requests shed by the concurrency limit
+    attr_reader :shed_concurrency
+
+    # @return [Integer] requests shed by the latency target
+    attr_reader :shed_latency
+
+    # Current monotonic time in milliseconds
+    # @return [Float]
+    def self.now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_millisecond)
+    end
+
+    # Create a new admission controller
+    # @param max_concurrency [Integer, nil] in-flight request limit (nil for none)
+    # @param latency_target [Numeric, nil] queue delay target in milliseconds (nil for none)
+    # @param latency_interval [Numeric] CoDel interval in milliseconds
+    def initialize(max_concurrency: nil, latency_target: nil, latency_interval: 100)
+      raise ArgumentError, "max_concurrency must be positive" if max_concurrency && max_concurrency < 1
+      raise ArgumentError, "latency_interval must be positive" unless latency_interval.positive?
+
+      @max_concurrency = max_concurrency
+      @latency_target = latency_target
+      @latency_interval = latency_interval
+      @in_flight = 0
+      @overloaded = false
+      @window_min = nil
+      @window_end = nil
+      reset_stats
+    end
+
+    # Decide whether to accept a new request
+    #
+    # An admitted request counts as in flight until {#release} is called.
+    #
+    # @param now [Numeric] current monotonic time in milliseconds
+    # @return [Boolean] true if the request may proceed
+    def admit(now = self.class.now)
+      if @max_concurrency && @in_flight >= @max_concurrency
+        @shed_concurrency += 1
+        return false
+      end
+
+      if @latency_target
+        roll_window(now)
+        if @overloaded
+          @shed_latency += 1
+          return false
+        end
+      end
+
+      @in_flight += 1
+      @admitted += 1
+      true
+    end
+
+    # Release an admitted request
+    # @return [self]
+    def release
+      @in_flight -= 1 if @in_flight > 0
+      self
+    end
+
+    # Record how long a complete request waited before its handler started
+    # @param delay [Numeric] queue delay in milliseconds
+    # @param now [Numeric] current monotonic time in milliseconds
+    # @return [self]
+    def record_queue_delay(delay, now = self.class.now)
+      return self unless @latency_target
+
+      roll_window(now)
+      @window_min = delay if @window_min.nil? || delay < @window_min
+      @max_queue_delay = delay if delay > @max_queue_delay
+      self
+    end
+
+    # Check whether the latency policy is currently shedding
+    # @return [Boolean]
+    def overloaded?
+      @overloaded
+    end
+
+    # Total requests shed by any policy
+    # @return [Integer]
+    def shed
+      @shed_concurrency + @shed_latency
+    end
+
+    # Snapshot of the controller's state and counters
+    # @return [Hash{Symbol => Numeric, Boolean}]
+    def stats
+      {
+        in_flight: @in_flight,
+        admitted: @admitted,
+        shed_concurrency: @shed_concurrency,
+        shed_latency: @shed_latency,
+        overloaded: @overloaded,
+        max_queue_delay: @max_queue_delay
+      }
+    end
+
+    # Reset the counters, keeping in-flight requests and policy state
+    # @return [self]
+    def reset_stats
+      @admitted = 0
+      @shed_concurrency = 0
+      @shed_latency = 0
+      @max_queue_delay = 0
+      self
+    end
+
+    private
+
+    # Closes the current interval once it has elapsed. An interval without
+    # samples means nothing was queued, so shedding stops.
+    def roll_window(now)
+      return if @window_end && now < @window_end
+
+      @overloaded = !@window_min.nil? && @window_min > @latency_target if @window_end
+      @window_min = nil
+      @window_end = now + @latency_interval
+    end
+  end
+end
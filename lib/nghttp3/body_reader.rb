@@ -0,0 +1,89 @@
+# frozen_string_literal: true
+
+module Nghttp3
+  # Streams a request body from an IO or Enumerable in chunks
+  #
+  # Used as the data reader block of Connection#submit_request, so the body is
+  # read only as the connection asks for it and never held in memory as a
+  # whole. IO sources are read with +read_nonblock+ when available; if the
+  # source is not ready the reader returns +:wouldblock+ and reports
+  # {#waiting?} until the stream is resumed. Enumerables are walked with an
+  # external enumerator and may yield +:wouldblock+ themselves.
+  #
+  # @example
+  #   reader = Nghttp3::BodyReader.new(File.open("upload.bin", "rb"))
+  #   connection.submit_request(stream_id, headers, &reader)
+  class BodyReader
+    # Default number of bytes read from an IO per chunk
+    DEFAULT_CHUNK_SIZE = 16_384
+
+    # @return [IO, Enumerable] the body source
+    attr_reader :source
+
+    # @return [Integer] bytes read from the source so far
+    attr_reader :bytes_read
+
+    # Check whether a body must be streamed rather than sent as a String
+    # @param body [Object] request body
+    # @return [Boolean]
+    def self.streamable?(body)
+      !body.nil? && !body.is_a?(String) && (body.respond_to?(:read) || body.respond_to?(:each))
+    end
+
+    # Create a reader for a body source
+    # @param source [IO, Enumerable<String>] object responding to read or each
+    # @param chunk_size [Integer] maximum bytes read from an IO per chunk
+    def initialize(source, chunk_size: DEFAULT_CHUNK_SIZE)
+      raise ArgumentError, "chunk_size must be positive" unless chunk_size.positive?
+
+      @source = source
+      @chunk_size = chunk_size
+      @io = source.respond_to?(:read)
+      @enum = nil
+      @waiting = false
+      @bytes_read = 0
+    end
+
+    # Read the next chunk
+    # @param _stream_id [Integer, nil] stream ID passed by the connection
+    # @return [String, Symbol, nil] data, :wouldblock if the source is not
+    #   ready, or nil at the end of the body
+    def call(_stream_id = nil)
+      chunk = @io ? read_io : read_enum
+      @waiting = chunk == :wouldblock
+      @bytes_read += chunk.bytesize if chunk.is_a?(String)
+      chunk
+    end
+
+    # Check whether the last read found the source not ready
+    # @return [Boolean]
+    def waiting?
+      @waiting
+    end
+
+    # @return [Proc] the reader as a block for Connection#submit_request
+    def to_proc
+      method(:call).to_proc
+    end
+
+    private
+
+    def read_io
+      return @source.read(@chunk_size) unless @source.respond_to?(:read_nonblock)
+
+      chunk = @source.read_nonblock(@chunk_size, exception: false)
+      (chunk == :wait_readable || chunk == :wait_writable) ? :wouldblock : chunk
+    end
+
+    def read_enum
+      # to_enum: an each that only yields returns no enumerator itself
+      @enum ||= @source.to_enum(:each)
+      # loop ends when the enumerator raises StopIteration
+      loop do
+        chunk = @enum.next
+        return chunk unless chunk.is_a?(String) && chunk.empty?
+      end
+      nil
+    end
+  end
+end
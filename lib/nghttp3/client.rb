@@ -1,6 +1,31 @@
 # frozen_string_literal: true
 
 module Nghttp3
+  # Passed to a request's on_complete callback when its stream ends without
+  # a complete response
+  class RequestAbortedError < Error
+    # @return [Integer] stream ID of the request
+    attr_reader :stream_id
+
+    # @return [Symbol] :closed if the stream was closed before the response
+    #   ended, :timeout if a stream timer expired, :connection_closed if the
+    #   client was closed or reset
+    attr_reader :reason
+
+    # @return [Integer, nil] HTTP/3 error code the stream was closed with
+    attr_reader :error_code
+
+    # @param stream_id [Integer] stream ID of the request
+    # @param reason [Symbol] why the request ended
+    # @param error_code [Integer, nil] HTTP/3 error code
+    def initialize(stream_id, reason, error_code = nil)
+      @stream_id = stream_id
+      @reason = reason
+      @error_code = error_code
+      super("Request on stream #{stream_id} aborted (#{reason})")
+    end
+  end
+
   # High-level HTTP/3 client
   #
   # Wraps the low-level Connection API with automatic stream management,
@@ -22,6 +47,11 @@ module Nghttp3
   #
   #   # Get response when ready
   #   response = client.responses[stream_id]
+  #
+  # @example Completion callbacks
+  #   client.get("https://example.com/path") do |response, error|
+  #     error ? retry_later(error) : handle(response)
+  #   end
   class Client
     # @return [Connection] the underlying low-level connection
     attr_reader :connection
@@ -35,12 +65,42 @@ module Nghttp3
     # @return [Hash{Integer => Request}] pending requests by stream ID
     attr_reader :pending_requests
 
+    # Timing of one in-flight request, in monotonic microseconds
+    RequestTiming = Struct.new(:authority, :started, :headers_at, :first_byte_at, :bytes)
+    private_constant :RequestTiming
+
+    # Callbacks given to submit for one request
+    RequestCallbacks = Struct.new(:on_headers, :on_data, :on_complete)
+    private_constant :RequestCallbacks
+
     # Create a new HTTP/3 client
     # @param settings [Settings, nil] settings to use (defaults to Settings.default)
-    def initialize(settings: nil)
+    # @param memory_budget [Integer, nil] per-connection memory budget in bytes;
+    #   response bodies count until handed to on_data or the stream closes,
+    #   and a buffered body that outgrows the budget is cancelled, see {#on_reject}
+    # @param timeouts [Hash{Symbol => Integer}, nil] per-stream timeouts in
+    #   milliseconds (:header, :idle, :deadline), see Connection#stream_timeouts=
+    # @param write_rate [Integer, nil] egress limit for the connection in bytes per second
+    # @param stream_write_rate [Integer, nil] egress limit for each request body in bytes per second
+    # @param body_chunk_size [Integer] bytes read per chunk from IO request bodies
+    # @param track_latency [Boolean] record per-request timings for {#latency_stats}
+    def initialize(settings: nil, memory_budget: nil, timeouts: nil, write_rate: nil, stream_write_rate: nil,
+      body_chunk_size: BodyReader::DEFAULT_CHUNK_SIZE, track_latency: true)
       @settings = settings || Settings.default
       @callbacks = setup_callbacks
       @connection = Connection.client_new(@settings, @callbacks)
+      @connection.memory_budget = memory_budget if memory_budget
+      @connection.stream_timeouts = timeouts if timeouts
+      @connection.set_write_rate(write_rate) if write_rate
+      @stream_write_rate = stream_write_rate
+      @body_chunk_size = body_chunk_size
+      @body_readers = {}
+      @track_latency = track_latency
+      @timings = {}
+      @latency = {}
+      @request_callbacks = {}
+      @reject_handler = nil
+      @flow_credit_handler = nil
       @stream_manager = StreamManager.new(is_server: false)
       @pending_requests = {}
       @responses = {}
@@ -72,60 +132,170 @@ module Nghttp3
       @streams_bound
     end
 
+    # Register a handler for flow control credit withheld under a memory budget
+    #
+    # While the connection is over its memory_budget, read_stream leaves the
+    # DATA payload of the largest consumers out of its return value so the
+    # peer slows down. Once memory drains, or the stream closes, the withheld
+    # bytes are passed to this handler. The transport should then extend the
+    # stream's and the connection's receive windows by that many bytes, as it
+    # does for the return value of read_stream; without a handler the credit
+    # is lost and the peer eventually stalls.
+    #
+    # @yield [stream_id, bytes] for each stream whose credit was released
+    # @yieldparam stream_id [Integer] the stream the data was received on
+    # @yieldparam bytes [Integer] bytes to add to the stream and connection offsets
+    # @return [self]
+    def on_flow_credit(&block)
+      @flow_credit_handler = block
+      self
+    end
+
+    # Register a handler for streams the client reset on its own
+    #
+    # Requests cancelled by the memory budget, or through
+    # Connection#reject_stream, are closed inside nghttp3 only; they end as
+    # :closed with H3_REQUEST_CANCELLED. The handler should reset each stream
+    # at the QUIC layer (RESET_STREAM and STOP_SENDING) with the given error
+    # code.
+    #
+    # @yield [stream_id, error_code] for each rejected stream, once closed
+    # @yieldparam stream_id [Integer] the rejected stream
+    # @yieldparam error_code [Integer] HTTP/3 error code
+    # @return [self]
+    def on_reject(&block)
+      @reject_handler = block
+      self
+    end
+
     # Submit a request
+    #
+    # IO and Enumerable bodies are streamed in chunks as the connection asks
+    # for data. When an IO is not ready the stream pauses; call
+    # {#resume_bodies} once it is readable.
+    #
+    # The callbacks are called from the connection callbacks as the response
+    # arrives, inside {#read_stream}, {#expire_timers}, {#close} or {#reset}.
+    # With on_data, body chunks are passed to it instead of being buffered
+    # in the response. With on_complete, the response is removed from
+    # {#responses} once it has been called.
+    #
     # @param request [Request] the request to submit
+    # @param on_headers [#call, nil] called with the response once its
+    #   final headers have been received; interim 1xx responses are skipped
+    # @param on_data [#call, nil] called with the response and each chunk of
+    #   the response body
+    # @param on_complete [#call, nil] called with the response and nil once
+    #   the response has ended, or with a {RequestAbortedError} if the
+    #   request ended first; the block is used if not given
     # @return [Integer] the stream ID for this request
-    def submit(request)
+    def submit(request, on_headers: nil, on_data: nil, on_complete: nil, &block)
       raise InvalidStateError, "Streams not bound. Call bind_streams first." unless @streams_bound
 
       stream_id = @stream_manager.allocate_bidi_stream_id
-      @pending_requests[stream_id] = request
-      @responses[stream_id] = Response.new(stream_id: stream_id)
-
-      @connection.submit_request(stream_id, request.to_nv_array, body: request.body)
+      reader = track_request(stream_id, request, request_callbacks(on_headers, on_data, on_complete || block))
+      begin
+        if reader
+          @connection.submit_request(stream_id, request.to_nv_array, &reader)
+        else
+          @connection.submit_request(stream_id, request.to_nv_array, body: request.body)
+        end
+      rescue
+        discard_request(stream_id)
+        raise
+      end
+      @connection.set_stream_write_rate(stream_id, @stream_write_rate) if @stream_write_rate
       stream_id
     end
 
+    # Submit many requests at once
+    #
+    # Allocates consecutive stream IDs and hands the whole batch to the
+    # connection in one call, which reads header fields straight from each
+    # request instead of building NV arrays. Every request is queued before
+    # the next {#pump_writes}, so their HEADERS frames go out in one burst.
+    #
+    # If a request fails to submit, it and the requests after it are dropped
+    # and the error is raised; the requests before it stay submitted.
+    #
+    # @param requests [Array<Request>] the requests to submit
+    # @param on_headers [#call, nil] see {#submit}, called for every request
+    # @param on_data [#call, nil] see {#submit}, called for every request
+    # @param on_complete [#call, nil] see {#submit}, called for every
+    #   request; the block is used if not given
+    # @return [Array<Integer>] stream IDs, in the order of requests
+    def submit_all(requests, on_headers: nil, on_data: nil, on_complete: nil, &block)
+      raise InvalidStateError, "Streams not bound. Call bind_streams first." unless @streams_bound
+
+      requests = requests.to_a
+      stream_ids = @stream_manager.allocate_bidi_stream_ids(requests.size)
+      return stream_ids if stream_ids.empty?
+
+      submitted = 0
+      callbacks = request_callbacks(on_headers, on_data, on_complete || block)
+      begin
+        @connection.submit_requests(stream_ids.first, requests) do |stream_id, request|
+          submitted = (stream_id - stream_ids.first) / 4
+          track_request(stream_id, request, callbacks)
+        end
+      rescue
+        stream_ids.drop(submitted).each { |stream_id| discard_request(stream_id) }
+        raise
+      end
+      stream_ids.each { |stream_id| @connection.set_stream_write_rate(stream_id, @stream_write_rate) } if @stream_write_rate
+      stream_ids
+    end
+
     # Convenience method for GET request
     # @param url [String] URL to request
     # @param headers [Hash] additional headers
+    # @param callbacks [Hash{Symbol => #call}] :on_headers, :on_data and
+    #   :on_complete callbacks, see {#submit}
     # @return [Integer] stream ID
-    def get(url, headers: {})
-      submit(Request.get(url, headers: headers))
+    def get(url, headers: {}, **callbacks, &block)
+      submit(Request.get(url, headers: headers), **callbacks, &block)
     end
 
     # Convenience method for POST request
     # @param url [String] URL to request
-    # @param body [String, nil] request body
+    # @param body [String, IO, Enumerable<String>, nil] request body
     # @param headers [Hash] additional headers
+    # @param callbacks [Hash{Symbol => #call}] :on_headers, :on_data and
+    #   :on_complete callbacks, see {#submit}
     # @return [Integer] stream ID
-    def post(url, body: nil, headers: {})
-      submit(Request.post(url, body: body, headers: headers))
+    def post(url, body: nil, headers: {}, **callbacks, &block)
+      submit(Request.post(url, body: body, headers: headers), **callbacks, &block)
     end
 
     # Convenience method for PUT request
     # @param url [String] URL to request
-    # @param body [String, nil] request body
+    # @param body [String, IO, Enumerable<String>, nil] request body
     # @param headers [Hash] additional headers
+    # @param callbacks [Hash{Symbol => #call}] :on_headers, :on_data and
+    #   :on_complete callbacks, see {#submit}
     # @return [Integer] stream ID
-    def put(url, body: nil, headers: {})
-      submit(Request.put(url, body: body, headers: headers))
+    def put(url, body: nil, headers: {}, **callbacks, &block)
+      submit(Request.put(url, body: body, headers: headers), **callbacks, &block)
     end
 
     # Convenience method for DELETE request
     # @param url [String] URL to request
     # @param headers [Hash] additional headers
+    # @param callbacks [Hash{Symbol => #call}] :on_headers, :on_data and
+    #   :on_complete callbacks, see {#submit}
     # @return [Integer] stream ID
-    def delete(url, headers: {})
-      submit(Request.delete(url, headers: headers))
+    def delete(url, headers: {}, **callbacks, &block)
+      submit(Request.delete(url, headers: headers), **callbacks, &block)
     end
 
     # Convenience method for HEAD request
     # @param url [String] URL to request
     # @param headers [Hash] additional headers
+    # @param callbacks [Hash{Symbol => #call}] :on_headers, :on_data and
+    #   :on_complete callbacks, see {#submit}
     # @return [Integer] stream ID
-    def head(url, headers: {})
-      submit(Request.head(url, headers: headers))
+    def head(url, headers: {}, **callbacks, &block)
+      submit(Request.head(url, headers: headers), **callbacks, &block)
     end
 
     # Pump pending writes to the QUIC layer
@@ -150,6 +320,90 @@ module Nghttp3
       self
     end
 
+    # Pump pending writes to the QUIC layer as packet-sized batches
+    #
+    # Coalesces small writes from many streams so each batch can be sent as
+    # one QUIC packet. Every byte yielded counts as written.
+    #
+    # @param max_payload [Integer] maximum bytes per batch
+    # @yield [data, slices] for each batch
+    # @yieldparam data [String] concatenated stream data
+    # @yieldparam slices [Array<Array(Integer, Integer, Integer, Boolean)>]
+    #   [stream_id, offset, length, fin] entries locating each stream's bytes in data
+    # @return [self]
+    def pump_packets(max_payload: 1200)
+      loop do
+        packets = @connection.writev_packets(max_payload)
+        break if packets.empty?
+
+        packets.each { |packet| yield(packet[:data], packet[:slices]) }
+      end
+      self
+    end
+
+    # Time at which a write rate next lets data through
+    #
+    # When pump_writes stops early because of write_rate or stream_write_rate,
+    # sleep until this time before pumping again.
+    #
+    # @return [Integer, nil] monotonic time in milliseconds, or nil if nothing is rate limited
+    def next_write_time
+      @connection.next_write_time
+    end
+
+    # Request bodies paused because their source was not ready
+    #
+    # Wait for these sources (e.g. with IO.select) and call {#resume_bodies}.
+    #
+    # @return [Hash{Integer => IO, Enumerable}] sources by stream ID
+    def waiting_bodies
+      @body_readers.each_with_object({}) do |(stream_id, reader), waiting|
+        waiting[stream_id] = reader.source if reader.waiting?
+      end
+    end
+
+    # Resume request bodies paused because their source was not ready
+    # @return [Array<Integer>] resumed stream IDs
+    def resume_bodies
+      @body_readers.filter_map do |stream_id, reader|
+        next unless reader.waiting?
+
+        @connection.resume_stream(stream_id)
+        stream_id
+      end
+    end
+
+    # Latency and size distributions of completed requests, per authority
+    #
+    # Each finished response records its time to response headers, time to
+    # the first response body byte, total duration from submission and the
+    # request plus response body bytes transferred. Requests that are
+    # cancelled or reset before the response ends are not recorded.
+    #
+    # @param reset [Boolean] discard the recorded samples after reading them
+    # @return [Hash{String => Hash{Symbol => Hash}}] for each authority,
+    #   :time_to_headers, :time_to_first_byte and :duration summaries in
+    #   milliseconds and a :bytes summary, see LatencyHistogram#summary
+    def latency_stats(reset: false)
+      stats = @latency.to_h do |authority, histograms|
+        [authority, {
+          time_to_headers: histograms[:time_to_headers].summary(1000.0),
+          time_to_first_byte: histograms[:time_to_first_byte].summary(1000.0),
+          duration: histograms[:duration].summary(1000.0),
+          bytes: histograms[:bytes].summary
+        }]
+      end
+      reset_latency_stats if reset
+      stats
+    end
+
+    # Discard all recorded latency samples
+    # @return [self]
+    def reset_latency_stats
+      @latency.clear
+      self
+    end
+
     # Read data from QUIC layer into HTTP/3 connection
     # @param stream_id [Integer] stream ID
     # @param data [String] received data
@@ -168,10 +422,48 @@ module Nghttp3
       self
     end
 
+    # Expire stream timers
+    #
+    # Cancels every request whose response header, idle or deadline timer has
+    # fired with H3_REQUEST_CANCELLED. The response is left unfinished. The
+    # caller should reset the returned streams at the QUIC layer.
+    #
+    # @param now [Integer, nil] monotonic time in milliseconds (defaults to now)
+    # @return [Array<Array(Integer, Symbol)>] [stream_id, kind] for each expired timer
+    def expire_timers(now = nil)
+      expired = @connection.expire_timers(now)
+      expired.uniq(&:first).each do |stream_id, _kind|
+        # Before closing: nghttp3 reports the close synchronously, which
+        # would end the request as :closed
+        abort_request(stream_id, :timeout, H3_REQUEST_CANCELLED)
+        begin
+          @connection.close_stream(stream_id, H3_REQUEST_CANCELLED)
+        rescue StreamNotFoundError
+          @connection.cancel_timer(stream_id)
+        end
+        @pending_requests.delete(stream_id)
+        @body_readers.delete(stream_id)
+        @timings.delete(stream_id)
+        @stream_manager.close_stream(stream_id)
+      end
+      expired
+    end
+
     # Close the client connection
-    # @return [nil]
+    #
+    # Releases all per-connection state at once: the connection's stream
+    # tables and the client's pending requests and responses.
+    #
+    # @return [Hash{Symbol => Integer}] streams and bytes released, see Connection#close
     def close
-      @connection.close
+      released = @connection.close
+      abort_requests
+      @stream_manager.reset
+      @body_readers.clear
+      @timings.clear
+      @pending_requests.clear
+      @responses.clear
+      released
     end
 
     # Check if the connection is closed
@@ -180,16 +472,62 @@ module Nghttp3
       @connection.closed?
     end
 
+    # Reset the client for a new peer connection
+    #
+    # Recycles the underlying connection and clears all per-connection state
+    # so the object can be reused instead of allocating a new Client. Streams
+    # must be bound again.
+    #
+    # @return [self]
+    def reset
+      @connection.recycle
+      abort_requests
+      @stream_manager.reset
+      @body_readers.clear
+      @timings.clear
+      @pending_requests.clear
+      @responses.clear
+      @streams_bound = false
+      self
+    end
+
     private
 
+    # Events are dispatched straight to the private on_* handlers below,
+    # which subclasses may override
     def setup_callbacks
-      Callbacks.new
-        .on_begin_headers { |stream_id| on_begin_headers(stream_id) }
-        .on_recv_header { |stream_id, name, value, flags| on_recv_header(stream_id, name, value, flags) }
-        .on_end_headers { |stream_id, fin| on_end_headers(stream_id, fin) }
-        .on_recv_data { |stream_id, data| on_recv_data(stream_id, data) }
-        .on_end_stream { |stream_id| on_end_stream(stream_id) }
-        .on_stream_close { |stream_id, app_error_code| on_stream_close(stream_id, app_error_code) }
+      Callbacks.dispatch_to(self)
+    end
+
+    def request_callbacks(on_headers, on_data, on_complete)
+      return unless on_headers || on_data || on_complete
+
+      RequestCallbacks.new(on_headers, on_data, on_complete)
+    end
+
+    # Records a request about to be submitted on a stream
+    # @return [BodyReader, nil] the reader for a streaming body
+    def track_request(stream_id, request, callbacks)
+      @pending_requests[stream_id] = request
+      @request_callbacks[stream_id] = callbacks if callbacks
+      @responses[stream_id] = Response.new(stream_id: stream_id)
+      if @track_latency
+        @timings[stream_id] = RequestTiming.new(request.authority, now_us, nil, nil,
+          request.streaming_body? ? 0 : request.body.to_s.bytesize)
+      end
+      return unless request.streaming_body?
+
+      @body_readers[stream_id] = BodyReader.new(request.body, chunk_size: @body_chunk_size)
+    end
+
+    # Forgets a request that was never submitted
+    def discard_request(stream_id)
+      @request_callbacks.delete(stream_id)
+      @pending_requests.delete(stream_id)
+      @responses.delete(stream_id)
+      @body_readers.delete(stream_id)
+      @timings.delete(stream_id)
+      @stream_manager.remove_stream(stream_id)
     end
 
     def on_begin_headers(stream_id)
@@ -209,28 +547,104 @@ module Nghttp3
     end
 
     def on_end_headers(stream_id, _fin)
-      # Headers complete
       response = @responses[stream_id]
+      # Interim (1xx) responses are dropped: the final response follows on
+      # the same stream, and only it fires on_headers and headers_at
+      if response&.status&.between?(100, 199)
+        response.status = nil
+        response.headers.clear
+        return
+      end
+
       response&.write_headers
+      timing = @timings[stream_id]
+      timing.headers_at ||= now_us if timing
+      @request_callbacks[stream_id]&.on_headers&.call(response)
     end
 
     def on_recv_data(stream_id, data)
       response = @responses[stream_id]
-      response&.append_body(data)
+      on_data = @request_callbacks[stream_id]&.on_data
+      if on_data
+        on_data.call(response, data)
+        # Handed off, so no longer held against the memory budget
+        @connection.release_memory(stream_id, data.bytesize)
+      else
+        response&.append_body(data)
+      end
+      timing = @timings[stream_id]
+      return unless timing
+
+      timing.first_byte_at ||= now_us
+      timing.bytes += data.bytesize
     end
 
     def on_end_stream(stream_id)
       response = @responses[stream_id]
       response&.finish
+      record_latency(stream_id)
       @pending_requests.delete(stream_id)
       @stream_manager.close_stream(stream_id)
+      complete_request(stream_id, nil)
     end
 
-    def on_stream_close(stream_id, _app_error_code)
+    def on_stream_close(stream_id, app_error_code)
       response = @responses[stream_id]
       response&.finish
       @pending_requests.delete(stream_id)
+      @body_readers.delete(stream_id)
+      @timings.delete(stream_id)
       @stream_manager.close_stream(stream_id)
+      abort_request(stream_id, :closed, app_error_code)
+    end
+
+    def on_stream_rejected(stream_id, app_error_code)
+      @reject_handler&.call(stream_id, app_error_code)
+    end
+
+    def on_deferred_consume(stream_id, consumed)
+      @flow_credit_handler&.call(stream_id, consumed)
+    end
+
+    # Calls the request's on_complete callback, at most once per request
+    def complete_request(stream_id, error)
+      callbacks = @request_callbacks.delete(stream_id)
+      return unless callbacks&.on_complete
+
+      callbacks.on_complete.call(@responses.delete(stream_id), error)
+    end
+
+    def abort_request(stream_id, reason, error_code = nil)
+      return unless @request_callbacks.key?(stream_id)
+
+      complete_request(stream_id, RequestAbortedError.new(stream_id, reason, error_code))
+    end
+
+    # Ends every request still waiting for its response
+    def abort_requests
+      @request_callbacks.keys.each { |stream_id| abort_request(stream_id, :connection_closed) } unless @request_callbacks.empty?
+    end
+
+    def record_latency(stream_id)
+      timing = @timings.delete(stream_id)
+      return unless timing
+
+      finished = now_us
+      reader = @body_readers[stream_id]
+      histograms = @latency[timing.authority.to_s] ||= {
+        time_to_headers: LatencyHistogram.new,
+        time_to_first_byte: LatencyHistogram.new,
+        duration: LatencyHistogram.new,
+        bytes: LatencyHistogram.new
+      }
+      histograms[:time_to_headers].record((timing.headers_at || finished) - timing.started)
+      histograms[:time_to_first_byte].record((timing.first_byte_at || finished) - timing.started)
+      histograms[:duration].record(finished - timing.started)
+      histograms[:bytes].record(timing.bytes + (reader ? reader.bytes_read : 0))
+    end
+
+    def now_us
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
     end
   end
 end
@@ -0,0 +1,156 @@
+# frozen_string_literal: true
+
+module Nghttp3
+  # HDR-style histogram of non-negative integer samples
+  #
+  # Values are counted in log-linear buckets: every power-of-two range is
+  # split into 2**(precision - 1) equal sub-buckets, so any recorded value is
+  # reported within a relative error of 2**-(precision - 1) while memory
+  # stays proportional to the number of powers of two seen. Recording is an
+  # index computation and an Array increment.
+  #
+  # @example
+  #   histogram = Nghttp3::LatencyHistogram.new
+  #   histogram.record(1_000)
+  #   histogram.record(1_250)
+  #   histogram.percentile(50) # => 1007, the upper end of 1_000's bucket
+  #   histogram.percentile(99) # => 1250, clamped to the largest sample
+  class LatencyHistogram
+    # Default sub-bucket bits, about 3% relative error
+    DEFAULT_PRECISION = 6
+
+    # @return [Integer] number of samples recorded
+    attr_reader :count
+
+    # @return [Integer] sum of all samples
+    attr_reader :total
+
+    # @return [Integer, nil] smallest sample, nil if empty
+    attr_reader :min
+
+    # @return [Integer, nil] largest sample, nil if empty
+    attr_reader :max
+
+    # Create an empty histogram
+    # @param precision [Integer] sub-bucket bits per power of two (1..16)
+    def initialize(precision: DEFAULT_PRECISION)
+      raise ArgumentError, "precision must be between 1 and 16" unless (1..16).cover?(precision)
+
+      @precision = precision
+      @half = 1 << (precision - 1)
+      @counts = []
+      reset
+    end
+
+    # Record a sample
+    # @param value [Integer] non-negative sample
+    # @return [self]
+    def record(value)
+      value = 0 if value.negative?
+      index = index_of(value)
+      @counts[index] = (@counts[index] || 0) + 1
+      @count += 1
+      @total += value
+      @min = value if @min.nil? || value < @min
+      @max = value if @max.nil? || value > @max
+      self
+    end
+
+    # Mean of all samples
+    # @return [Float]
+    def mean
+      @count.zero? ? 0.0 : @total.fdiv(@count)
+    end
+
+    # Value at or below which a given percentage of samples fall
+    #
+    # Reports the highest value equivalent to the bucket holding the
+    # percentile, clamped to the recorded range.
+    #
+    # @param percent [Numeric] percentile between 0 and 100
+    # @return [Integer] 0 if empty
+    def percentile(percent)
+      return 0 if @count.zero?
+
+      target = [(@count * percent / 100.0).ceil, 1].max
+      seen = 0
+      @counts.each_with_index do |n, index|
+        next unless n
+
+        seen += n
+        return highest_equivalent(index).clamp(@min, @max) if seen >= target
+      end
+      @max
+    end
+
+    # Add another histogram's samples to this one
+    # @param other [LatencyHistogram] histogram with the same precision
+    # @return [self]
+    def merge!(other)
+      raise ArgumentError, "precision mismatch" unless other.precision == @precision
+      return self if other.count.zero?
+
+      other.bucket_counts.each_with_index do |n, index|
+        @counts[index] = (@counts[index] || 0) + n if n
+      end
+      @count += other.count
+      @total += other.total
+      @min = other.min if @min.nil? || other.min < @min
+      @max = other.max if @max.nil? || other.max > @max
+      self
+    end
+
+    # Discard all samples
+    # @return [self]
+    def reset
+      @counts.clear
+      @count = 0
+      @total = 0
+      @min = nil
+      @max = nil
+      self
+    end
+
+    # Summary of the distribution
+    # @param scale [Numeric] divisor applied to reported values (e.g. 1000.0
+    #   to report microsecond samples in milliseconds)
+    # @return [Hash{Symbol => Numeric}] count, min, max, mean, p50, p90, p99, p999
+    def summary(scale = 1)
+      {
+        count: @count,
+        min: (@min || 0) / scale,
+        max: (@max || 0) / scale,
+        mean: mean / scale,
+        p50: percentile(50) / scale,
+        p90: percentile(90) / scale,
+        p99: percentile(99) / scale,
+        p999: percentile(99.9) / scale
+      }
+    end
+
+    protected
+
+    attr_reader :precision
+
+    def bucket_counts
+      @counts
+    end
+
+    private
+
+    def index_of(value)
+      shift = value.bit_length - @precision
+      return value if shift <= 0
+
+      shift * @half + (value >> shift)
+    end
+
+    def highest_equivalent(index)
+      return index if index < 2 * @half
+
+      shift = index / @half - 1
+      sub = index - shift * @half
+      ((sub + 1) << shift) - 1
+    end
+  end
+end
@@ -0,0 +1,264 @@
+# frozen_string_literal: true
+
+require "stringio"
+
+module Nghttp3
+  # Runs a Rack application as a Server request handler
+  #
+  # The env Hash is built lazily: the CGI keys Rack requires are set up front,
+  # while +HTTP_*+ keys are looked up in the request headers the first time
+  # they are read with +env[key]+ and stored from then on. Iterating the env
+  # or calling +fetch+/+key?+ only sees keys already read; pass
+  # +lazy_headers: false+ for middleware that walks the whole env.
+  #
+  # Env Hashes and their +rack.input+ are reused across requests once the
+  # response has been handed to the connection, or once a streamed body has
+  # been read to the end. Applications that keep the env beyond the request
+  # should pass +reuse_env: false+.
+  #
+  # Response bodies that respond to +each+ or +call+ (Rack 3 streaming
+  # bodies) are streamed through the connection's data reader as the
+  # connection asks for data instead of being buffered. The body is closed
+  # once it has been read to the end, or by the Server when the stream closes
+  # before that, e.g. after a reset or timeout.
+  #
+  # @example
+  #   server = Nghttp3::Server.new
+  #   server.on_request(&Nghttp3::RackAdapter.new(app))
+  class RackAdapter
+    # Maximum number of idle env Hashes kept for reuse
+    POOL_SIZE = 64
+
+    # Key under which the Request is kept in the env
+    REQUEST_KEY = "nghttp3.request"
+
+    REQUEST_METHOD = "REQUEST_METHOD"
+    SCRIPT_NAME = "SCRIPT_NAME"
+    PATH_INFO = "PATH_INFO"
+    QUERY_STRING = "QUERY_STRING"
+    SERVER_NAME = "SERVER_NAME"
+    SERVER_PORT = "SERVER_PORT"
+    SERVER_PROTOCOL = "SERVER_PROTOCOL"
+    HTTP_HOST = "HTTP_HOST"
+    CONTENT_TYPE = "CONTENT_TYPE"
+    CONTENT_LENGTH = "CONTENT_LENGTH"
+    RACK_URL_SCHEME = "rack.url_scheme"
+    RACK_INPUT = "rack.input"
+    RACK_ERRORS = "rack.errors"
+    HTTP3 = "HTTP/3"
+    EMPTY = ""
+    EMPTY_BODY = "".b.freeze
+    private_constant :REQUEST_METHOD, :SCRIPT_NAME, :PATH_INFO, :QUERY_STRING, :SERVER_NAME,
+      :SERVER_PORT, :SERVER_PROTOCOL, :HTTP_HOST, :CONTENT_TYPE, :CONTENT_LENGTH, :RACK_URL_SCHEME,
+      :RACK_INPUT, :RACK_ERRORS, :HTTP3, :EMPTY, :EMPTY_BODY
+
+    # Resolves HTTP_* keys from the request headers on first access
+    LAZY_HEADERS = proc do |env, key|
+      next unless key.is_a?(String) && key.start_with?("HTTP_")
+
+      request = env[REQUEST_KEY]
+      next unless request
+
+      value = request.headers[key.delete_prefix("HTTP_").downcase.tr("_", "-")]
+      env[key] = value if value
+    end
+    private_constant :LAZY_HEADERS
+
+    # Rack 3 stream handed to bodies that respond to +call+
+    #
+    # Each write is passed on as one chunk of the response body; reads come
+    # from the request body.
+    class Stream
+      def initialize(yielder, input)
+        @yielder = yielder
+        @input = input
+        @closed = false
+      end
+
+      def read(...)
+        @input.read(...)
+      end
+
+      def write(data)
+        data = data.to_s
+        @yielder << data unless data.empty?
+        data.bytesize
+      end
+
+      def <<(data)
+        write(data)
+        self
+      end
+
+      def flush
+        self
+      end
+
+      def close_read
+      end
+
+      def close_write
+        @closed = true
+      end
+
+      def close
+        @closed = true
+      end
+
+      def closed?
+        @closed
+      end
+    end
+
+    # Streamed response body handed to the Server
+    #
+    # Enumerates the chunks of a Rack body. Closing it closes the Rack body
+    # and releases the env, once, whether or not the chunks were read to the
+    # end.
+    class StreamedBody
+      def initialize(chunks, on_close)
+        @chunks = chunks
+        @on_close = on_close
+      end
+
+      def each(&)
+        @chunks.each(&)
+      end
+
+      def close
+        @on_close.call
+      end
+    end
+
+    # @return [#call] the Rack application
+    attr_reader :app
+
+    # Wrap a Rack application
+    # @param app [#call] Rack application
+    # @param lazy_headers [Boolean] resolve HTTP_* env keys on first access
+    # @param reuse_env [Boolean] reuse env Hashes across requests
+    def initialize(app, lazy_headers: true, reuse_env: true)
+      @app = app
+      @lazy_headers = lazy_headers
+      @reuse_env = reuse_env
+      @pool = []
+    end
+
+    # Run the application for one request
+    # @param request [Request] incoming request
+    # @param response [Response] response to populate
+    # @return [void]
+    def call(request, response)
+      env = build_env(request)
+      status, headers, body = @app.call(env)
+      response.status = status.to_i
+      copy_headers(headers, response.headers)
+
+      if body.respond_to?(:to_ary)
+        parts = body.to_ary
+        body.close if body.respond_to?(:close)
+        response.body = (parts.size <= 1) ? parts[0] : parts
+        release(env)
+      elsif body.respond_to?(:each) || body.respond_to?(:call)
+        response.body = stream(body, env)
+      else
+        release(env)
+      end
+    end
+
+    # @return [Proc] the adapter as a block for Server#on_request
+    def to_proc
+      method(:call).to_proc
+    end
+
+    private
+
+    def build_env(request)
+      env = @pool.pop || new_env
+      path = request.path
+      query = path.index("?")
+      authority = request.authority
+      scheme = request.scheme
+      port_sep = authority.rindex(":") if authority && !authority.end_with?("]")
+
+      env[REQUEST_KEY] = request
+      env[REQUEST_METHOD] = request.method
+      env[SCRIPT_NAME] = EMPTY
+      env[PATH_INFO] = query ? path[0, query] : path
+      env[QUERY_STRING] = query ? path[(query + 1)..] : EMPTY
+      env[SERVER_NAME] = port_sep ? authority[0, port_sep] : (authority || "localhost")
+      env[SERVER_PORT] = port_sep ? authority[(port_sep + 1)..] : default_port(scheme)
+      env[SERVER_PROTOCOL] = HTTP3
+      env[RACK_URL_SCHEME] = scheme
+      env[RACK_ERRORS] = $stderr
+      env[HTTP_HOST] = authority if authority
+      env[RACK_INPUT].string = request.body || EMPTY_BODY
+
+      headers = request.headers
+      content_type = headers["content-type"]
+      env[CONTENT_TYPE] = content_type if content_type
+      content_length = headers["content-length"]
+      env[CONTENT_LENGTH] = content_length if content_length
+      copy_request_headers(headers, env) unless @lazy_headers
+      env
+    end
+
+    def new_env
+      env = @lazy_headers ? Hash.new(&LAZY_HEADERS) : {}
+      env[RACK_INPUT] = StringIO.new(EMPTY_BODY)
+      env
+    end
+
+    def default_port(scheme)
+      (scheme == "http") ? "80" : "443"
+    end
+
+    def copy_request_headers(headers, env)
+      headers.each do |name, value|
+        next if name == "content-type" || name == "content-length"
+
+        env["HTTP_#{name.upcase.tr("-", "_")}"] = value
+      end
+    end
+
+    # Multiple values are joined with newlines, which Response#to_nv_array
+    # splits back into separate fields
+    def copy_headers(headers, target)
+      headers.each do |name, value|
+        target[name] = value.is_a?(Array) ? value.join("\n") : value
+      end
+    end
+
+    def stream(body, env)
+      input = env[RACK_INPUT]
+      closed = false
+      finish = lambda do
+        next if closed
+
+        closed = true
+        body.close if body.respond_to?(:close)
+        release(env)
+      end
+      chunks = Enumerator.new do |yielder|
+        if body.respond_to?(:each)
+          body.each { |chunk| yielder << chunk }
+        else
+          body.call(Stream.new(yielder, input))
+        end
+      ensure
+        finish.call
+      end
+      StreamedBody.new(chunks, finish)
+    end
+
+    def release(env)
+      return unless @reuse_env && @pool.size < POOL_SIZE
+
+      input = env[RACK_INPUT]
+      env.clear
+      input.string = EMPTY_BODY
+      env[RACK_INPUT] = input
+      @pool.push(env)
+    end
+  end
+end
@@ -23,7 +23,7 @@ module Nghttp3
     # @return [Headers] request headers
     attr_reader :headers
 
-    # @return [String, nil] request body
+    # @return [String, IO, Enumerable<String>, nil] request body
     attr_reader :body
 
     # Create a new request
@@ -32,14 +32,15 @@ module Nghttp3
     # @param scheme [String] URL scheme (default: "https")
     # @param authority [String, nil] authority (host:port)
     # @param headers [Hash, Headers] additional headers
-    # @param body [String, nil] request body
+    # @param body [String, IO, Enumerable<String>, nil] request body; IO and
+    #   Enumerable bodies are streamed in chunks and not copied
     def initialize(method:, path:, scheme: "https", authority: nil, headers: {}, body: nil)
       @method = method.to_s.upcase.freeze
       @scheme = scheme.to_s.freeze
       @authority = authority&.to_s&.freeze
       @path = path.to_s.freeze
       @headers = headers.is_a?(Headers) ? headers : Headers.new(headers)
-      @body = body&.dup&.freeze
+      @body = body.is_a?(String) ? body.dup.freeze : body
       freeze
     end
 
@@ -58,7 +59,15 @@ module Nghttp3
     # Check if request has a body
     # @return [Boolean]
     def body?
-      !@body.nil? && !@body.empty?
+      return streaming_body? unless @body.is_a?(String)
+
+      !@body.empty?
+    end
+
+    # Check if the body is read from an IO or Enumerable
+    # @return [Boolean]
+    def streaming_body?
+      BodyReader.streamable?(@body)
     end
 
     # String representation
@@ -77,7 +86,7 @@ module Nghttp3
 
       # Create a POST request
       # @param url [String] full URL
-      # @param body [String, nil] request body
+      # @param body [String, IO, Enumerable<String>, nil] request body
       # @param headers [Hash] additional headers
       # @return [Request]
       def post(url, body: nil, headers: {})
@@ -86,7 +95,7 @@ module Nghttp3
 
       # Create a PUT request
       # @param url [String] full URL
-      # @param body [String, nil] request body
+      # @param body [String, IO, Enumerable<String>, nil] request body
       # @param headers [Hash] additional headers
       # @return [Request]
       def put(url, body: nil, headers: {})
@@ -111,7 +120,7 @@ module Nghttp3
 
       # Create a PATCH request
       # @param url [String] full URL
-      # @param body [String, nil] request body
+      # @param body [String, IO, Enumerable<String>, nil] request body
       # @param headers [Hash] additional headers
       # @return [Request]
       def patch(url, body: nil, headers: {})
@@ -0,0 +1,155 @@
+# frozen_string_literal: true
+
+module Nghttp3
+  # Recycles Request and Response objects between streams
+  #
+  # A Server given a pool takes each stream's Response from it and has its
+  # Request refilled in place by Connection#take_request, then hands both
+  # back once the stream closes. Together with the header Hashes the
+  # connection keeps, a warm pool serves a request without allocating a
+  # Request, a Response, their Headers or the Hashes behind them.
+  #
+  # Pooled Requests are not frozen; they are refilled rather than mutated
+  # through their API. Handlers must not keep the request or response past
+  # the stream's close. In debug mode, released requests are poisoned so
+  # later use fails instead of reading another stream's data, and a released
+  # response changed before it is handed out again raises
+  # InvalidStateError naming the stream it was released from.
+  #
+  # One pool may be shared by several servers.
+  #
+  # @example
+  #   pool = Nghttp3::RequestPool.new(size: 128)
+  #   server = Nghttp3::Server.new(pool: pool)
+  #   pool.stats # => {requests: 0, responses: 0, hits: 0, misses: 0, released: 0}
+  class RequestPool
+    # Default maximum number of idle objects of each kind
+    DEFAULT_SIZE = 64
+
+    # @return [Integer] maximum number of idle requests and of idle responses
+    attr_reader :size
+
+    # @return [Integer] objects handed out from the pool
+    attr_reader :hits
+
+    # @return [Integer] objects allocated because the pool was empty
+    attr_reader :misses
+
+    # @return [Integer] objects handed back to the pool
+    attr_reader :released
+
+    # Create an empty pool
+    # @param size [Integer] maximum number of idle objects of each kind
+    # @param debug [Boolean] poison released requests and check released
+    #   responses for use after release
+    def initialize(size: DEFAULT_SIZE, debug: false)
+      raise ArgumentError, "size must be positive" unless size.positive?
+
+      @size = size
+      @debug = debug
+      @requests = []
+      @responses = []
+      @released_from = {}.compare_by_identity if debug
+      @hits = 0
+      @misses = 0
+      @released = 0
+    end
+
+    # @return [Boolean] true if use after release is checked
+    def debug?
+      @debug
+    end
+
+    # Take a request to be refilled by Connection#take_request
+    # @return [Request] an unfrozen, possibly uninitialized Request
+    def acquire_request
+      request = @requests.pop
+      return hit(request) if request
+
+      @misses += 1
+      Request.allocate
+    end
+
+    # Take a response for a stream, reset to its initial state
+    # @param stream_id [Integer] stream the response is for
+    # @return [Response]
+    def acquire_response(stream_id)
+      response = @responses.pop
+      unless response
+        @misses += 1
+        return Response.new(stream_id: stream_id)
+      end
+
+      check_response(response) if @debug
+      hit(response).reset(stream_id)
+    end
+
+    # Hand a request back once its stream has closed
+    #
+    # Frozen requests, which were not taken from a pool, are ignored.
+    #
+    # @param request [Request]
+    # @return [self]
+    def release_request(request)
+      return self if request.frozen? || @requests.size >= @size
+
+      poison(request) if @debug
+      @requests.push(request)
+      @released += 1
+      self
+    end
+
+    # Hand a response back once its stream has closed
+    # @param response [Response]
+    # @return [self]
+    def release_response(response)
+      return self if @responses.size >= @size
+
+      stream_id = response.stream_id
+      response.reset
+      @released_from[response] = stream_id if @debug
+      @responses.push(response)
+      @released += 1
+      self
+    end
+
+    # Drop all idle objects
+    # @return [self]
+    def clear
+      @requests.clear
+      @responses.clear
+      @released_from&.clear
+      self
+    end
+
+    # Pool counters
+    # @return [Hash{Symbol => Integer}] idle requests and responses, hits,
+    #   misses and releases
+    def stats
+      {requests: @requests.size, responses: @responses.size, hits: @hits, misses: @misses, released: @released}
+    end
+
+    private
+
+    def hit(object)
+      @hits += 1
+      object
+    end
+
+    # Clears the fields so a handler still holding the request fails fast
+    def poison(request)
+      request.instance_variable_set(:@method, nil)
+      request.instance_variable_set(:@path, nil)
+      request.instance_variable_set(:@authority, nil)
+      request.instance_variable_set(:@headers, nil)
+      request.instance_variable_set(:@body, nil)
+    end
+
+    def check_response(response)
+      stream_id = @released_from.delete(response)
+      return if response.pristine?
+
+      raise InvalidStateError, "Response released from stream #{stream_id} was modified after release"
+    end
+  end
+end
@@ -16,7 +16,8 @@ module Nghttp3
     # @return [Headers] response headers
     attr_reader :headers
 
-    # @return [String, nil] response body (for simple responses)
+    # @return [String, IO, Enumerable<String>, nil] response body; IO and
+    #   Enumerable bodies are streamed by Server
     attr_accessor :body
 
     # Create a new response
@@ -35,11 +36,20 @@ module Nghttp3
     end
 
     # Convert to NV array for low-level Connection API (server-side)
+    #
+    # A header value containing newlines is sent as one field per line.
+    #
     # @return [Array<NV>] array of NV objects for status and headers
     def to_nv_array
       nvs = []
       nvs << NV.new(":status", @status.to_s) if @status
-      @headers.each { |name, value| nvs << NV.new(name, value) }
+      @headers.each do |name, value|
+        if value.include?("\n")
+          value.each_line(chomp: true) { |line| nvs << NV.new(name, line) }
+        else
+          nvs << NV.new(name, value)
+        end
+      end
       nvs
     end
 
@@ -96,9 +106,17 @@ module Nghttp3
     # Check if response has a body
     # @return [Boolean]
     def body?
+      return true if streaming_body?
+
       (@body && !@body.empty?) || !@body_chunks.empty?
     end
 
+    # Check if the body is read from an IO or Enumerable
+    # @return [Boolean]
+    def streaming_body?
+      BodyReader.streamable?(@body)
+    end
+
     # Get the effective body (either set body or joined chunks)
     # @return [String, nil]
     def effective_body
@@ -116,6 +134,29 @@ module Nghttp3
       self
     end
 
+    # Return the response to its initial state for reuse
+    #
+    # Keeps the Headers object and the body chunk Array, emptied.
+    #
+    # @param stream_id [Integer] the stream ID the response is reused for
+    # @return [self]
+    def reset(stream_id = @stream_id)
+      @stream_id = stream_id
+      @status = nil
+      @headers.clear
+      @body = nil
+      @body_chunks.clear
+      @headers_sent = false
+      @finished = false
+      self
+    end
+
+    # Check if the response is still in its initial state
+    # @return [Boolean]
+    def pristine?
+      @status.nil? && @body.nil? && @headers.empty? && @body_chunks.empty? && !@headers_sent && !@finished
+    end
+
     # String representation
     def inspect
       status_str = @status ? @status.to_s : "pending"
@@ -24,6 +24,15 @@ module Nghttp3
   #     quic.write(stream_id, data, fin)
   #   end
   class Server
+    # Content type of the metrics endpoint
+    METRICS_CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8"
+
+    # Metrics route label for requests served by the on_request handler
+    UNROUTED = "on_request"
+
+    # Metrics route label for requests answered with 404
+    NOT_FOUND = "not_found"
+
     # @return [Connection] the underlying low-level connection
     attr_reader :connection
 
@@ -36,18 +45,72 @@ module Nghttp3
     # @return [Hash{Integer => Response}] responses by stream ID
     attr_reader :responses
 
+    # @return [AdmissionController, nil] admission controller for new requests
+    attr_reader :admission
+
+    # @return [Router, nil] routes registered with {#route}
+    attr_reader :router
+
+    # @return [Metrics, nil] request metrics, if enabled
+    attr_reader :metrics
+
+    # @return [RequestPool, nil] pool recycling requests and responses, if enabled
+    attr_reader :pool
+
     # Create a new HTTP/3 server
     # @param settings [Settings, nil] settings to use (defaults to Settings.default)
-    def initialize(settings: nil)
+    # @param memory_budget [Integer, nil] per-connection memory budget in bytes;
+    #   a request body that outgrows it is rejected, see {#on_reject}
+    # @param timeouts [Hash{Symbol => Integer}, nil] per-stream timeouts in
+    #   milliseconds (:header, :idle, :deadline), see Connection#stream_timeouts=
+    # @param admission [AdmissionController, Hash, nil] admission controller, or
+    #   options for a new one; rejected requests are closed with H3_REQUEST_REJECTED.
+    #   With a latency_target, every {#read_stream} must pass +received_at:+
+    # @param write_rate [Integer, nil] egress limit for the connection in bytes per second
+    # @param stream_write_rate [Integer, nil] egress limit for each response in bytes per second
+    # @param abuse_limits [Hash{Symbol => Integer}, nil] stream open/reset/stop_sending/cancel
+    #   limits per window, see Connection#abuse_limits=
+    # @param metrics [Metrics, Boolean, nil] record per-route request metrics;
+    #   pass a Metrics to share one registry between servers
+    # @param metrics_path [String, nil] path serving the metrics in Prometheus
+    #   text format, or nil to only expose them through {#metrics}
+    # @param pool [RequestPool, Boolean, Integer, nil] recycle requests and
+    #   responses once their stream closes; an Integer sets the pool size.
+    #   Closed streams are then removed from {#requests} and {#responses}
+    def initialize(settings: nil, memory_budget: nil, timeouts: nil, admission: nil, write_rate: nil,
+      stream_write_rate: nil, abuse_limits: nil, metrics: nil, metrics_path: "/metrics", pool: nil)
       @settings = settings || Settings.default
       @callbacks = setup_callbacks
       @connection = Connection.server_new(@settings, @callbacks)
+      @connection.assemble_requests = true
+      @connection.memory_budget = memory_budget if memory_budget
+      @connection.stream_timeouts = timeouts if timeouts
+      @connection.set_write_rate(write_rate) if write_rate
+      @connection.abuse_limits = abuse_limits if abuse_limits
+      @stream_write_rate = stream_write_rate
       @stream_manager = StreamManager.new(is_server: true)
       @request_handler = nil
+      @reject_handler = nil
+      @flow_credit_handler = nil
+      @router = nil
       @requests = {}
       @responses = {}
-      @building_requests = {}  # Requests being built (headers not complete)
+      @streamed_bodies = {}
       @streams_bound = false
+      @admission = admission.is_a?(Hash) ? AdmissionController.new(**admission) : admission
+      @admitted_streams = {}
+      @received_at = nil
+      @metrics = (metrics == true) ? Metrics.new : (metrics || nil)
+      @metrics_path = metrics_path
+      @metrics_query = metrics_path && "#{metrics_path}?"
+      @metric_series = {}
+      @metric_started = {}
+      @pool =
+        case pool
+        when true then RequestPool.new
+        when Integer then RequestPool.new(size: pool)
+        else pool || nil
+        end
     end
 
     # Bind control and QPACK streams
@@ -79,6 +142,8 @@ module Nghttp3
     #
     # The handler is called when a complete request is received.
     # The handler should set response.status and response.body (or use streaming).
+    # A streamed body that responds to +close+ is closed when its stream
+    # closes, including when the stream is reset or the server is closed.
     #
     # @yield [request, response] for each incoming request
     # @yieldparam request [Request] the incoming request
@@ -89,6 +154,71 @@ module Nghttp3
       self
     end
 
+    # Register a handler for flow control credit withheld under a memory budget
+    #
+    # While the connection is over its memory_budget, read_stream leaves the
+    # DATA payload of the largest consumers out of its return value so the
+    # peer slows down. Once memory drains, or the stream closes, the withheld
+    # bytes are passed to this handler. The transport should then extend the
+    # stream's and the connection's receive windows by that many bytes, as it
+    # does for the return value of read_stream; without a handler the credit
+    # is lost and the peer eventually stalls.
+    #
+    # @yield [stream_id, bytes] for each stream whose credit was released
+    # @yieldparam stream_id [Integer] the stream the data was received on
+    # @yieldparam bytes [Integer] bytes to add to the stream and connection offsets
+    # @return [self]
+    def on_flow_credit(&block)
+      @flow_credit_handler = block
+      self
+    end
+
+    # Register a handler for streams the server rejected
+    #
+    # Requests shed by admission control or by the memory budget are closed
+    # inside nghttp3 only. The handler should reset each stream at the QUIC
+    # layer (RESET_STREAM and STOP_SENDING) with the given error code so the
+    # peer learns the request was rejected.
+    #
+    # @yield [stream_id, error_code] for each rejected stream, once closed
+    # @yieldparam stream_id [Integer] the rejected stream
+    # @yieldparam error_code [Integer] HTTP/3 error code, H3_REQUEST_REJECTED
+    # @return [self]
+    def on_reject(&block)
+      @reject_handler = block
+      self
+    end
+
+    # Register a handler for one route
+    #
+    # Routes are matched in C against the request method, path and
+    # authority before the handler passed to {#on_request}, which only sees
+    # requests no route matched. Without an on_request handler, unmatched
+    # requests get a 404 response. With metrics enabled, requests are
+    # counted under the route's pattern.
+    #
+    # @example
+    #   server.route(:get, "/users/:id") do |request, response, params|
+    #     response.status = 200
+    #     response.body = "user #{params["id"]}"
+    #   end
+    #
+    # @param method [String, Symbol, nil] request method, or nil for any
+    # @param pattern [String] path pattern with :param and trailing *wildcard
+    #   segments, see Router#add
+    # @param authority [String, nil] only match requests for this authority
+    # @yield [request, response, params] for each matching request
+    # @yieldparam request [Request] the incoming request
+    # @yieldparam response [Response] the response object to populate
+    # @yieldparam params [Hash{String => String}] captured path parameters
+    # @return [self]
+    def route(method, pattern, authority: nil, &block)
+      raise ArgumentError, "route requires a block" unless block
+
+      (@router ||= Router.new).add(method, pattern, [block, pattern.dup.freeze], authority)
+      self
+    end
+
     # Pump pending writes to the QUIC layer
     #
     # @yield [stream_id, data, fin] for each pending write
@@ -111,12 +241,66 @@ module Nghttp3
       self
     end
 
+    # Pump pending writes to the QUIC layer as packet-sized batches
+    #
+    # Coalesces small writes from many streams so each batch can be sent as
+    # one QUIC packet. Every byte yielded counts as written.
+    #
+    # @param max_payload [Integer] maximum bytes per batch
+    # @yield [data, slices] for each batch
+    # @yieldparam data [String] concatenated stream data
+    # @yieldparam slices [Array<Array(Integer, Integer, Integer, Boolean)>]
+    #   [stream_id, offset, length, fin] entries locating each stream's bytes in data
+    # @return [self]
+    def pump_packets(max_payload: 1200)
+      loop do
+        packets = @connection.writev_packets(max_payload)
+        break if packets.empty?
+
+        packets.each { |packet| yield(packet[:data], packet[:slices]) }
+      end
+      self
+    end
+
+    # Time at which a write rate next lets data through
+    #
+    # When pump_writes stops early because of write_rate or stream_write_rate,
+    # sleep until this time before pumping again.
+    #
+    # @return [Integer, nil] monotonic time in milliseconds, or nil if nothing is rate limited
+    def next_write_time
+      @connection.next_write_time
+    end
+
     # Read data from QUIC layer into HTTP/3 connection
+    #
+    # An admission latency_target measures the queue delay from +received_at+
+    # to the start of the request's handler, so it must be the time the
+    # packet was read off the socket, before it waited in any queue. Taking
+    # the time here instead would always measure about 0ms and never shed
+    # load, so +received_at+ is required when a latency_target is set.
+    #
+    # @example
+    #   # Taken as each UDP datagram is read off the socket
+    #   received_at = Nghttp3::AdmissionController.now
+    #   server.read_stream(stream_id, data, received_at: received_at)
+    #
     # @param stream_id [Integer] stream ID
     # @param data [String] received data
     # @param fin [Boolean] true if this is the final data for the stream
+    # @param received_at [Numeric, nil] monotonic time in milliseconds the data
+    #   arrived, see {AdmissionController.now}
+    # @raise [ArgumentError] if the admission controller has a latency_target
+    #   and received_at is nil
+    # @raise [ExcessiveLoadError] if the peer crossed an abuse limit; close the
+    #   QUIC connection with H3_EXCESSIVE_LOAD
     # @return [Integer] number of bytes consumed
-    def read_stream(stream_id, data, fin: false)
+    def read_stream(stream_id, data, fin: false, received_at: nil)
+      if received_at.nil? && @admission&.latency_target
+        raise ArgumentError, "received_at is required with an admission latency_target"
+      end
+
+      @received_at = received_at
       @connection.read_stream(stream_id, data, fin: fin)
     end
 
@@ -129,10 +313,39 @@ module Nghttp3
       self
     end
 
+    # Expire stream timers
+    #
+    # Closes every stream whose header, idle or deadline timer has fired and
+    # drops its partially built request. Streams still receiving the request
+    # are closed with H3_REQUEST_INCOMPLETE, others with H3_REQUEST_CANCELLED.
+    # The caller should reset the returned streams at the QUIC layer.
+    #
+    # @param now [Integer, nil] monotonic time in milliseconds (defaults to now)
+    # @return [Array<Array(Integer, Symbol)>] [stream_id, kind] for each expired timer
+    def expire_timers(now = nil)
+      expired = @connection.expire_timers(now)
+      expired.uniq(&:first).each do |stream_id, kind|
+        incomplete = kind != :deadline && !@requests.key?(stream_id)
+        close_expired_stream(stream_id, incomplete ? H3_REQUEST_INCOMPLETE : H3_REQUEST_CANCELLED)
+        release_stream(stream_id)
+      end
+      expired
+    end
+
     # Close the server connection
-    # @return [nil]
+    #
+    # Releases all per-connection state at once: the connection's stream
+    # tables and the server's requests, responses and admissions.
+    #
+    # @return [Hash{Symbol => Integer}] streams and bytes released, see Connection#close
     def close
-      @connection.close
+      release_admissions
+      cancel_metrics
+      close_streamed_bodies
+      released = @connection.close
+      @stream_manager.reset
+      release_pooled
+      released
     end
 
     # Check if the connection is closed
@@ -141,112 +354,211 @@ module Nghttp3
       @connection.closed?
     end
 
+    # Reset the server for a new peer connection
+    #
+    # Recycles the underlying connection and clears all per-connection state
+    # so the object can be reused instead of allocating a new Server. The
+    # request handler is kept. Streams must be bound again.
+    #
+    # @return [self]
+    def reset
+      release_admissions
+      cancel_metrics
+      close_streamed_bodies
+      @connection.recycle
+      @stream_manager.reset
+      release_pooled
+      @streams_bound = false
+      self
+    end
+
     private
 
+    # Events are dispatched straight to the private on_* handlers below,
+    # which subclasses may override
     def setup_callbacks
-      Callbacks.new
-        .on_begin_headers { |stream_id| on_begin_headers(stream_id) }
-        .on_recv_header { |stream_id, name, value, flags| on_recv_header(stream_id, name, value, flags) }
-        .on_end_headers { |stream_id, fin| on_end_headers(stream_id, fin) }
-        .on_recv_data { |stream_id, data| on_recv_data(stream_id, data) }
-        .on_end_stream { |stream_id| on_end_stream(stream_id) }
-        .on_stream_close { |stream_id, app_error_code| on_stream_close(stream_id, app_error_code) }
+      Callbacks.dispatch_to(self)
     end
 
     def on_begin_headers(stream_id)
-      # Start building a new request
-      @building_requests[stream_id] = {
-        method: nil,
-        scheme: nil,
-        authority: nil,
-        path: nil,
-        headers: Headers.new,
-        body: nil
-      }
+      if @admission
+        unless @admission.admit
+          # Suppresses the stream's remaining events, including its body
+          @connection.reject_stream(stream_id)
+          return
+        end
+        @admitted_streams[stream_id] = true
+      end
+
       @stream_manager.register_stream(stream_id, type: :bidi)
     end
 
-    def on_recv_header(stream_id, name, value, _flags)
-      req = @building_requests[stream_id]
-      return unless req
+    # Header fields and body data are assembled into the Request in C,
+    # see Connection#assemble_requests=
+    def on_end_headers(stream_id, fin)
+      @responses[stream_id] = @pool ? @pool.acquire_response(stream_id) : Response.new(stream_id: stream_id)
 
-      case name
-      when ":method"
-        req[:method] = value
-      when ":scheme"
-        req[:scheme] = value
-      when ":authority"
-        req[:authority] = value
-      when ":path"
-        req[:path] = value
-      else
-        req[:headers][name] = value
-      end
+      # Without a body the request is complete now
+      receive_request(stream_id) if fin
     end
 
-    def on_end_headers(stream_id, fin)
-      # Headers complete, create immutable Request
-      req_data = @building_requests[stream_id]
-      return unless req_data
-
-      @requests[stream_id] = Request.new(
-        method: req_data[:method] || "GET",
-        scheme: req_data[:scheme] || "https",
-        authority: req_data[:authority],
-        path: req_data[:path] || "/",
-        headers: req_data[:headers]
-      )
-
-      # Create response object
-      @responses[stream_id] = Response.new(stream_id: stream_id)
-
-      # If request has no body (fin=true), process it immediately
-      process_request(stream_id) if fin
-    end
-
-    def on_recv_data(stream_id, data)
-      req_data = @building_requests[stream_id]
-      if req_data
-        req_data[:body] ||= +""
-        req_data[:body] << data
-      end
+    def on_end_stream(stream_id)
+      receive_request(stream_id) unless @requests.key?(stream_id)
     end
 
-    def on_end_stream(stream_id)
-      # Request complete with body
-      req_data = @building_requests.delete(stream_id)
-      if req_data && @requests[stream_id].nil?
-        # Headers weren't finalized yet, create request with body
-        @requests[stream_id] = Request.new(
-          method: req_data[:method] || "GET",
-          scheme: req_data[:scheme] || "https",
-          authority: req_data[:authority],
-          path: req_data[:path] || "/",
-          headers: req_data[:headers],
-          body: req_data[:body]
-        )
-        @responses[stream_id] ||= Response.new(stream_id: stream_id)
-      end
+    def receive_request(stream_id)
+      request = @connection.take_request(stream_id, @pool&.acquire_request)
+      return unless request
 
+      @requests[stream_id] = request
+      @responses[stream_id] ||= @pool ? @pool.acquire_response(stream_id) : Response.new(stream_id: stream_id)
       process_request(stream_id)
     end
 
     def on_stream_close(stream_id, _app_error_code)
-      @building_requests.delete(stream_id)
+      release_admission(stream_id)
+      finish_metrics(stream_id) if @metrics
+      close_streamed_body(stream_id)
+      release_stream(stream_id) if @pool
       @stream_manager.close_stream(stream_id)
     end
 
+    def on_stream_rejected(stream_id, app_error_code)
+      @reject_handler&.call(stream_id, app_error_code)
+    end
+
+    def on_deferred_consume(stream_id, consumed)
+      @flow_credit_handler&.call(stream_id, consumed)
+    end
+
+    def release_stream(stream_id)
+      request = @requests.delete(stream_id)
+      response = @responses.delete(stream_id)
+      return unless @pool
+
+      @pool.release_request(request) if request
+      @pool.release_response(response) if response
+    end
+
+    def release_pooled
+      if @pool
+        @requests.each_value { |request| @pool.release_request(request) }
+        @responses.each_value { |response| @pool.release_response(response) }
+      end
+      @requests.clear
+      @responses.clear
+    end
+
+    def close_expired_stream(stream_id, error_code)
+      @connection.close_stream(stream_id, error_code)
+    rescue StreamNotFoundError
+      @connection.cancel_timer(stream_id)
+      release_admission(stream_id)
+      close_streamed_body(stream_id)
+    ensure
+      @stream_manager.close_stream(stream_id)
+    end
+
+    def release_admission(stream_id)
+      @admission.release if @admitted_streams.delete(stream_id)
+    end
+
+    # A streamed body is closed once its stream is gone, whether or not it
+    # was read to the end, like a Rack server closes response bodies
+    def close_streamed_body(stream_id)
+      @streamed_bodies.delete(stream_id)&.close
+    end
+
+    def close_streamed_bodies
+      bodies = @streamed_bodies.values
+      @streamed_bodies.clear
+      bodies.each(&:close)
+    end
+
+    def metrics_request?(request)
+      path = request.path
+      @metrics_path && (path == @metrics_path || path.start_with?(@metrics_query))
+    end
+
+    def serve_metrics(response)
+      response.status = 200
+      response.headers["content-type"] = METRICS_CONTENT_TYPE
+      response.body = @metrics.to_prometheus
+    end
+
+    def start_metrics(stream_id, label, authority, started)
+      series = @metrics.series(label, authority)
+      @metrics.start(series)
+      @metric_series[stream_id] = series
+      @metric_started[stream_id] = started
+    end
+
+    def finish_metrics(stream_id)
+      series = @metric_series.delete(stream_id)
+      return unless series
+
+      @metrics.finish(series, @responses[stream_id]&.status, now_us - @metric_started.delete(stream_id))
+    end
+
+    def cancel_metrics
+      @metric_series.each_value { |series| @metrics.cancel(series) }
+      @metric_series.clear
+      @metric_started.clear
+    end
+
+    def now_us
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+    end
+
+    def release_admissions
+      @admitted_streams.each_key { @admission.release }
+      @admitted_streams.clear
+    end
+
     def process_request(stream_id)
       request = @requests[stream_id]
       response = @responses[stream_id]
-      return unless request && response && @request_handler
+      return unless request && response && (@request_handler || @router || @metrics)
+
+      if @admission && @received_at
+        now = AdmissionController.now
+        @admission.record_queue_delay(now - @received_at, now)
+      end
+
+      # Match the route first so the request counts as in flight while its
+      # handler runs; on_stream_close or close finishes the series again
+      if @metrics && metrics_request?(request)
+        metrics_endpoint = true
+      elsif @router && (match = @router.match(request.method, request.path, request.authority))
+        handler, label = match[0]
+      else
+        label = @request_handler ? UNROUTED : NOT_FOUND
+      end
+      start_metrics(stream_id, label, request.authority, now_us) if @metrics && label
+
+      # Call the matching route, falling back to the request handler
+      if metrics_endpoint
+        serve_metrics(response)
+      elsif handler
+        handler.call(request, response, match[1])
+      elsif @request_handler
+        @request_handler.call(request, response)
+      else
+        response.status = 404
+      end
 
-      # Call the request handler
-      @request_handler.call(request, response)
+      # Buffered request data has been handed off to the handler
+      @connection.release_memory(stream_id)
 
       # Submit the response if status is set
       if response.status
-        @connection.submit_response(stream_id, response.to_nv_array, body: response.effective_body)
+        @connection.set_stream_write_rate(stream_id, @stream_write_rate) if @stream_write_rate
+        if response.streaming_body?
+          @streamed_bodies[stream_id] = response.body if response.body.respond_to?(:close)
+          @connection.submit_response(stream_id, response.to_nv_array, &BodyReader.new(response.body))
+        else
+          @connection.submit_response(stream_id, response.to_nv_array, body: response.effective_body)
+        end
       end
     end
   end
@@ -19,11 +19,19 @@ module Nghttp3
 
     def initialize(is_server:)
       @is_server = is_server
-      # Next stream IDs by type
-      @next_bidi_stream_id = is_server ? 1 : 0
-      @next_uni_stream_id = is_server ? 3 : 2
       # Track active streams
       @active_streams = {}
+      reset
+    end
+
+    # Forget all streams and restart stream ID allocation
+    # @return [self]
+    def reset
+      # Next stream IDs by type
+      @next_bidi_stream_id = @is_server ? 1 : 0
+      @next_uni_stream_id = @is_server ? 3 : 2
+      @active_streams.clear
+      self
     end
 
     # Allocate a new bidirectional stream ID
@@ -35,6 +43,19 @@ module Nghttp3
       id
     end
 
+    # Allocate consecutive bidirectional stream IDs
+    # @param count [Integer] number of stream IDs
+    # @return [Array<Integer>] new stream IDs, in ascending order
+    def allocate_bidi_stream_ids(count)
+      first = @next_bidi_stream_id
+      @next_bidi_stream_id += 4 * count
+      Array.new(count) do |i|
+        id = first + 4 * i
+        @active_streams[id] = {type: :bidi, state: :open}
+        id
+      end
+    end
+
     # Allocate a new unidirectional stream ID
     # @return [Integer] new stream ID
     def allocate_uni_stream_id
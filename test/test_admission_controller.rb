@@ -0,0 +1,78 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestAdmissionController < Minitest::Test
+  def test_admits_everything_without_policies
+    admission = Nghttp3::AdmissionController.new
+    100.times { assert admission.admit }
+    assert_equal 100, admission.in_flight
+    assert_equal 0, admission.shed
+  end
+
+  def test_concurrency_limit_sheds_until_released
+    admission = Nghttp3::AdmissionController.new(max_concurrency: 2)
+    assert admission.admit
+    assert admission.admit
+    refute admission.admit
+    assert_equal 1, admission.shed_concurrency
+
+    admission.release
+    assert admission.admit
+    assert_equal 2, admission.in_flight
+  end
+
+  def test_release_does_not_go_negative
+    admission = Nghttp3::AdmissionController.new
+    admission.release
+    assert_equal 0, admission.in_flight
+  end
+
+  def test_latency_target_sheds_after_standing_queue
+    admission = Nghttp3::AdmissionController.new(latency_target: 5, latency_interval: 100)
+    assert admission.admit(0)
+
+    # A burst with one fast request does not trip the target
+    admission.record_queue_delay(50, 10)
+    admission.record_queue_delay(1, 20)
+    assert admission.admit(100)
+    refute admission.overloaded?
+
+    # Every request in the interval waited too long
+    admission.record_queue_delay(20, 150)
+    admission.record_queue_delay(30, 190)
+    refute admission.admit(200)
+    assert admission.overloaded?
+    assert_equal 1, admission.shed_latency
+  end
+
+  def test_latency_shedding_stops_after_quiet_interval
+    admission = Nghttp3::AdmissionController.new(latency_target: 5, latency_interval: 100)
+    admission.admit(0)
+    admission.record_queue_delay(20, 50)
+    refute admission.admit(100)
+
+    # No samples during the next interval: nothing is queued any more
+    assert admission.admit(200)
+    refute admission.overloaded?
+  end
+
+  def test_stats_and_reset_stats
+    admission = Nghttp3::AdmissionController.new(max_concurrency: 1)
+    admission.admit
+    admission.admit
+    stats = admission.stats
+    assert_equal 1, stats[:in_flight]
+    assert_equal 1, stats[:admitted]
+    assert_equal 1, stats[:shed_concurrency]
+
+    admission.reset_stats
+    assert_equal 0, admission.stats[:admitted]
+    assert_equal 1, admission.stats[:in_flight]
+  end
+
+  def test_rejects_invalid_options
+    assert_raises(ArgumentError) { Nghttp3::AdmissionController.new(max_concurrency: 0) }
+    assert_raises(ArgumentError) { Nghttp3::AdmissionController.new(latency_interval: 0) }
+  end
+end
@@ -0,0 +1,62 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "stringio"
+
+class TestBodyReader < Minitest::Test
+  def test_reads_io_in_chunks
+    reader = Nghttp3::BodyReader.new(StringIO.new("abcdefg"), chunk_size: 3)
+    assert_equal "abc", reader.call
+    assert_equal "def", reader.call
+    assert_equal "g", reader.call
+    assert_nil reader.call
+    refute reader.waiting?
+  end
+
+  def test_reads_enumerable_skipping_empty_chunks
+    reader = Nghttp3::BodyReader.new(["ab", "", "cd"])
+    assert_equal "ab", reader.call
+    assert_equal "cd", reader.call
+    assert_nil reader.call
+  end
+
+  def test_reads_source_whose_each_only_yields
+    source = Object.new
+    def source.each
+      yield "ab"
+      yield "cd"
+    end
+    reader = Nghttp3::BodyReader.new(source)
+    assert_equal "ab", reader.call
+    assert_equal "cd", reader.call
+    assert_nil reader.call
+  end
+
+  def test_wouldblock_when_io_not_ready
+    r, w = IO.pipe
+    reader = Nghttp3::BodyReader.new(r)
+    assert_equal :wouldblock, reader.call
+    assert reader.waiting?
+
+    w.write("data")
+    w.close
+    assert_equal "data", reader.call
+    refute reader.waiting?
+    assert_nil reader.call
+  ensure
+    r&.close
+    w&.close
+  end
+
+  def test_streamable
+    assert Nghttp3::BodyReader.streamable?(StringIO.new("x"))
+    assert Nghttp3::BodyReader.streamable?(["x"])
+    refute Nghttp3::BodyReader.streamable?("x")
+    refute Nghttp3::BodyReader.streamable?(nil)
+  end
+
+  def test_to_proc
+    reader = Nghttp3::BodyReader.new(["x"])
+    assert_equal "x", reader.to_proc.call(0)
+  end
+end
@@ -33,6 +33,12 @@ class TestNghttp3Callbacks < Minitest::Test
     assert_same callbacks, result
   end
 
+  def test_on_stream_rejected_accepts_block_and_returns_self
+    callbacks = Nghttp3::Callbacks.new
+    result = callbacks.on_stream_rejected { |stream_id, app_error_code| }
+    assert_same callbacks, result
+  end
+
   def test_on_begin_headers_accepts_block_and_returns_self
     callbacks = Nghttp3::Callbacks.new
     result = callbacks.on_begin_headers { |stream_id| }
@@ -157,4 +163,17 @@ class TestNghttp3Callbacks < Minitest::Test
   ensure
     conn&.close
   end
+
+  def test_dispatch_to_sets_handler
+    handler = Object.new
+    callbacks = Nghttp3::Callbacks.dispatch_to(handler)
+    assert_kind_of Nghttp3::Callbacks, callbacks
+    assert_same handler, callbacks.handler
+    assert_nil Nghttp3::Callbacks.new.handler
+
+    conn = Nghttp3::Connection.server_new(Nghttp3::Settings.default, callbacks)
+    assert_kind_of Nghttp3::Connection, conn
+  ensure
+    conn&.close
+  end
 end
@@ -73,6 +73,57 @@ class TestClient < Minitest::Test
     assert_equal stream_id, response.stream_id
   end
 
+  def test_submit_all_allocates_consecutive_stream_ids
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.submit(Nghttp3::Request.get("https://example.com/first"))
+
+    requests = [
+      Nghttp3::Request.get("https://example.com/a", headers: {"accept" => "*/*"}),
+      Nghttp3::Request.post("https://example.com/b", body: "data"),
+      Nghttp3::Request.put("https://example.com/c", body: StringIO.new("io"))
+    ]
+    stream_ids = client.submit_all(requests)
+
+    assert_equal [4, 8, 12], stream_ids
+    stream_ids.zip(requests).each do |stream_id, request|
+      assert_same request, client.pending_requests[stream_id]
+      assert_equal stream_id, client.responses[stream_id].stream_id
+    end
+    assert_equal 16, client.submit(Nghttp3::Request.get("https://example.com/last"))
+  end
+
+  def test_submit_drops_a_request_that_failed_to_submit
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.connection.define_singleton_method(:submit_request) do |*|
+      raise Nghttp3::StreamInUseError, "Failed to submit request"
+    end
+
+    assert_raises(Nghttp3::StreamInUseError) do
+      client.submit(Nghttp3::Request.post("https://example.com/", body: StringIO.new("io")))
+    end
+    assert_empty client.pending_requests
+    assert_empty client.responses
+  end
+
+  def test_submit_all_with_no_requests
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    assert_equal [], client.submit_all([])
+  end
+
+  def test_submit_all_drops_requests_that_were_not_submitted
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    assert_raises(Nghttp3::InvalidStateError) { Nghttp3::Client.new.submit_all([]) }
+    assert_raises(TypeError) do
+      client.submit_all([Nghttp3::Request.get("https://example.com/"), "not a request"])
+    end
+    assert_empty client.pending_requests
+    assert_empty client.responses
+  end
+
   def test_get_convenience_method
     client = Nghttp3::Client.new
     client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
@@ -152,6 +203,29 @@ class TestClient < Minitest::Test
     assert client.closed?
   end
 
+  def test_close_releases_requests_and_responses
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.post("https://example.com/", body: "hello")
+    released = client.close
+    assert_equal 1, released[:streams]
+    assert client.responses.empty?
+    assert client.pending_requests.empty?
+  end
+
+  def test_post_with_io_body_streams
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    r, w = IO.pipe
+    stream_id = client.post("https://example.com/upload", body: r)
+    assert_same r, client.pending_requests[stream_id].body
+    assert_empty client.waiting_bodies
+    assert_empty client.resume_bodies
+  ensure
+    r&.close
+    w&.close
+  end
+
   def test_responses_hash_is_accessible
     client = Nghttp3::Client.new
     assert_kind_of Hash, client.responses
@@ -161,4 +235,157 @@ class TestClient < Minitest::Test
     client = Nghttp3::Client.new
     assert_kind_of Hash, client.pending_requests
   end
+
+  def test_reset_restarts_stream_ids
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.get("https://example.com/")
+    client.close
+    client.reset
+    assert client.responses.empty?
+    assert client.pending_requests.empty?
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    assert_equal 0, client.get("https://example.com/")
+  end
+
+  def test_pump_packets_returns_self
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    client.get("https://example.com/")
+    result = client.pump_packets(max_payload: 1200) do |data, slices|
+      assert_operator data.bytesize, :<=, 1200
+      refute_empty slices
+    end
+    assert_same client, result
+  end
+
+  def test_latency_stats_per_authority
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    stream_id = client.post("https://example.com/upload", body: "abcd")
+    client.get("https://other.example/")
+    client.send(:on_end_headers, stream_id, false)
+    client.send(:on_recv_data, stream_id, "hello")
+    client.send(:on_end_stream, stream_id)
+
+    stats = client.latency_stats
+    assert_equal ["example.com"], stats.keys
+    assert_equal 1, stats["example.com"][:duration][:count]
+    assert_equal 9, stats["example.com"][:bytes][:max]
+    assert_operator stats["example.com"][:time_to_first_byte][:p50], :<=, stats["example.com"][:duration][:p99]
+
+    client.latency_stats(reset: true)
+    assert_empty client.latency_stats
+  end
+
+  def test_latency_tracking_can_be_disabled
+    client = Nghttp3::Client.new(track_latency: false)
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    stream_id = client.get("https://example.com/")
+    client.send(:on_end_stream, stream_id)
+    assert_empty client.latency_stats
+  end
+
+  def test_request_callbacks_are_called_as_the_response_arrives
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    events = []
+    stream_id = client.get("https://example.com/",
+      on_headers: ->(response) { events << [:headers, response.status] },
+      on_data: ->(_response, data) { events << [:data, data] }) do |response, error|
+      events << [:complete, response.stream_id, error]
+    end
+
+    client.send(:on_begin_headers, stream_id)
+    client.send(:on_recv_header, stream_id, ":status", "200", 0)
+    client.send(:on_end_headers, stream_id, false)
+    client.send(:on_recv_data, stream_id, "chunk")
+    assert_equal "", client.responses[stream_id].body.to_s
+    client.send(:on_end_stream, stream_id)
+    client.send(:on_stream_close, stream_id, Nghttp3::H3_NO_ERROR)
+
+    assert_equal [[:headers, 200], [:data, "chunk"], [:complete, stream_id, nil]], events
+    refute client.responses.key?(stream_id)
+  end
+
+  def test_deferred_credit_reaches_the_flow_credit_handler
+    client = Nghttp3::Client.new(memory_budget: 4096)
+    credit = []
+    assert_same client, client.on_flow_credit { |stream_id, bytes| credit << [stream_id, bytes] }
+
+    client.send(:on_deferred_consume, 0, 1200)
+    assert_equal [[0, 1200]], credit
+  end
+
+  def test_body_handed_to_on_data_is_released_from_the_budget
+    client = Nghttp3::Client.new(memory_budget: 4096)
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    stream_id = client.get("https://example.com/", on_data: ->(_response, _data) {})
+    released = []
+    client.connection.define_singleton_method(:release_memory) do |id, bytes = nil|
+      released << [id, bytes]
+      0
+    end
+
+    client.send(:on_recv_data, stream_id, "chunk")
+    assert_equal [[stream_id, 5]], released
+  end
+
+  def test_interim_responses_are_skipped
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    statuses = []
+    stream_id = client.get("https://example.com/", on_headers: ->(response) { statuses << response.status })
+
+    client.send(:on_begin_headers, stream_id)
+    client.send(:on_recv_header, stream_id, ":status", "103", 0)
+    client.send(:on_recv_header, stream_id, "link", "</style.css>; rel=preload", 0)
+    client.send(:on_end_headers, stream_id, false)
+    assert_empty statuses
+
+    client.send(:on_begin_headers, stream_id)
+    client.send(:on_recv_header, stream_id, ":status", "200", 0)
+    client.send(:on_end_headers, stream_id, false)
+    assert_equal [200], statuses
+    refute client.responses[stream_id].headers.key?("link")
+  end
+
+  def test_on_complete_reports_aborted_requests
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    errors = {}
+    on_complete = ->(response, error) { errors[response.stream_id] = error }
+    reset, pending = client.submit_all(
+      [Nghttp3::Request.get("https://example.com/a"), Nghttp3::Request.get("https://example.com/b")],
+      on_complete: on_complete
+    )
+
+    client.send(:on_stream_close, reset, Nghttp3::H3_REQUEST_CANCELLED)
+    client.close
+
+    assert_equal [:closed, Nghttp3::H3_REQUEST_CANCELLED], [errors[reset].reason, errors[reset].error_code]
+    assert_kind_of Nghttp3::RequestAbortedError, errors[pending]
+    assert_equal :connection_closed, errors[pending].reason
+    assert_equal pending, errors[pending].stream_id
+  end
+
+  def test_on_complete_reports_expired_timers_as_timeouts
+    client = Nghttp3::Client.new
+    client.bind_streams(control: 2, qpack_encoder: 6, qpack_decoder: 10)
+    errors = []
+    stream_id = client.get("https://example.com/") { |_response, error| errors << error }
+
+    # nghttp3 reports the close from inside close_stream
+    connection = client.connection
+    connection.define_singleton_method(:expire_timers) { |_now| [[stream_id, :header]] }
+    connection.define_singleton_method(:close_stream) do |id, code|
+      client.send(:on_stream_close, id, code)
+      self
+    end
+    client.expire_timers
+
+    assert_equal 1, errors.size
+    assert_equal :timeout, errors[0].reason
+    assert_equal Nghttp3::H3_REQUEST_CANCELLED, errors[0].error_code
+  end
 end
@@ -326,6 +326,50 @@ class TestNghttp3Connection < Minitest::Test
     end
   end
 
+  def test_submit_requests_reads_requests_directly
+    conn = Nghttp3::Connection.client_new
+    conn.bind_control_stream(2)
+    conn.bind_qpack_streams(6, 10)
+    requests = [
+      Nghttp3::Request.get("https://example.com/", headers: {"accept" => "*/*"}),
+      Nghttp3::Request.post("https://example.com/upload", body: "data"),
+      Nghttp3::Request.post("https://example.com/stream", body: ["a", "b"])
+    ]
+
+    yielded = []
+    result = conn.submit_requests(0, requests) do |stream_id, request|
+      yielded << [stream_id, request]
+      proc {} if request.streaming_body?
+    end
+
+    assert_same conn, result
+    assert_equal [0, 4, 8], yielded.map(&:first)
+    assert_equal requests, yielded.map(&:last)
+  ensure
+    conn&.close
+  end
+
+  def test_submit_requests_validates_the_batch
+    conn = Nghttp3::Connection.client_new
+    conn.bind_control_stream(2)
+    conn.bind_qpack_streams(6, 10)
+
+    assert_raises(TypeError) { conn.submit_requests(0, [Nghttp3::Request.get("https://example.com/"), :get]) }
+    assert_raises(ArgumentError) do
+      conn.submit_requests(0, [Nghttp3::Request.post("https://example.com/", body: ["a"])])
+    end
+    assert_raises(Nghttp3::InvalidStateError) { Nghttp3::Connection.server_new.submit_requests(0, []) }
+
+    # A field of the wrong type surfaces once its stream state is set up;
+    # the state is dropped again, so the stream can still be submitted
+    bad = Nghttp3::Request.get("https://example.com/")
+    bad.headers.instance_variable_get(:@headers)["x-count"] = 1
+    assert_raises(TypeError) { conn.submit_requests(0, [bad]) { proc {} } }
+    assert_same conn, conn.submit_requests(0, [Nghttp3::Request.get("https://example.com/")])
+  ensure
+    conn&.close
+  end
+
   def test_submit_response_raises_on_client_connection
     conn = Nghttp3::Connection.client_new
     headers = [Nghttp3::NV.new(":status", "200")]
@@ -406,6 +450,30 @@ class TestNghttp3Connection < Minitest::Test
     end
   end
 
+  def test_close_reports_released_streams
+    conn = Nghttp3::Connection.client_new
+    3.times { |i| conn.set_stream_user_data(i * 4, "data") }
+    assert_equal({streams: 3, bytes: 0}, conn.close)
+    assert_equal({streams: 0, bytes: 0}, conn.close)
+  end
+
+  def test_close_reports_held_body_bytes_without_a_budget
+    conn = Nghttp3::Connection.client_new
+    conn.bind_control_stream(2)
+    conn.bind_qpack_streams(6, 10)
+    headers = [
+      Nghttp3::NV.new(":method", "POST"),
+      Nghttp3::NV.new(":path", "/"),
+      Nghttp3::NV.new(":scheme", "https"),
+      Nghttp3::NV.new(":authority", "example.com")
+    ]
+    conn.submit_request(0, headers, body: "test body")
+    conn.submit_request(4, headers, body: "more")
+
+    assert_equal 0, conn.memory_used
+    assert_equal({streams: 2, bytes: 13}, conn.close)
+  end
+
   def test_set_and_get_stream_user_data
     conn = Nghttp3::Connection.client_new
     data = {id: 123, name: "test"}
@@ -419,6 +487,16 @@ class TestNghttp3Connection < Minitest::Test
     conn&.close
   end
 
+  def test_stream_user_data_for_many_streams_survives_gc
+    conn = Nghttp3::Connection.client_new
+    100.times { |i| conn.set_stream_user_data(i * 4, "stream-#{i}") }
+    GC.start
+    100.times { |i| assert_equal "stream-#{i}", conn.get_stream_user_data(i * 4) }
+    assert_nil conn.get_stream_user_data(400)
+  ensure
+    conn&.close
+  end
+
   def test_get_stream_user_data_returns_nil_for_unknown_stream
     conn = Nghttp3::Connection.client_new
     result = conn.get_stream_user_data(999)
@@ -439,4 +517,301 @@ class TestNghttp3Connection < Minitest::Test
       conn.get_stream_user_data(0)
     end
   end
+
+  # Memory budget tests
+
+  def test_memory_budget_defaults_to_unlimited
+    conn = Nghttp3::Connection.server_new
+    assert_equal 0, conn.memory_budget
+    assert_equal 0, conn.memory_used
+    refute conn.over_memory_budget?
+  ensure
+    conn&.close
+  end
+
+  def test_memory_budget_can_be_set
+    conn = Nghttp3::Connection.server_new
+    conn.memory_budget = 64 * 1024
+    assert_equal 64 * 1024, conn.memory_budget
+  ensure
+    conn&.close
+  end
+
+  def test_release_memory_for_unknown_stream_returns_zero
+    conn = Nghttp3::Connection.server_new
+    assert_equal 0, conn.release_memory(0)
+    assert_equal 0, conn.release_memory(0, 100)
+  ensure
+    conn&.close
+  end
+
+  def test_process_memory_budget
+    original = Nghttp3::Connection.process_memory_budget
+    Nghttp3::Connection.process_memory_budget = 1024 * 1024
+    assert_equal 1024 * 1024, Nghttp3::Connection.process_memory_budget
+    assert_kind_of Integer, Nghttp3::Connection.process_memory_used
+  ensure
+    Nghttp3::Connection.process_memory_budget = original
+  end
+
+  def test_recycle_reopens_closed_connection
+    conn = Nghttp3::Connection.server_new
+    conn.set_stream_user_data(0, "data")
+    conn.close
+    result = conn.recycle
+    assert_same conn, result
+    refute conn.closed?
+    assert conn.server?
+    assert_nil conn.get_stream_user_data(0)
+  ensure
+    conn&.close
+  end
+
+  def test_recycle_keeps_memory_budget
+    conn = Nghttp3::Connection.client_new
+    conn.memory_budget = 4096
+    conn.recycle
+    assert_equal 4096, conn.memory_budget
+    assert_equal 0, conn.memory_used
+    assert conn.client?
+  ensure
+    conn&.close
+  end
+
+  def test_take_request_builds_assembled_request
+    conn = Nghttp3::Connection.server_new
+    conn.assemble_requests = true
+    assert conn.assemble_requests?
+    assert_nil conn.take_request(0)
+
+    conn.assemble_header(0, ":method", "post")
+    conn.assemble_header(0, ":path", "/upload")
+    conn.assemble_header(0, ":authority", "example.com")
+    conn.assemble_header(0, "Accept", "text/html")
+    conn.assemble_header(0, "accept", "text/plain")
+    conn.assemble_header(0, "cookie", "a=1")
+    conn.assemble_header(0, "cookie", "b=2")
+    conn.assemble_data(0, "hello ")
+    conn.assemble_data(0, "world")
+
+    request = conn.take_request(0)
+    assert_kind_of Nghttp3::Request, request
+    assert request.frozen?
+    assert_equal "POST", request.method
+    assert_equal "https", request.scheme
+    assert_equal "example.com", request.authority
+    assert_equal "/upload", request.path
+    assert_equal "text/html, text/plain", request.headers["accept"]
+    assert_equal "a=1; b=2", request.headers["cookie"]
+    assert request.headers["accept"].frozen?
+    assert request.headers["cookie"].frozen?
+    assert_equal "hello world", request.body
+    assert request.body.frozen?
+    assert_nil conn.take_request(0)
+  ensure
+    conn&.close
+  end
+
+  def test_assemble_requests_requires_server
+    conn = Nghttp3::Connection.client_new
+    refute conn.assemble_requests?
+    assert_raises(Nghttp3::InvalidStateError) { conn.assemble_requests = true }
+  ensure
+    conn&.close
+  end
+
+  def test_writev_packets_batches_pending_data
+    conn = Nghttp3::Connection.client_new
+    conn.bind_control_stream(2)
+    conn.bind_qpack_streams(6, 10)
+    packets = conn.writev_packets(1200)
+    assert_kind_of Array, packets
+    packets.each do |packet|
+      assert_operator packet[:data].bytesize, :<=, 1200
+      packet[:slices].each do |stream_id, offset, length, fin|
+        assert_kind_of Integer, stream_id
+        assert_operator offset + length, :<=, packet[:data].bytesize
+        assert_includes [true, false], fin
+      end
+    end
+    assert_empty conn.writev_packets(1200)
+  ensure
+    conn&.close
+  end
+
+  def test_writev_packets_raises_on_closed_connection
+    conn = Nghttp3::Connection.client_new
+    conn.close
+    assert_raises(Nghttp3::InvalidStateError) do
+      conn.writev_packets
+    end
+  end
+
+  def test_stream_timeouts_default_to_disabled
+    conn = Nghttp3::Connection.server_new
+    assert_equal({header: 0, idle: 0, deadline: 0}, conn.stream_timeouts)
+
+    conn.stream_timeouts = {header: 5_000, deadline: 60_000}
+    assert_equal({header: 5_000, idle: 0, deadline: 60_000}, conn.stream_timeouts)
+  ensure
+    conn&.close
+  end
+
+  def test_expire_timers_returns_fired_timers_in_order
+    conn = Nghttp3::Connection.server_new
+    now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+
+    conn.arm_timer(0, :deadline, 300_000, now)
+    conn.arm_timer(4, :header, 10, now)
+    conn.arm_timer(8, :idle, 5_000, now)
+    assert_equal 3, conn.timer_count
+    assert_operator conn.next_timer_expiry, :<=, now + 10
+
+    assert_equal [[4, :header]], conn.expire_timers(now + 10)
+    assert_equal [[8, :idle]], conn.expire_timers(now + 5_000)
+    assert_equal [], conn.expire_timers(now + 299_999)
+    assert_equal [[0, :deadline]], conn.expire_timers(now + 300_000)
+    assert_equal 0, conn.timer_count
+    assert_nil conn.next_timer_expiry
+  ensure
+    conn&.close
+  end
+
+  def test_arm_timer_rearms_and_cancel_timer_disarms
+    conn = Nghttp3::Connection.server_new
+    now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+
+    conn.arm_timer(0, :idle, 100, now)
+    conn.arm_timer(0, :idle, 200, now)
+    conn.arm_timer(4, :header, 100, now)
+    conn.cancel_timer(4, :header)
+    assert_equal 1, conn.timer_count
+
+    assert_equal [], conn.expire_timers(now + 150)
+    assert_equal [[0, :idle]], conn.expire_timers(now + 200)
+
+    conn.arm_timer(8, :header, 100, now)
+    conn.arm_timer(8, :deadline, 100, now)
+    conn.cancel_timer(8)
+    assert_equal 0, conn.timer_count
+    assert_raises(ArgumentError) { conn.arm_timer(0, :bogus, 100) }
+  ensure
+    conn&.close
+  end
+
+  def test_write_rate_defaults_to_unlimited
+    conn = Nghttp3::Connection.server_new
+    assert_nil conn.write_tokens
+    assert_nil conn.write_tokens(0)
+    assert_nil conn.next_write_time
+  ensure
+    conn&.close
+  end
+
+  def test_write_rate_accounts_written_bytes
+    conn = Nghttp3::Connection.server_new
+    conn.set_write_rate(1_000, 4_000)
+    assert_equal 4_000, conn.write_tokens
+    assert_nil conn.next_write_time
+
+    conn.add_write_offset(0, 4_500)
+    assert_equal 0, conn.write_tokens
+    assert_nil conn.writev_stream
+    now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+    # 500 bytes of debt plus one byte at 1000 bytes per second
+    assert_in_delta now + 501, conn.next_write_time, 20
+
+    conn.set_write_rate(nil)
+    assert_nil conn.write_tokens
+  ensure
+    conn&.close
+  end
+
+  def test_stream_write_rate
+    conn = Nghttp3::Connection.server_new
+    conn.set_stream_write_rate(0, 10_000, 1_500)
+    assert_equal 1_500, conn.write_tokens(0)
+    conn.add_write_offset(0, 1_000)
+    assert_equal 500, conn.write_tokens(0)
+
+    conn.set_stream_write_rate(0, nil)
+    assert_nil conn.write_tokens(0)
+    assert_raises(ArgumentError) { conn.set_stream_write_rate(0, 1_000, 0) }
+  ensure
+    conn&.close
+  end
+
+  def test_abuse_limits
+    conn = Nghttp3::Connection.server_new
+    assert_equal({opens: 0, resets: 0, stop_sending: 0, cancels: 0, window: 1000}, conn.abuse_limits)
+
+    conn.abuse_limits = {opens: 500, resets: 50, window: 10_000}
+    assert_equal({opens: 500, resets: 50, stop_sending: 0, cancels: 0, window: 10_000}, conn.abuse_limits)
+    assert_equal({opens: 0, resets: 0, stop_sending: 0, cancels: 0}, conn.abuse_counters)
+    assert_nil conn.abuse_reason
+    assert_raises(ArgumentError) { conn.abuse_limits = {window: 0} }
+  ensure
+    conn&.close
+  end
+
+  def test_excessive_load_error_is_fatal
+    assert_operator Nghttp3::ExcessiveLoadError, :<, Nghttp3::FatalError
+  end
+
+  def test_nonblock_variants_return_symbol_on_closed_connection
+    conn = Nghttp3::Connection.client_new
+    conn.close
+    assert_equal :invalid_state, conn.read_stream_nonblock(0, "test")
+    assert_equal :invalid_state, conn.add_write_offset_nonblock(0, 10)
+    assert_equal :invalid_state, conn.add_ack_offset_nonblock(0, 10)
+    assert_equal :invalid_state, conn.unblock_stream_nonblock(0)
+    assert_equal :invalid_state, conn.close_stream_nonblock(0, Nghttp3::H3_NO_ERROR)
+    assert_equal :invalid_state, conn.resume_stream_nonblock(0)
+  end
+
+  def test_nonblock_variants_return_nil_on_success
+    conn = Nghttp3::Connection.client_new
+    assert_nil conn.unblock_stream_nonblock(0)
+    refute conn.closed?
+  ensure
+    conn&.close
+  end
+
+  def test_old_connection_keeps_young_values_across_minor_gc
+    require "objspace"
+    conn = Nghttp3::Connection.server_new
+    assert_match(/"wb_protected":true/, ObjectSpace.dump(conn))
+    conn.assemble_requests = true
+    4.times { GC.start }
+
+    conn.assemble_header(0, ":method", "GET")
+    conn.assemble_header(0, ":path", "/young")
+    conn.assemble_data(0, "body")
+    GC.start(full_mark: false)
+
+    request = conn.take_request(0)
+    assert_equal "/young", request.path
+    assert_equal "body", request.body
+  ensure
+    conn&.close
+  end
+
+  def test_stream_state_survives_compaction
+    skip "GC.compact unsupported" unless GC.respond_to?(:verify_compaction_references)
+    conn = Nghttp3::Connection.server_new
+    conn.assemble_requests = true
+    conn.assemble_header(0, ":method", "GET")
+    conn.assemble_header(0, ":path", "/moved")
+    conn.assemble_header(0, "x-trace", "abc")
+    conn.assemble_data(0, "body")
+
+    GC.verify_compaction_references(expand_heap: true, toward: :empty)
+
+    request = conn.take_request(0)
+    assert_equal "/moved", request.path
+    assert_equal "abc", request.headers["x-trace"]
+    assert_equal "body", request.body
+  ensure
+    conn&.close
+  end
 end
@@ -0,0 +1,56 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestLatencyHistogram < Minitest::Test
+  def test_empty_histogram
+    histogram = Nghttp3::LatencyHistogram.new
+    assert_equal 0, histogram.count
+    assert_nil histogram.min
+    assert_equal 0, histogram.percentile(99)
+    assert_in_delta 0.0, histogram.mean
+  end
+
+  def test_percentiles_within_precision
+    histogram = Nghttp3::LatencyHistogram.new
+    (1..10_000).each { |v| histogram.record(v) }
+    assert_equal 10_000, histogram.count
+    assert_equal 1, histogram.min
+    assert_equal 10_000, histogram.max
+    assert_in_delta 5000.5, histogram.mean
+    assert_in_delta 5000, histogram.percentile(50), 5000 / 32
+    assert_in_delta 9900, histogram.percentile(99), 9900 / 32
+    assert_equal 10_000, histogram.percentile(100)
+  end
+
+  def test_small_values_are_exact
+    histogram = Nghttp3::LatencyHistogram.new
+    [3, 7, 7, 20].each { |v| histogram.record(v) }
+    assert_equal 7, histogram.percentile(50)
+    assert_equal 20, histogram.percentile(99)
+  end
+
+  def test_merge_and_reset
+    a = Nghttp3::LatencyHistogram.new
+    b = Nghttp3::LatencyHistogram.new
+    a.record(10)
+    b.record(1000)
+    a.merge!(b)
+    assert_equal 2, a.count
+    assert_equal 1000, a.max
+    assert_same a, a.reset
+    assert_equal 0, a.count
+  end
+
+  def test_summary_scales_values
+    histogram = Nghttp3::LatencyHistogram.new
+    histogram.record(2000)
+    summary = histogram.summary(1000.0)
+    assert_equal 1, summary[:count]
+    assert_in_delta 2.0, summary[:p50]
+  end
+
+  def test_rejects_invalid_precision
+    assert_raises(ArgumentError) { Nghttp3::LatencyHistogram.new(precision: 0) }
+  end
+end
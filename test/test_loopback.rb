@@ -0,0 +1,189 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestLoopback < Minitest::Test
+  def test_binds_both_ends
+    loopback = Nghttp3::Loopback.new
+    assert loopback.client.streams_bound?
+    assert loopback.server.streams_bound?
+    assert_equal 0, loopback.client_bytes
+    assert_equal 0, loopback.server_bytes
+  end
+
+  def test_pump_delivers_request_and_response
+    server = Nghttp3::Server.new
+    server.on_request do |_request, response|
+      response.status = 200
+      response.body = "hello"
+    end
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    stream_id = loopback.client.get("https://localhost/")
+
+    assert_same loopback, loopback.pump
+    assert_operator loopback.client_bytes, :>, 0
+    response = loopback.client.responses[stream_id]
+    assert_equal 200, response&.status
+    assert_equal "hello", response&.effective_body
+  end
+
+  def test_stamps_server_reads_with_received_at
+    admission = Nghttp3::AdmissionController.new(latency_target: 5)
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, Nghttp3::Server.new(admission: admission))
+    loopback.client.define_singleton_method(:pump_writes) do |&block|
+      @sent ||= block.call(0, "x", false)
+      self
+    end
+    stamps = []
+    loopback.server.define_singleton_method(:read_stream) do |_stream_id, data, fin: false, received_at: nil|
+      stamps << received_at
+      data.bytesize
+    end
+
+    loopback.pump
+    assert_equal 1, stamps.size
+    assert_kind_of Float, stamps.first
+  end
+
+  def test_body_within_the_budget_is_fully_credited
+    server = Nghttp3::Server.new(memory_budget: 16_384)
+    server.on_request do |request, response|
+      response.status = 200
+      response.body = request.body
+    end
+    delivered, credited = count_credit(server)
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    stream_id = loopback.client.post("https://localhost/", body: "x" * 8192)
+
+    loopback.pump
+    assert_equal 8192, loopback.client.responses[stream_id]&.effective_body&.bytesize
+    assert_equal delivered[stream_id], credited[stream_id]
+    assert_equal 0, server.connection.memory_used
+  end
+
+  def test_body_larger_than_the_budget_is_rejected_and_credited
+    server = Nghttp3::Server.new(memory_budget: 4096)
+    handled = false
+    server.on_request { |_request, _response| handled = true }
+    rejected = []
+    server.on_reject { |stream_id, error_code| rejected << [stream_id, error_code] }
+    delivered, credited = count_credit(server)
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    stream_id = loopback.client.post("https://localhost/", body: "x" * 65_536)
+
+    loopback.pump
+    refute handled
+    assert_equal [[stream_id, Nghttp3::H3_REQUEST_REJECTED]], rejected
+    assert_operator delivered[stream_id], :>, 65_536
+    assert_equal delivered[stream_id], credited[stream_id]
+    assert_equal 0, server.connection.memory_used
+  end
+
+  def test_producer_paused_by_the_budget_resumes_as_acks_drain
+    server = Nghttp3::Server.new(memory_budget: 4096)
+    server.on_request do |_request, response|
+      response.status = 200
+      response.body = Array.new(8) { "y" * 3000 }
+    end
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    stream_id = loopback.client.get("https://localhost/")
+
+    loopback.pump
+    response = loopback.client.responses[stream_id]
+    assert response&.finished?
+    assert_equal "y" * 24_000, response.effective_body
+    assert_equal 0, server.connection.memory_used
+  end
+
+  def test_write_rate_shapes_pump_writes
+    server = Nghttp3::Server.new
+    server.on_request do |_request, response|
+      response.status = 200
+      response.body = "z" * 24_000
+    end
+    server.connection.set_write_rate(200_000, 4096)
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    stream_id = loopback.client.get("https://localhost/")
+
+    elapsed = until_finished(loopback.client, stream_id, server) { loopback.pump }
+    assert_equal "z" * 24_000, loopback.client.responses[stream_id].effective_body
+    # 20KB beyond the burst at 200KB/s
+    assert_operator elapsed, :>=, 0.08
+  end
+
+  def test_write_rate_shapes_pump_packets
+    server = Nghttp3::Server.new
+    server.on_request do |_request, response|
+      response.status = 200
+      response.body = "z" * 24_000
+    end
+    server.connection.set_write_rate(200_000, 4096)
+    client = Nghttp3::Client.new
+    loopback = Nghttp3::Loopback.new(client, server)
+    stream_id = client.get("https://localhost/")
+    packets = []
+
+    elapsed = until_finished(client, stream_id, server) do
+      loopback.flush_client
+      packets.clear
+      server.pump_packets(max_payload: 1200) { |data, slices| packets << [data, slices] }
+      packets.each do |data, slices|
+        assert_operator data.bytesize, :<=, 1200
+        slices.each do |id, offset, length, fin|
+          client.read_stream(id, data.byteslice(offset, length), fin: fin)
+          server.add_ack_offset(id, length) if length > 0
+        end
+      end
+    end
+    assert_equal "z" * 24_000, client.responses[stream_id].effective_body
+    assert_operator elapsed, :>=, 0.08
+  end
+
+  def test_rapid_stream_opens_trip_the_abuse_limit
+    server = Nghttp3::Server.new(abuse_limits: {opens: 5, window: 10_000})
+    handled = 0
+    server.on_request do |_request, response|
+      handled += 1
+      response.status = 204
+    end
+    loopback = Nghttp3::Loopback.new(Nghttp3::Client.new, server)
+    20.times { |i| loopback.client.get("https://localhost/#{i}") }
+
+    assert_raises(Nghttp3::ExcessiveLoadError) { loopback.pump }
+    assert server.closed?
+    assert_equal :opens, server.connection.abuse_reason
+    assert_operator handled, :<=, 5
+  end
+
+  private
+
+  # Counts the bytes delivered to the server per stream and those credited
+  # back to the peer, through read_stream's return value or on_flow_credit
+  def count_credit(server)
+    delivered = Hash.new(0)
+    credited = Hash.new(0)
+    read = server.method(:read_stream)
+    server.define_singleton_method(:read_stream) do |stream_id, data, **opts|
+      delivered[stream_id] += data.bytesize
+      read.call(stream_id, data, **opts).tap { |n| credited[stream_id] += n }
+    end
+    server.on_flow_credit { |stream_id, bytes| credited[stream_id] += bytes }
+    [delivered, credited]
+  end
+
+  # Pumps until the response ends, sleeping while the write rate holds data
+  # back. Returns the seconds taken.
+  def until_finished(client, stream_id, server)
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    100.times do
+      yield
+      break if client.responses[stream_id]&.finished?
+
+      wake = server.next_write_time
+      flunk "stalled without a write time" unless wake
+      sleep([wake - Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond), 1].max / 1000.0)
+    end
+    assert client.responses[stream_id]&.finished?
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  end
+end
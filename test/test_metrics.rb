@@ -0,0 +1,74 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestMetrics < Minitest::Test
+  def setup
+    @metrics = Nghttp3::Metrics.new
+  end
+
+  def test_series_ids_are_stable
+    id = @metrics.series("/users/:id", "example.com")
+    assert_equal id, @metrics.series("/users/:id", "example.com")
+    refute_equal id, @metrics.series("/users/:id", "other.example")
+    assert_equal 2, @metrics.size
+  end
+
+  def test_records_requests_and_latency
+    id = @metrics.series("/", nil)
+    @metrics.start(id).start(id)
+    @metrics.finish(id, 200, 3_000)
+    @metrics.finish(id, 503, 20_000_000)
+
+    series = @metrics.snapshot.first
+    assert_equal "/", series[:route]
+    assert_equal "", series[:authority]
+    assert_equal 0, series[:in_flight]
+    assert_equal 1, series[:requests][:"2xx"]
+    assert_equal 1, series[:requests][:"5xx"]
+    assert_equal 2, series[:count]
+    assert_in_delta 20.003, series[:sum]
+    assert_equal [0.005, 1], series[:buckets][2]
+    assert_equal [Float::INFINITY, 2], series[:buckets].last
+  end
+
+  def test_cancel_and_reset
+    id = @metrics.series("/", nil)
+    @metrics.start(id)
+    @metrics.cancel(id)
+    @metrics.finish(id, 200, 10)
+    @metrics.reset
+    series = @metrics.snapshot.first
+    assert_equal 0, series[:in_flight]
+    assert_equal 0, series[:count]
+    assert_equal 1, @metrics.size
+  end
+
+  def test_prometheus_format
+    id = @metrics.series("/a\"b", "example.com")
+    @metrics.start(id)
+    @metrics.finish(id, 404, 1_500)
+    text = @metrics.to_prometheus
+    assert_includes text, "# TYPE nghttp3_requests_total counter\n"
+    assert_includes text, %(nghttp3_requests_total{route="/a\\"b",authority="example.com",status="4xx"} 1\n)
+    assert_includes text, %(nghttp3_request_duration_seconds_bucket{route="/a\\"b",authority="example.com",le="0.0025"} 1\n)
+    assert_includes text, %(nghttp3_request_duration_seconds_count{route="/a\\"b",authority="example.com"} 1\n)
+  end
+
+  def test_series_lookup_across_many_series
+    ids = Array.new(200) { |i| @metrics.series("/r#{i % 20}", "host#{i / 20}.example") }
+    assert_equal 200, @metrics.size
+    assert_equal ids, Array.new(200) { |i| @metrics.series("/r#{i % 20}", "host#{i / 20}.example") }
+    assert_equal 200, @metrics.size
+  end
+
+  def test_overflow_series
+    metrics = Nghttp3::Metrics.new(max_series: 1)
+    metrics.series("/a", nil)
+    other = metrics.series("/b", nil)
+    assert_equal other, metrics.series("/c", nil)
+    assert_equal "_other", metrics.snapshot.last[:route]
+    assert_raises(ArgumentError) { metrics.start(99) }
+    assert_raises(ArgumentError) { Nghttp3::Metrics.new(max_series: 0) }
+  end
+end
@@ -0,0 +1,135 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestRackAdapter < Minitest::Test
+  def request(path: "/items?page=2", body: nil, headers: {"user-agent" => "test", "content-type" => "text/plain"})
+    Nghttp3::Request.new(method: "POST", path: path, authority: "example.com:8443", headers: headers, body: body)
+  end
+
+  def run_app(adapter, req = request)
+    response = Nghttp3::Response.new(stream_id: 0)
+    adapter.call(req, response)
+    response
+  end
+
+  def test_builds_rack_env
+    env = nil
+    adapter = Nghttp3::RackAdapter.new(->(e) {
+      env = e.dup
+      env["HTTP_USER_AGENT"] = e["HTTP_USER_AGENT"]
+      env["rack.input.data"] = e["rack.input"].read
+      [200, {}, ["ok"]]
+    })
+    run_app(adapter, request(body: "payload"))
+
+    assert_equal "POST", env["REQUEST_METHOD"]
+    assert_equal "/items", env["PATH_INFO"]
+    assert_equal "page=2", env["QUERY_STRING"]
+    assert_equal "example.com", env["SERVER_NAME"]
+    assert_equal "8443", env["SERVER_PORT"]
+    assert_equal "HTTP/3", env["SERVER_PROTOCOL"]
+    assert_equal "https", env["rack.url_scheme"]
+    assert_equal "text/plain", env["CONTENT_TYPE"]
+    assert_equal "test", env["HTTP_USER_AGENT"]
+    assert_equal "payload", env["rack.input.data"]
+  end
+
+  def test_http_headers_materialize_on_access
+    adapter = Nghttp3::RackAdapter.new(->(env) {
+      refute env.key?("HTTP_USER_AGENT")
+      assert_equal "test", env["HTTP_USER_AGENT"]
+      assert env.key?("HTTP_USER_AGENT")
+      assert_nil env["HTTP_MISSING"]
+      refute env.key?("HTTP_MISSING")
+      [204, {}, []]
+    })
+    assert_equal 204, run_app(adapter).status
+  end
+
+  def test_eager_headers
+    adapter = Nghttp3::RackAdapter.new(->(env) {
+      assert env.key?("HTTP_USER_AGENT")
+      refute env.key?("HTTP_CONTENT_TYPE")
+      [200, {}, []]
+    }, lazy_headers: false)
+    run_app(adapter)
+  end
+
+  def test_reuses_env_across_requests
+    envs = []
+    adapter = Nghttp3::RackAdapter.new(->(env) {
+      envs << env
+      assert_nil env["nghttp3.stale"]
+      env["nghttp3.stale"] = true
+      [200, {}, ["ok"]]
+    })
+    run_app(adapter)
+    run_app(adapter)
+    assert_same envs[0], envs[1]
+  end
+
+  def test_reuse_env_can_be_disabled
+    envs = []
+    adapter = Nghttp3::RackAdapter.new(->(env) { envs << env and [200, {}, []] }, reuse_env: false)
+    run_app(adapter)
+    run_app(adapter)
+    refute_same envs[0], envs[1]
+  end
+
+  def test_array_body_and_headers
+    adapter = Nghttp3::RackAdapter.new(->(_env) {
+      [201, {"content-type" => "text/plain", "set-cookie" => ["a=1", "b=2"]}, ["hello"]]
+    })
+    response = run_app(adapter)
+    assert_equal 201, response.status
+    assert_equal "hello", response.body
+    cookies = response.to_nv_array.select { |nv| nv.name == "set-cookie" }.map(&:value)
+    assert_equal ["a=1", "b=2"], cookies
+  end
+
+  def test_streams_enumerable_body_and_closes_it
+    closed = false
+    body = Object.new
+    body.define_singleton_method(:each) { |&blk| %w[a b c].each(&blk) }
+    body.define_singleton_method(:close) { closed = true }
+    adapter = Nghttp3::RackAdapter.new(->(_env) { [200, {}, body] })
+
+    response = run_app(adapter)
+    assert response.streaming_body?
+    reader = Nghttp3::BodyReader.new(response.body)
+    chunks = []
+    while (chunk = reader.call)
+      chunks << chunk
+    end
+    assert_equal %w[a b c], chunks
+    assert closed
+  end
+
+  def test_closing_an_unread_streamed_body_closes_the_rack_body_once
+    closes = 0
+    body = Object.new
+    body.define_singleton_method(:each) { |&blk| %w[a b].each(&blk) }
+    body.define_singleton_method(:close) { closes += 1 }
+    adapter = Nghttp3::RackAdapter.new(->(_env) { [200, {}, body] })
+
+    streamed = run_app(adapter).body
+    streamed.close
+    streamed.close
+    assert_equal 1, closes
+  end
+
+  def test_streams_callable_body
+    body = ->(stream) {
+      stream.write("hello ")
+      stream << "world"
+      stream.close
+    }
+    adapter = Nghttp3::RackAdapter.new(->(_env) { [200, {}, body] })
+
+    reader = Nghttp3::BodyReader.new(run_app(adapter).body)
+    assert_equal "hello ", reader.call
+    assert_equal "world", reader.call
+    assert_nil reader.call
+  end
+end
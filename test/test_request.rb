@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "stringio"
 
 class TestRequest < Minitest::Test
   def test_new_creates_request
@@ -58,6 +59,14 @@ class TestRequest < Minitest::Test
     refute request.body?
   end
 
+  def test_io_body_is_streamed_without_copy
+    io = StringIO.new("data")
+    request = Nghttp3::Request.new(method: "POST", path: "/", body: io)
+    assert_same io, request.body
+    assert request.body?
+    assert request.streaming_body?
+  end
+
   def test_body_returns_false_for_empty_body
     request = Nghttp3::Request.new(method: "POST", path: "/", body: "")
     refute request.body?
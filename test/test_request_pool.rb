@@ -0,0 +1,81 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestRequestPool < Minitest::Test
+  def test_acquire_allocates_when_empty
+    pool = Nghttp3::RequestPool.new
+    request = pool.acquire_request
+    assert_kind_of Nghttp3::Request, request
+    refute request.frozen?
+    response = pool.acquire_response(4)
+    assert_equal 4, response.stream_id
+    assert_equal 2, pool.misses
+    assert_equal 0, pool.hits
+  end
+
+  def test_released_response_is_reset_and_reused
+    pool = Nghttp3::RequestPool.new
+    response = pool.acquire_response(0)
+    response.status = 200
+    response.headers["content-type"] = "text/plain"
+    response.write("chunk")
+    pool.release_response(response)
+
+    reused = pool.acquire_response(8)
+    assert_same response, reused
+    assert_equal 8, reused.stream_id
+    assert reused.pristine?
+    assert_equal({requests: 0, responses: 0, hits: 1, misses: 1, released: 1}, pool.stats)
+  end
+
+  def test_take_request_refills_pooled_request
+    pool = Nghttp3::RequestPool.new
+    conn = Nghttp3::Connection.server_new
+    conn.assemble_header(0, ":path", "/a")
+    conn.assemble_header(0, "x-first", "1")
+    first = conn.take_request(0, pool.acquire_request)
+    headers = first.headers
+    pool.release_request(first)
+
+    conn.assemble_header(4, ":path", "/b")
+    conn.assemble_header(4, "x-second", "2")
+    second = conn.take_request(4, pool.acquire_request)
+    assert_same first, second
+    assert_same headers, second.headers
+    assert_equal "/b", second.path
+    assert_equal({"x-second" => "2"}, second.headers.to_h)
+    refute second.frozen?
+  ensure
+    conn&.close
+  end
+
+  def test_frozen_requests_and_full_pool_are_not_kept
+    pool = Nghttp3::RequestPool.new(size: 1)
+    pool.release_request(Nghttp3::Request.new(method: "GET", path: "/"))
+    pool.release_response(Nghttp3::Response.new(stream_id: 0))
+    pool.release_response(Nghttp3::Response.new(stream_id: 4))
+    assert_equal 0, pool.stats[:requests]
+    assert_equal 1, pool.stats[:responses]
+    assert_raises(ArgumentError) { Nghttp3::RequestPool.new(size: 0) }
+  end
+
+  def test_debug_detects_use_after_release
+    pool = Nghttp3::RequestPool.new(debug: true)
+    assert pool.debug?
+    response = pool.acquire_response(0)
+    pool.release_response(response)
+    response.status = 500
+    error = assert_raises(Nghttp3::InvalidStateError) { pool.acquire_response(4) }
+    assert_match(/stream 0/, error.message)
+
+    conn = Nghttp3::Connection.server_new
+    conn.assemble_header(0, ":path", "/a")
+    request = conn.take_request(0, pool.acquire_request)
+    pool.release_request(request)
+    assert_nil request.path
+    assert_nil request.headers
+  ensure
+    conn&.close
+  end
+end
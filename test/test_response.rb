@@ -180,4 +180,26 @@ class TestResponse < Minitest::Test
     inspect_str = response.inspect
     assert_includes inspect_str, "finished"
   end
+
+  def test_to_nv_array_splits_multiline_values
+    response = Nghttp3::Response.new(stream_id: 0, status: 200, headers: {"set-cookie" => "a=1\nb=2"})
+    values = response.to_nv_array.select { |nv| nv.name == "set-cookie" }.map(&:value)
+    assert_equal ["a=1", "b=2"], values
+  end
+
+  def test_streaming_body
+    response = Nghttp3::Response.new(stream_id: 0, body: %w[a b])
+    assert response.streaming_body?
+    assert response.body?
+    refute Nghttp3::Response.new(stream_id: 0, body: "a").streaming_body?
+  end
+
+  def test_reset_returns_response_to_initial_state
+    response = Nghttp3::Response.new(stream_id: 0, status: 200, headers: {"a" => "1"}, body: "x")
+    response.write("chunk").finish
+    refute response.pristine?
+    assert_same response, response.reset(4)
+    assert_equal 4, response.stream_id
+    assert response.pristine?
+  end
 end
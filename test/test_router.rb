@@ -0,0 +1,72 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestRouter < Minitest::Test
+  def setup
+    @router = Nghttp3::Router.new
+  end
+
+  def test_static_routes
+    @router.add("GET", "/", :root)
+    @router.add("GET", "/about/team", :team)
+    assert_equal [:root, {}], @router.match("GET", "/")
+    assert_equal [:team, {}], @router.match("GET", "/about/team/")
+    assert_nil @router.match("GET", "/about")
+    assert_equal 2, @router.size
+  end
+
+  def test_param_captures_and_query
+    @router.add("GET", "/users/:id/posts/:post", :post)
+    assert_equal [:post, {"id" => "7", "post" => "9"}], @router.match("GET", "/users/7/posts/9?page=2")
+  end
+
+  def test_static_segments_win_over_params
+    @router.add("GET", "/users/:id", :user)
+    @router.add("GET", "/users/new", :new)
+    assert_equal :new, @router.match("GET", "/users/new")[0]
+    assert_equal :user, @router.match("GET", "/users/newer")[0]
+  end
+
+  def test_backtracks_to_param_when_static_branch_fails
+    @router.add("GET", "/a/b", :static)
+    @router.add("GET", "/a/:x/c", :param)
+    assert_equal [:param, {"x" => "b"}], @router.match("GET", "/a/b/c")
+  end
+
+  def test_wildcard_captures_rest_of_path
+    @router.add("GET", "/files/*path", :files)
+    assert_equal [:files, {"path" => "a/b.txt"}], @router.match("GET", "/files/a/b.txt")
+    assert_equal [:files, {"path" => ""}], @router.match("GET", "/files")
+  end
+
+  def test_method_matching
+    @router.add(:post, "/items", :create)
+    @router.add(nil, "/items", :any)
+    assert_equal :create, @router.match("POST", "/items")[0]
+    assert_equal :any, @router.match("DELETE", "/items")[0]
+  end
+
+  def test_authority_matching
+    @router.add("GET", "/", :api, "api.example.com")
+    @router.add("GET", "/", :default)
+    assert_equal :api, @router.match("GET", "/", "API.example.com")[0]
+    assert_equal :default, @router.match("GET", "/", "www.example.com")[0]
+    assert_equal :default, @router.match("GET", "/")[0]
+  end
+
+  def test_invalid_patterns
+    assert_raises(ArgumentError) { @router.add("GET", "users", :x) }
+    assert_raises(ArgumentError) { @router.add("GET", "/a/:", :x) }
+    assert_raises(ArgumentError) { @router.add("GET", "/*rest/more", :x) }
+    assert_raises(ArgumentError) { @router.add("GET", "/a?b", :x) }
+    assert_equal 0, @router.size
+  end
+
+  def test_handlers_survive_gc
+    @router.add("GET", "/x/:id", proc { |id| id })
+    GC.start
+    handler, params = @router.match("GET", "/x/1")
+    assert_equal "1", handler.call(params["id"])
+  end
+end
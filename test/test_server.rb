@@ -72,4 +72,204 @@ class TestServer < Minitest::Test
     server = Nghttp3::Server.new
     assert_kind_of Hash, server.responses
   end
+
+  def test_new_with_memory_budget
+    server = Nghttp3::Server.new(memory_budget: 1024 * 1024)
+    assert_equal 1024 * 1024, server.connection.memory_budget
+  end
+
+  def test_new_with_timeouts
+    server = Nghttp3::Server.new(timeouts: {header: 5_000, idle: 30_000})
+    assert_equal({header: 5_000, idle: 30_000, deadline: 0}, server.connection.stream_timeouts)
+  end
+
+  def test_new_with_admission_options
+    server = Nghttp3::Server.new(admission: {max_concurrency: 10})
+    assert_kind_of Nghttp3::AdmissionController, server.admission
+    assert_equal 10, server.admission.max_concurrency
+  end
+
+  def test_read_stream_requires_received_at_with_a_latency_target
+    server = Nghttp3::Server.new(admission: {latency_target: 5})
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+
+    assert_raises(ArgumentError) { server.read_stream(0, "") }
+    assert_kind_of Integer, server.read_stream(0, "", received_at: Nghttp3::AdmissionController.now)
+  end
+
+  def test_deferred_credit_reaches_the_flow_credit_handler
+    server = Nghttp3::Server.new(memory_budget: 4096)
+    credit = []
+    assert_same server, server.on_flow_credit { |stream_id, bytes| credit << [stream_id, bytes] }
+
+    server.send(:on_deferred_consume, 0, 1200)
+    assert_equal [[0, 1200]], credit
+  end
+
+  def test_rejected_streams_are_reported_for_reset
+    server = Nghttp3::Server.new(admission: {max_concurrency: 1})
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    rejected = []
+    assert_same server, server.on_reject { |stream_id, error_code| rejected << [stream_id, error_code] }
+
+    server.send(:on_begin_headers, 0)
+    server.send(:on_begin_headers, 4)
+    assert_equal [[4, Nghttp3::H3_REQUEST_REJECTED]], rejected
+
+    server.connection.reject_stream(8)
+    assert_equal [8, Nghttp3::H3_REQUEST_REJECTED], rejected.last
+  end
+
+  def test_new_with_shared_admission_controller
+    admission = Nghttp3::AdmissionController.new(max_concurrency: 10)
+    server = Nghttp3::Server.new(admission: admission)
+    assert_same admission, server.admission
+  end
+
+  def test_expire_timers_returns_expired_streams
+    server = Nghttp3::Server.new
+    now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+    server.connection.arm_timer(0, :header, 10, now)
+    assert_equal [], server.expire_timers(now + 5)
+    assert_equal [[0, :header]], server.expire_timers(now + 10)
+    assert_equal 0, server.connection.timer_count
+  end
+
+  def test_reset_allows_reuse
+    server = Nghttp3::Server.new
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    server.close
+    result = server.reset
+    assert_same server, result
+    refute server.closed?
+    refute server.streams_bound?
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    assert server.streams_bound?
+  end
+
+  def deliver_request(server, stream_id, method, path, body: nil)
+    server.send(:on_begin_headers, stream_id)
+    server.connection.assemble_header(stream_id, ":method", method)
+    server.connection.assemble_header(stream_id, ":path", path)
+    server.send(:on_end_headers, stream_id, body.nil?)
+    if body
+      server.connection.assemble_data(stream_id, body)
+      server.send(:on_end_stream, stream_id)
+    end
+    server.responses[stream_id]
+  end
+
+  def test_request_body_is_delivered_at_end_of_stream
+    server = Nghttp3::Server.new
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    received = []
+    server.on_request do |req, res|
+      received << req
+      res.status = 200
+    end
+
+    deliver_request(server, 0, "POST", "/echo", body: "payload")
+    server.send(:on_end_stream, 4)
+    assert_equal 1, received.size
+    assert_equal "payload", received[0].body
+    assert_same received[0], server.requests[0]
+  end
+
+  def test_pool_recycles_request_and_response_on_stream_close
+    server = Nghttp3::Server.new(pool: 8)
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    seen = []
+    server.on_request do |req, res|
+      seen << [req, res]
+      res.status = 200
+    end
+
+    deliver_request(server, 0, "GET", "/a")
+    server.send(:on_stream_close, 0, 0)
+    assert_empty server.requests
+    assert_empty server.responses
+    deliver_request(server, 4, "GET", "/b")
+    assert_same seen[0][0], seen[1][0]
+    assert_same seen[0][1], seen[1][1]
+    assert_equal "/b", server.requests[4].path
+    assert_equal 2, server.pool.hits
+  end
+
+  def test_route_dispatches_with_params
+    server = Nghttp3::Server.new
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    result = server.route(:get, "/users/:id") do |_req, res, params|
+      res.status = 200
+      res.body = params["id"]
+    end
+    server.on_request { |_req, res| res.status = 418 }
+    assert_same server, result
+
+    assert_equal "42", deliver_request(server, 0, "GET", "/users/42").body
+    assert_equal 418, deliver_request(server, 4, "POST", "/users/42").status
+  end
+
+  def test_unrouted_request_without_handler_is_not_found
+    server = Nghttp3::Server.new
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    server.route("GET", "/") { |_req, res| res.status = 200 }
+    assert_equal 404, deliver_request(server, 0, "GET", "/missing").status
+  end
+
+  def test_streamed_bodies_are_closed_when_their_stream_ends
+    server = Nghttp3::Server.new
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    bodies = {}
+    server.on_request do |req, res|
+      res.status = 200
+      res.body = bodies[req.path] = StringIO.new("never read")
+    end
+
+    deliver_request(server, 0, "GET", "/reset")
+    deliver_request(server, 4, "GET", "/open")
+    server.send(:on_stream_close, 0, 0x10c)
+    assert bodies["/reset"].closed?
+    refute bodies["/open"].closed?
+
+    server.close
+    assert bodies["/open"].closed?
+  end
+
+  def test_metrics_per_route_and_endpoint
+    server = Nghttp3::Server.new(metrics: true)
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    server.route(:get, "/users/:id") { |_req, res, _params| res.status = 200 }
+
+    deliver_request(server, 0, "GET", "/users/1")
+    assert_equal 1, server.metrics.snapshot.first[:in_flight]
+    server.send(:on_stream_close, 0, 0)
+
+    series = server.metrics.snapshot.first
+    assert_equal "/users/:id", series[:route]
+    assert_equal 0, series[:in_flight]
+    assert_equal 1, series[:requests][:"2xx"]
+
+    response = deliver_request(server, 4, "GET", "/metrics")
+    assert_equal 200, response.status
+    assert_equal Nghttp3::Server::METRICS_CONTENT_TYPE, response.headers["content-type"]
+    assert_includes response.body, %(route="/users/:id")
+    assert_equal 1, server.metrics.size
+  end
+
+  def test_metrics_count_requests_in_flight_during_the_handler
+    server = Nghttp3::Server.new(metrics: true)
+    server.bind_streams(control: 3, qpack_encoder: 7, qpack_decoder: 11)
+    in_flight = nil
+    server.route(:get, "/slow") do |_req, _res, _params|
+      in_flight = server.metrics.snapshot.first[:in_flight]
+      raise "handler failed"
+    end
+
+    assert_raises(RuntimeError) { deliver_request(server, 0, "GET", "/slow") }
+    assert_equal 1, in_flight
+
+    # The failed request is still balanced when its stream closes
+    server.send(:on_stream_close, 0, 0)
+    assert_equal 0, server.metrics.snapshot.first[:in_flight]
+  end
 end
@@ -137,4 +137,14 @@ class TestStreamManager < Minitest::Test
     refute manager.unidirectional?(0)
     refute manager.unidirectional?(1)
   end
+
+  def test_reset_clears_streams_and_restarts_ids
+    manager = Nghttp3::StreamManager.new(is_server: false)
+    manager.allocate_bidi_stream_id
+    manager.allocate_uni_stream_id
+    manager.reset
+    assert_empty manager.active_stream_ids
+    assert_equal 0, manager.allocate_bidi_stream_id
+    assert_equal 2, manager.allocate_uni_stream_id
+  end
 end
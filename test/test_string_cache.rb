@@ -0,0 +1,68 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestStringCache < Minitest::Test
+  def setup
+    @capacity = Nghttp3::StringCache.capacity
+    @admit_after = Nghttp3::StringCache.admit_after
+    Nghttp3::StringCache.clear
+  end
+
+  def teardown
+    Nghttp3::StringCache.capacity = @capacity
+    Nghttp3::StringCache.admit_after = @admit_after
+  end
+
+  def test_value_is_shared_after_admission
+    Nghttp3::StringCache.admit_after = 3
+    first = Array.new(3) { Nghttp3::StringCache.lookup("application/json") }
+    assert(first.all?(&:frozen?))
+    assert_equal Encoding::BINARY, first[0].encoding
+    refute_same first[0], first[1]
+
+    assert_same first[2], Nghttp3::StringCache.lookup("application/json")
+    stats = Nghttp3::StringCache.stats
+    assert_equal 1, stats[:size]
+    assert_equal 1, stats[:hits]
+    assert_equal 3, stats[:misses]
+    assert_equal 1, stats[:admitted]
+  end
+
+  def test_long_values_are_not_cached
+    Nghttp3::StringCache.admit_after = 1
+    value = "x" * (Nghttp3::StringCache::MAX_LENGTH + 1)
+    refute_same Nghttp3::StringCache.lookup(value), Nghttp3::StringCache.lookup(value)
+    assert_equal 0, Nghttp3::StringCache.stats[:size]
+  end
+
+  def test_colliding_value_evicts_after_admission
+    Nghttp3::StringCache.capacity = 1
+    Nghttp3::StringCache.admit_after = 2
+    2.times { Nghttp3::StringCache.lookup("gzip") }
+    2.times { Nghttp3::StringCache.lookup("no-cache") }
+    stats = Nghttp3::StringCache.stats
+    assert_equal 1, stats[:capacity]
+    assert_equal 1, stats[:evicted]
+    assert_same Nghttp3::StringCache.lookup("no-cache"), Nghttp3::StringCache.lookup("no-cache")
+  end
+
+  def test_capacity_is_rounded_to_power_of_two
+    Nghttp3::StringCache.capacity = 100
+    assert_equal 128, Nghttp3::StringCache.capacity
+    assert_raises(ArgumentError) { Nghttp3::StringCache.capacity = 0 }
+    assert_raises(ArgumentError) { Nghttp3::StringCache.admit_after = 0 }
+  end
+
+  def test_assembled_header_values_use_cache
+    Nghttp3::StringCache.admit_after = 1
+    conn = Nghttp3::Connection.server_new
+    conn.assemble_header(0, "accept-encoding", "gzip")
+    conn.assemble_header(4, "accept-encoding", "gzip")
+    first = conn.take_request(0).headers["accept-encoding"]
+    assert first.frozen?
+    assert_same first, conn.take_request(4).headers["accept-encoding"]
+  ensure
+    conn&.close
+  end
+end